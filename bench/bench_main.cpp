@@ -0,0 +1,485 @@
+#include "common.h"
+#include "black_sheet.h"
+#include "black_import.h"
+#include "black_snapshot.h"
+#include "black_journal.h"
+#include "black_kernels.h"
+#include "workload.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Counts every allocation of the process, so the benchmarks can report
+// allocations per op.
+namespace {
+  std::atomic<uint64_t> allocations = 0;
+
+  void* Allocate(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) {
+      return ptr;
+    }
+    throw std::bad_alloc();
+  }
+}
+
+void* operator new(std::size_t size) {
+  return Allocate(size);
+}
+
+void* operator new[](std::size_t size) {
+  return Allocate(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(size ? size : 1);
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+
+  struct BenchmarkResult {
+    std::string name;
+    int iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    long peak_rss_kb; // of the whole process so far
+  };
+
+  struct Options {
+    bool json = false;
+    std::string filter;
+  };
+
+  Options options;
+  std::vector<BenchmarkResult> results;
+
+  volatile double g_sink;
+
+  // Keeps the computation of a value the benchmark doesn't use.
+  void DoNotOptimize(double value) {
+    g_sink = value;
+  }
+
+  long PeakRssKb() {
+#ifdef _WIN32
+    return 0;
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+  }
+
+  // Runs op(state, i) `iterations` times on the state built by setup() and
+  // reports the mean time and number of allocations of a single op. Setup and
+  // the state destruction are not measured.
+  template <typename Setup, typename Op>
+  void RunBenchmark(const std::string& name, int iterations, Setup&& setup, Op&& op) {
+    if (name.find(options.filter) == std::string::npos) {
+      return;
+    }
+
+    auto state = setup();
+
+    const auto start_allocations = allocations.load();
+    const auto start = Clock::now();
+    for (int i = 0; i < iterations; ++i) {
+      op(*state, i);
+    }
+    const auto elapsed = Clock::now() - start;
+    const auto op_allocations = allocations.load() - start_allocations;
+
+    BenchmarkResult result{
+      name, iterations,
+      double(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / iterations,
+      double(op_allocations) / iterations,
+      PeakRssKb()
+    };
+    if (!options.json) {
+      std::cout << result.name << ": " << int64_t(result.ns_per_op) << " ns/op, "
+                << result.allocs_per_op << " allocs/op, peak RSS " << result.peak_rss_kb << " KiB"
+                << std::endl;
+    }
+    results.push_back(std::move(result));
+  }
+
+  void PrintJson(std::ostream& output) {
+    output << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+      const auto& result = results[i];
+      output << "  {\"name\": \"" << result.name << "\", \"iterations\": " << result.iterations
+             << ", \"ns_per_op\": " << result.ns_per_op << ", \"allocs_per_op\": " << result.allocs_per_op
+             << ", \"peak_rss_kb\": " << result.peak_rss_kb << "}" << (i + 1 < results.size() ? "," : "")
+             << '\n';
+    }
+    output << "]\n";
+  }
+
+  std::unique_ptr<Black::Sheet> MakeSheet(Workload::Shape shape, int rows, int cols) {
+    Workload::Options options;
+    options.shape = shape;
+    options.rows = rows;
+    options.cols = cols;
+
+    auto sheet = std::make_unique<Black::Sheet>();
+    Workload::Fill(*sheet, options);
+    return sheet;
+  }
+
+  // Text, numbers and formulas over the rows above.
+  std::unique_ptr<Black::Sheet> MakeLargeSheet() {
+    return MakeSheet(Workload::Shape::Mixed, 1024, 1024);
+  }
+
+  void BenchPosition() {
+    struct Positions {
+      std::vector<Position> positions;
+      std::vector<std::string> names;
+    };
+    auto setup = [] {
+      auto state = std::make_unique<Positions>();
+      for (int i = 0; i < 4096; ++i) {
+        const Position pos{(i * 7919) % Position::kMaxRows, (i * 104729) % Position::kMaxCols};
+        state->positions.push_back(pos);
+        state->names.push_back(pos.ToString());
+      }
+      return state;
+    };
+    RunBenchmark("Position::ToString", 1'000'000, setup,
+      [] (Positions& state, int i) { state.positions[i % state.positions.size()].ToString(); }
+    );
+    RunBenchmark("Position::FromString", 1'000'000, setup,
+      [] (Positions& state, int i) { Position::FromString(state.names[i % state.names.size()]); }
+    );
+  }
+
+  void BenchParseFormula() {
+    RunBenchmark("ParseFormula", 100'000,
+      [] { return std::make_unique<std::string>("(A1+B2)*-C3/4.5-(D5+E6)/ZZ100"); },
+      [] (std::string& expression, int) { ParseFormula(expression); }
+    );
+  }
+
+  void BenchRecalculation() {
+    constexpr int kLength = 10'000;
+    RunBenchmark("Recalculate/chain of 10k", 100,
+      [] { return MakeSheet(Workload::Shape::Chain, kLength, 1); },
+      [] (Black::Sheet& sheet, int i) {
+        sheet.SetCell({0, 0}, std::to_string(i));
+        sheet.GetCell({kLength - 1, 0})->GetValue();
+      }
+    );
+    RunBenchmark("Recalculate/fan-out of 10k", 100,
+      [] { return MakeSheet(Workload::Shape::FanOut, kLength, 1); },
+      [] (Black::Sheet& sheet, int i) {
+        sheet.SetCell({0, 0}, std::to_string(i));
+        for (int row = 0; row < kLength; ++row) {
+          sheet.GetCell({row, 1})->GetValue();
+        }
+      }
+    );
+    RunBenchmark("Recalculate/DAG 100x100", 100,
+      [] { return MakeSheet(Workload::Shape::Dag, 100, 100); },
+      [] (Black::Sheet& sheet, int i) {
+        sheet.SetCell({0, i % 100}, std::to_string(i));
+        for (int col = 0; col < 100; ++col) {
+          sheet.GetCell({99, col})->GetValue();
+        }
+      }
+    );
+    RunBenchmark("InvalidateCache/hub of 10k", 100'000,
+      [] {
+        auto sheet = MakeSheet(Workload::Shape::FanOut, kLength, 1);
+        for (int row = 0; row < kLength; ++row) {
+          sheet->GetCell({row, 1})->GetValue();
+        }
+        return sheet;
+      },
+      [] (Black::Sheet& sheet, int i) { sheet.SetCell({0, 0}, std::to_string(i)); }
+    );
+  }
+
+  void BenchCycleCheck() {
+    constexpr int kLength = 10'000;
+    RunBenchmark("CycleCheck/chain of 10k", 1000,
+      [] { return MakeSheet(Workload::Shape::Chain, kLength, 1); },
+      [] (Black::Sheet& sheet, int i) {
+        sheet.SetCell({0, 1}, "=" + Position{kLength - 1, 0}.ToString() + (i % 2 ? "+1" : "+2"));
+      }
+    );
+  }
+
+  // The kernels of every instruction set the CPU has, against the scalar ones.
+  void BenchAggregates() {
+    using namespace Black::Kernels;
+    auto setup = [] {
+      auto values = std::make_unique<std::vector<double>>(1'000'000);
+      for (size_t i = 0; i < values->size(); ++i) {
+        (*values)[i] = std::sin(double(i));
+      }
+      return values;
+    };
+    for (auto isa : {Isa::Scalar, Isa::Sse2, Isa::Avx2}) {
+      if (!IsSupported(isa)) {
+        continue;
+      }
+      const auto& kernels = GetKernels(isa);
+      const std::string suffix = std::string("/") + GetIsaName(isa) + "/1M values";
+      RunBenchmark("Kernels::Sum" + suffix, 100, setup,
+        [&] (std::vector<double>& values, int) {
+          SumState state;
+          kernels.sum(values.data(), values.size(), state);
+          DoNotOptimize(state.Total());
+        }
+      );
+      RunBenchmark("Kernels::SumProducts" + suffix, 100, setup,
+        [&] (std::vector<double>& values, int) {
+          SumState state;
+          kernels.sum_products(values.data(), values.data(), values.size(), state);
+          DoNotOptimize(state.Total());
+        }
+      );
+      RunBenchmark("Kernels::Max" + suffix, 100, setup,
+        [&] (std::vector<double>& values, int) { DoNotOptimize(kernels.max(values.data(), values.size(), 0)); }
+      );
+    }
+
+    constexpr int kRows = 10'000;
+    constexpr int kCols = 10;
+    const std::string last_row = std::to_string(kRows);
+    for (std::string formula : {"SUM(A1:J" + last_row + ")", "MAX(A1:J" + last_row + ")",
+                                "SUMPRODUCT(A1:E" + last_row + ",F1:J" + last_row + ")"}) {
+      const auto function = formula.substr(0, formula.find('('));
+      RunBenchmark("Recalculate/" + function + " over 100k cells", 100,
+        [&] {
+          auto sheet = std::make_unique<Black::Sheet>();
+          for (int row = 0; row < kRows; ++row) {
+            for (int col = 0; col < kCols; ++col) {
+              sheet->SetCell({row, col}, std::to_string((row + col) % 100));
+            }
+          }
+          sheet->SetCell({0, kCols}, "=" + formula);
+          sheet->GetCell({0, kCols})->GetValue(); // the first read scans the range
+          return sheet;
+        },
+        [] (Black::Sheet& sheet, int i) {
+          sheet.SetCell({i * 997 % kRows, i % kCols}, std::to_string(i));
+          sheet.GetCell({0, kCols})->GetValue();
+        }
+      );
+    }
+  }
+
+  void BenchLookups() {
+    constexpr int kRows = 10'000;
+    constexpr int kLookups = 1000;
+    for (std::string match : {"0", "1"}) {
+      RunBenchmark("Recalculate/" + std::to_string(kLookups) + " VLOOKUP(..." + match + ") into 10k rows", 100,
+        [&] {
+          auto sheet = std::make_unique<Black::Sheet>();
+          for (int row = 0; row < kRows; ++row) {
+            sheet->SetCell({row, 0}, std::to_string(row * 3 % kRows));
+            sheet->SetCell({row, 1}, std::to_string(row));
+          }
+          for (int row = 0; row < kLookups; ++row) {
+            sheet->SetCell({row, 3}, "=VLOOKUP(" + std::to_string(row * 7) + ",A1:B" + std::to_string(kRows)
+                                     + ",2," + match + ")");
+            sheet->GetCell({row, 3})->GetValue();
+          }
+          return sheet;
+        },
+        [] (Black::Sheet& sheet, int i) {
+          sheet.SetCell({i * 997 % kRows, 0}, std::to_string(i % kRows));
+          for (int row = 0; row < kLookups; ++row) {
+            sheet.GetCell({row, 3})->GetValue();
+          }
+        }
+      );
+    }
+  }
+
+  void BenchConditionals() {
+    constexpr int kRows = 1000;
+    // G1 selects the cheap branch, the other one reads an expensive formula
+    // invalidated by every edit.
+    const std::vector<std::pair<std::string, std::string>> variants = {
+      {"IF(G1>0,A,E)", "=IF(G1>0,A{},E{})"},
+      {"G1*A+(1-G1)*E", "=G1*A{}+(1-G1)*E{}"},
+    };
+    for (const auto& [name, pattern] : variants) {
+      RunBenchmark("Recalculate/" + std::to_string(kRows) + " " + name + ", E untaken SUMPRODUCT", 100,
+        [&] {
+          auto sheet = std::make_unique<Black::Sheet>();
+          sheet->SetCell({0, 6}, "1");
+          const std::string range = "A1:A" + std::to_string(kRows);
+          for (int row = 0; row < kRows; ++row) {
+            const auto ref = std::to_string(row + 1);
+            std::string formula = pattern;
+            for (size_t at; (at = formula.find("{}")) != std::string::npos; ) {
+              formula.replace(at, 2, ref);
+            }
+            sheet->SetCell({row, 0}, std::to_string(row));
+            sheet->SetCell({row, 4}, "=SUMPRODUCT(" + range + "," + range + ")");
+            sheet->SetCell({row, 3}, formula);
+          }
+          return sheet;
+        },
+        [] (Black::Sheet& sheet, int i) {
+          sheet.SetCell({i % kRows, 0}, std::to_string(i));
+          for (int row = 0; row < kRows; ++row) {
+            sheet.GetCell({row, 3})->GetValue();
+          }
+        }
+      );
+    }
+  }
+
+  void BenchStructuralChanges() {
+    RunBenchmark("InsertRows(1)/1M cells", 100,
+      [] { return MakeLargeSheet(); },
+      [] (Black::Sheet& sheet, int) { sheet.InsertRows(1); }
+    );
+    RunBenchmark("DeleteRows(1)/1M cells", 100,
+      [] { return MakeLargeSheet(); },
+      [] (Black::Sheet& sheet, int) { sheet.DeleteRows(1); }
+    );
+    RunBenchmark("DeleteCols(1)/1M cells", 100,
+      [] { return MakeLargeSheet(); },
+      [] (Black::Sheet& sheet, int) { sheet.DeleteCols(1); }
+    );
+  }
+
+  void BenchPrint() {
+    std::ostringstream output;
+    RunBenchmark("PrintValues/1M cells", 5,
+      [] { return MakeLargeSheet(); },
+      [&] (Black::Sheet& sheet, int) { output.str({}); sheet.PrintValues(output); }
+    );
+    RunBenchmark("PrintTexts/1M cells", 5,
+      [] { return MakeLargeSheet(); },
+      [&] (Black::Sheet& sheet, int) { output.str({}); sheet.PrintTexts(output); }
+    );
+    RunBenchmark("PrintValues(parallel)/1M cells", 5,
+      [] { return MakeLargeSheet(); },
+      [&] (Black::Sheet& sheet, int) { output.str({}); sheet.PrintValues(output, Black::ExportOptions{}); }
+    );
+  }
+
+  void BenchMemoryUsage() {
+    RunBenchmark("MemoryUsage/1M cells", 10,
+      [] { return MakeLargeSheet(); },
+      [] (Black::Sheet& sheet, int) { sheet.MemoryUsage(); }
+    );
+  }
+
+  void BenchImport() {
+    RunBenchmark("ImportTsv/1M cells", 1,
+      [] {
+        std::ostringstream texts;
+        MakeLargeSheet()->PrintTexts(texts);
+        return std::make_unique<std::string>(texts.str());
+      },
+      [&] (const std::string& data, int) {
+        std::istringstream input(data);
+        Black::Sheet sheet;
+        Black::ImportTsv(input, sheet);
+      }
+    );
+  }
+
+  void BenchSnapshot() {
+    const auto path = std::filesystem::temp_directory_path() / "spreadsheet_bench_snapshot.bin";
+    RunBenchmark("SaveSnapshot/1M cells", 1,
+      [] { return MakeLargeSheet(); },
+      [&] (Black::Sheet& sheet, int) { Black::SaveSnapshot(sheet, path); }
+    );
+    RunBenchmark("LoadSnapshot/1M cells", 1,
+      [] { return std::make_unique<Black::Sheet>(); },
+      [&] (Black::Sheet& sheet, int) { Black::LoadSnapshot(path, sheet); }
+    );
+    std::filesystem::remove(path);
+  }
+
+  void BenchJournal() {
+    const auto dir = std::filesystem::temp_directory_path() / "spreadsheet_bench_journal";
+    std::filesystem::remove_all(dir);
+    RunBenchmark("JournaledSheet::SetCell", 1'000'000,
+      [&] { return std::make_unique<Black::JournaledSheet>(dir); },
+      [] (Black::JournaledSheet& sheet, int i) { sheet.SetCell({i % 1000, i / 1000}, std::to_string(i)); }
+    );
+    std::filesystem::remove_all(dir);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg == "--json") {
+      options.json = true;
+    } else if (arg == "--filter" && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--json] [--filter <substring>]" << std::endl;
+      return 2;
+    }
+  }
+
+  BenchPosition();
+  BenchParseFormula();
+  BenchRecalculation();
+  BenchCycleCheck();
+  BenchAggregates();
+  BenchLookups();
+  BenchConditionals();
+  BenchStructuralChanges();
+  BenchPrint();
+  BenchMemoryUsage();
+  BenchImport();
+  BenchSnapshot();
+  BenchJournal();
+
+  if (options.json) {
+    PrintJson(std::cout);
+  }
+  return 0;
+}
@@ -0,0 +1,89 @@
+#include "black_sheet.h"
+#include "workload.h"
+
+#include <iostream>
+#include <string>
+#include <string_view>
+
+// Writes a synthetic sheet to stdout, either as TSV (the PrintTexts format,
+// see Black::ImportTsv) or as a JSONL log of "set" operations for
+// spreadsheet_replay.
+
+namespace {
+  void PrintUsage(const char* program) {
+    std::cerr << "usage: " << program
+              << " --shape grid|filldown|chain|fanout|fanin|dag|mixed"
+                 " [--rows N] [--cols N] [--seed N] [--refs N] [--format tsv|jsonl]\n"
+                 "rows and cols must fit a sheet, cols is ignored by chain, fanout and fanin" << std::endl;
+  }
+
+  void WriteJsonString(std::ostream& output, std::string_view str) {
+    output << '"';
+    for (char c : str) {
+      switch (c) {
+        case '"': output << "\\\""; break;
+        case '\\': output << "\\\\"; break;
+        case '\n': output << "\\n"; break;
+        case '\t': output << "\\t"; break;
+        case '\r': output << "\\r"; break;
+        default: output << c; break;
+      }
+    }
+    output << '"';
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Workload::Options options;
+  std::string format = "tsv";
+  bool has_shape = false;
+
+  try {
+    for (int i = 1; i + 1 < argc; i += 2) {
+      const std::string_view arg = argv[i];
+      const std::string value = argv[i + 1];
+      if (arg == "--shape") {
+        const auto shape = Workload::ParseShape(value);
+        if (!shape) {
+          throw std::invalid_argument("unknown shape " + value);
+        }
+        options.shape = *shape;
+        has_shape = true;
+      } else if (arg == "--rows") {
+        options.rows = std::stoi(value);
+      } else if (arg == "--cols") {
+        options.cols = std::stoi(value);
+      } else if (arg == "--seed") {
+        options.seed = std::stoull(value);
+      } else if (arg == "--refs") {
+        options.refs = std::stoi(value);
+      } else if (arg == "--format" && (value == "tsv" || value == "jsonl")) {
+        format = value;
+      } else {
+        throw std::invalid_argument("unexpected argument " + std::string(arg));
+      }
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    PrintUsage(argv[0]);
+    return 2;
+  }
+  if (!has_shape || argc % 2 == 0 || !Workload::IsValid(options)) {
+    PrintUsage(argv[0]);
+    return 2;
+  }
+
+  std::ios::sync_with_stdio(false);
+  if (format == "jsonl") {
+    Workload::Generate(options, [] (Position pos, std::string text) {
+      std::cout << "{\"op\": \"set\", \"cell\": \"" << pos.ToString() << "\", \"text\": ";
+      WriteJsonString(std::cout, text);
+      std::cout << "}\n";
+    });
+  } else {
+    Black::Sheet sheet;
+    Workload::Fill(sheet, options);
+    sheet.PrintTexts(std::cout);
+  }
+  return 0;
+}
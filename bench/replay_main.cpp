@@ -0,0 +1,290 @@
+#include "common.h"
+#include "black_sheet.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Replays a JSONL log of sheet operations, one flat JSON object per line:
+//   {"op": "set", "cell": "A1", "text": "=B2+1"}
+//   {"op": "clear", "cell": "A1"}
+//   {"op": "insert_rows", "before": 3, "count": 1}   (also insert_cols)
+//   {"op": "delete_rows", "first": 3, "count": 1}    (also delete_cols)
+//   {"op": "get", "cell": "A1"}
+//   {"op": "print", "what": "values"}                (or "texts")
+// and reports latency percentiles per operation and the total throughput.
+// Failed operations (e.g. a circular reference) are timed and counted too.
+// With --trace <file> the recalculations are also written to a Chrome trace,
+// --profile <count> reports the formulas taking the most evaluation time.
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+
+  // Fields of a flat JSON object: strings unescaped, numbers as written.
+  class JsonObject {
+    std::map<std::string, std::string, std::less<>> fields_;
+
+    static void SkipSpaces(std::string_view& str) {
+      while (!str.empty() && std::isspace(static_cast<unsigned char>(str.front()))) {
+        str.remove_prefix(1);
+      }
+    }
+
+    static void Expect(std::string_view& str, char c) {
+      SkipSpaces(str);
+      if (str.empty() || str.front() != c) {
+        throw std::invalid_argument(std::string("expected '") + c + "'");
+      }
+      str.remove_prefix(1);
+    }
+
+    static std::string ParseString(std::string_view& str) {
+      Expect(str, '"');
+      std::string result;
+      while (!str.empty() && str.front() != '"') {
+        char c = str.front();
+        str.remove_prefix(1);
+        if (c == '\\' && !str.empty()) {
+          c = str.front();
+          str.remove_prefix(1);
+          switch (c) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'u': {
+              if (str.size() < 4) {
+                throw std::invalid_argument("bad \\u escape");
+              }
+              const auto code = std::stoul(std::string(str.substr(0, 4)), nullptr, 16);
+              str.remove_prefix(4);
+              if (code < 0x80) {
+                c = char(code);
+              } else if (code < 0x800) {
+                result += char(0xC0 | (code >> 6));
+                c = char(0x80 | (code & 0x3F));
+              } else {
+                result += char(0xE0 | (code >> 12));
+                result += char(0x80 | ((code >> 6) & 0x3F));
+                c = char(0x80 | (code & 0x3F));
+              }
+              break;
+            }
+            default: break; // '"', '\\', '/'
+          }
+        }
+        result += c;
+      }
+      Expect(str, '"');
+      return result;
+    }
+
+  public:
+    explicit JsonObject(std::string_view str) {
+      Expect(str, '{');
+      SkipSpaces(str);
+      if (!str.empty() && str.front() == '}') {
+        return;
+      }
+      while (true) {
+        auto key = ParseString(str);
+        Expect(str, ':');
+        SkipSpaces(str);
+        std::string value;
+        if (!str.empty() && str.front() == '"') {
+          value = ParseString(str);
+        } else {
+          const auto end = str.find_first_of(",} \t\r\n");
+          value = std::string(str.substr(0, end));
+          str.remove_prefix(std::min(end, str.size()));
+        }
+        fields_[std::move(key)] = std::move(value);
+
+        SkipSpaces(str);
+        if (!str.empty() && str.front() == ',') {
+          str.remove_prefix(1);
+          continue;
+        }
+        Expect(str, '}');
+        return;
+      }
+    }
+
+    const std::string& Get(std::string_view key) const {
+      auto it = fields_.find(key);
+      if (it == fields_.end()) {
+        throw std::invalid_argument("missing \"" + std::string(key) + "\"");
+      }
+      return it->second;
+    }
+
+    int GetInt(std::string_view key, std::optional<int> default_value = std::nullopt) const {
+      if (default_value && !fields_.count(key)) {
+        return *default_value;
+      }
+      return std::stoi(Get(key));
+    }
+
+    Position GetPosition(std::string_view key) const {
+      return Position::FromString(Get(key));
+    }
+  };
+
+  struct OpStats {
+    std::vector<int64_t> latencies; // ns
+    size_t errors = 0;
+
+    int64_t Percentile(double p) {
+      const size_t index = std::min(latencies.size() - 1, size_t(p * latencies.size()));
+      std::nth_element(latencies.begin(), latencies.begin() + index, latencies.end());
+      return latencies[index];
+    }
+  };
+
+  void Apply(ISheet& sheet, const JsonObject& op, std::ostringstream& sink) {
+    const auto& name = op.Get("op");
+    if (name == "set") {
+      sheet.SetCell(op.GetPosition("cell"), op.Get("text"));
+    } else if (name == "clear") {
+      sheet.ClearCell(op.GetPosition("cell"));
+    } else if (name == "insert_rows") {
+      sheet.InsertRows(op.GetInt("before"), op.GetInt("count", 1));
+    } else if (name == "insert_cols") {
+      sheet.InsertCols(op.GetInt("before"), op.GetInt("count", 1));
+    } else if (name == "delete_rows") {
+      sheet.DeleteRows(op.GetInt("first"), op.GetInt("count", 1));
+    } else if (name == "delete_cols") {
+      sheet.DeleteCols(op.GetInt("first"), op.GetInt("count", 1));
+    } else if (name == "get") {
+      if (const auto* cell = sheet.GetCell(op.GetPosition("cell"))) {
+        cell->GetValue();
+      }
+    } else if (name == "print") {
+      sink.str({});
+      if (op.Get("what") == "texts") {
+        sheet.PrintTexts(sink);
+      } else {
+        sheet.PrintValues(sink);
+      }
+    } else {
+      throw std::invalid_argument("unknown op \"" + name + "\"");
+    }
+  }
+
+  struct ReplayOptions {
+    const char* trace_path = nullptr;
+    int profile_count = 0;
+  };
+
+  int Replay(std::istream& input, const ReplayOptions& options) {
+    Black::Sheet sheet;
+    Black::Tracer tracer;
+    if (options.trace_path) {
+      sheet.SetTracer(&tracer);
+    }
+    Black::Profiler profiler;
+    if (options.profile_count > 0) {
+      sheet.SetProfiler(&profiler);
+    }
+    std::ostringstream sink;
+    std::map<std::string, OpStats> stats;
+
+    std::string line;
+    size_t line_number = 0;
+    Clock::duration total{};
+    while (std::getline(input, line)) {
+      ++line_number;
+      if (line.find_first_not_of(" \t\r") == std::string::npos) {
+        continue;
+      }
+
+      std::optional<JsonObject> op;
+      try {
+        op.emplace(line);
+        op->Get("op");
+      } catch (const std::exception& e) {
+        std::cerr << "line " << line_number << ": " << e.what() << std::endl;
+        return 1;
+      }
+
+      auto& op_stats = stats[op->Get("op")];
+      const auto start = Clock::now();
+      try {
+        Apply(sheet, *op, sink);
+      } catch (const std::invalid_argument& e) {
+        std::cerr << "line " << line_number << ": " << e.what() << std::endl;
+        return 1;
+      } catch (const std::exception&) {
+        ++op_stats.errors;
+      }
+      const auto elapsed = Clock::now() - start;
+      total += elapsed;
+      op_stats.latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    size_t ops = 0;
+    std::cout << std::left << std::setw(12) << "op" << std::right
+              << std::setw(10) << "count" << std::setw(8) << "errors"
+              << std::setw(12) << "p50 ns" << std::setw(12) << "p99 ns" << std::setw(14) << "max ns" << '\n';
+    for (auto& [name, op_stats] : stats) {
+      ops += op_stats.latencies.size();
+      std::cout << std::left << std::setw(12) << name << std::right
+                << std::setw(10) << op_stats.latencies.size() << std::setw(8) << op_stats.errors
+                << std::setw(12) << op_stats.Percentile(0.5) << std::setw(12) << op_stats.Percentile(0.99)
+                << std::setw(14) << *std::max_element(op_stats.latencies.begin(), op_stats.latencies.end())
+                << '\n';
+    }
+
+    const double seconds = std::chrono::duration<double>(total).count();
+    std::cout << "total: " << ops << " ops in " << seconds << " s, "
+              << (seconds > 0 ? ops / seconds : 0) << " ops/s" << std::endl;
+    if (options.trace_path) {
+      tracer.Save(options.trace_path);
+    }
+    if (options.profile_count > 0) {
+      std::cout << '\n';
+      profiler.WriteReport(std::cout, sheet, options.profile_count);
+    }
+    return 0;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  ReplayOptions options;
+  const char* log_path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg == "--trace" && i + 1 < argc) {
+      options.trace_path = argv[++i];
+    } else if (arg == "--profile" && i + 1 < argc) {
+      options.profile_count = std::atoi(argv[++i]);
+    } else if (!log_path && arg.substr(0, 2) != "--") {
+      log_path = argv[i];
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--trace trace.json] [--profile <count>] [log.jsonl]" << std::endl;
+      return 2;
+    }
+  }
+  if (!log_path || std::string_view(log_path) == "-") {
+    return Replay(std::cin, options);
+  }
+
+  std::ifstream input(log_path);
+  if (!input) {
+    std::cerr << "cannot open " << log_path << std::endl;
+    return 2;
+  }
+  return Replay(input, options);
+}
@@ -0,0 +1,175 @@
+#include "workload.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <stdexcept>
+#include <utility>
+
+namespace Workload {
+  namespace {
+    // SplitMix64: unlike the standard distributions its output is the same
+    // with every standard library.
+    class Random {
+      uint64_t state_;
+
+    public:
+      explicit Random(uint64_t seed) : state_(seed) {}
+
+      uint64_t Next() {
+        uint64_t z = (state_ += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+      }
+
+      // Uniform enough in [0, bound) for the sizes used here.
+      int Below(int bound) {
+        return int(Next() % uint64_t(bound));
+      }
+    };
+
+    std::string Ref(int row, int col) {
+      return Position{row, col}.ToString();
+    }
+
+    // An integer or a number with two decimals.
+    std::string Number(Random& random) {
+      const int value = random.Below(2'000'000) - 1'000'000;
+      if (random.Below(4)) {
+        return std::to_string(value);
+      }
+      const int abs_value = std::abs(value);
+      const auto fraction = std::to_string(abs_value % 100);
+      return (value < 0 ? "-" : "") + std::to_string(abs_value / 100) + "."
+             + std::string(2 - fraction.size(), '0') + fraction;
+    }
+
+    void GenerateGrid(const Options& options, Random& random, const std::function<void(Position, std::string)>& set_cell) {
+      for (int row = 0; row < options.rows; ++row) {
+        for (int col = 0; col < options.cols; ++col) {
+          set_cell({row, col}, Number(random));
+        }
+      }
+    }
+
+    void GenerateFillDown(const Options& options, Random& random, const std::function<void(Position, std::string)>& set_cell) {
+      for (int row = 0; row < options.rows; ++row) {
+        set_cell({row, 0}, Number(random));
+        for (int col = 1; col < options.cols; ++col) {
+          set_cell({row, col}, "=" + Ref(row, col - 1) + "*2+" + Ref(row, 0));
+        }
+      }
+    }
+
+    void GenerateChain(const Options& options, Random& random, const std::function<void(Position, std::string)>& set_cell) {
+      set_cell({0, 0}, Number(random));
+      for (int row = 1; row < options.rows; ++row) {
+        set_cell({row, 0}, "=" + Ref(row - 1, 0) + "+1");
+      }
+    }
+
+    void GenerateFanOut(const Options& options, Random& random, const std::function<void(Position, std::string)>& set_cell) {
+      set_cell({0, 0}, Number(random));
+      for (int row = 0; row < options.rows; ++row) {
+        set_cell({row, 1}, "=A1+" + std::to_string(row));
+      }
+    }
+
+    void GenerateFanIn(const Options& options, Random& random, const std::function<void(Position, std::string)>& set_cell) {
+      std::string formula = "=";
+      for (int row = 0; row < options.rows; ++row) {
+        set_cell({row, 1}, Number(random));
+        formula += (row ? "+" : "") + Ref(row, 1);
+      }
+      set_cell({0, 0}, std::move(formula));
+    }
+
+    void GenerateDag(const Options& options, Random& random, const std::function<void(Position, std::string)>& set_cell) {
+      GenerateGrid({options.shape, 1, options.cols, options.seed, options.refs}, random, set_cell);
+      for (int row = 1; row < options.rows; ++row) {
+        for (int col = 0; col < options.cols; ++col) {
+          // The first reference goes to the previous level, so the DAG is
+          // exactly `rows` levels deep.
+          std::string formula = "=" + Ref(row - 1, random.Below(options.cols));
+          for (int ref = 1; ref < options.refs; ++ref) {
+            formula += "+" + Ref(random.Below(row), random.Below(options.cols));
+          }
+          set_cell({row, col}, std::move(formula));
+        }
+      }
+    }
+
+    void GenerateMixed(const Options& options, Random& random, const std::function<void(Position, std::string)>& set_cell) {
+      constexpr std::array<std::string_view, 6> kWords = {"alpha", "beta", "gamma", "delta", "total", "'=escaped"};
+      for (int row = 0; row < options.rows; ++row) {
+        for (int col = 0; col < options.cols; ++col) {
+          const int kind = random.Below(10);
+          if (kind < 2) {
+            set_cell({row, col}, std::string(kWords[random.Below(kWords.size())]) + " " + std::to_string(row));
+          } else if (kind < 7 || row == 0) {
+            set_cell({row, col}, Number(random));
+          } else {
+            set_cell({row, col}, "=" + Ref(random.Below(row), random.Below(options.cols))
+                                 + (random.Below(2) ? "*" : "-") + Ref(random.Below(row), col));
+          }
+        }
+      }
+    }
+  }
+
+  std::optional<Shape> ParseShape(std::string_view name) {
+    constexpr std::pair<std::string_view, Shape> kShapes[] = {
+      {"grid", Shape::Grid}, {"filldown", Shape::FillDown}, {"chain", Shape::Chain},
+      {"fanout", Shape::FanOut}, {"fanin", Shape::FanIn}, {"dag", Shape::Dag}, {"mixed", Shape::Mixed}
+    };
+    for (const auto& [shape_name, shape] : kShapes) {
+      if (shape_name == name) {
+        return shape;
+      }
+    }
+    return std::nullopt;
+  }
+
+  bool IsValid(const Options& options) {
+    // Chain only fills column A, FanOut and FanIn columns A and B.
+    const bool uses_cols = options.shape != Shape::Chain && options.shape != Shape::FanOut
+                           && options.shape != Shape::FanIn;
+    return options.rows > 0 && options.rows <= Position::kMaxRows
+           && (!uses_cols || (options.cols > 0 && options.cols <= Position::kMaxCols));
+  }
+
+  void Generate(const Options& options, const std::function<void(Position, std::string)>& set_cell) {
+    if (!IsValid(options)) {
+      throw std::invalid_argument("the workload doesn't fit a sheet");
+    }
+    Random random(options.seed);
+    switch (options.shape) {
+      case Shape::Grid:
+        GenerateGrid(options, random, set_cell);
+        break;
+      case Shape::FillDown:
+        GenerateFillDown(options, random, set_cell);
+        break;
+      case Shape::Chain:
+        GenerateChain(options, random, set_cell);
+        break;
+      case Shape::FanOut:
+        GenerateFanOut(options, random, set_cell);
+        break;
+      case Shape::FanIn:
+        GenerateFanIn(options, random, set_cell);
+        break;
+      case Shape::Dag:
+        GenerateDag(options, random, set_cell);
+        break;
+      case Shape::Mixed:
+        GenerateMixed(options, random, set_cell);
+        break;
+    }
+  }
+
+  void Fill(ISheet& sheet, const Options& options) {
+    Generate(options, [&] (Position pos, std::string text) { sheet.SetCell(pos, std::move(text)); });
+  }
+} // namespace Workload
@@ -0,0 +1,41 @@
+#pragma once
+#include "common.h"
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Deterministic synthetic sheets for benchmarks and load tests. The same
+// options always produce the same cells in the same order on any platform.
+namespace Workload {
+  enum class Shape {
+    Grid,     // rows x cols numbers
+    FillDown, // column A numbers, every next column a formula over the same row
+    Chain,    // column A, every cell refers to the one above
+    FanOut,   // A1 referenced by every cell of column B
+    FanIn,    // A1 sums all the numbers of column B
+    Dag,      // random DAG, `rows` levels deep, `cols` wide
+    Mixed     // random text, numbers and formulas over the cells above
+  };
+
+  struct Options {
+    Shape shape = Shape::Grid;
+    int rows = 1000;
+    int cols = 10;
+    uint64_t seed = 1;
+    int refs = 3; // Dag: references of a cell to the previous levels
+  };
+
+  std::optional<Shape> ParseShape(std::string_view name);
+
+  // Whether the cells of the shape fit a sheet: rows in [1, Position::kMaxRows]
+  // and, for the shapes `cols` wide, cols in [1, Position::kMaxCols].
+  bool IsValid(const Options& options);
+
+  // Calls set_cell(pos, text) for every generated cell. Throws
+  // std::invalid_argument unless IsValid(options).
+  void Generate(const Options& options, const std::function<void(Position, std::string)>& set_cell);
+  void Fill(ISheet& sheet, const Options& options);
+} // namespace Workload
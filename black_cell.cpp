@@ -1,32 +1,105 @@
 #include "black_cell.h"
+#include "black_sheet.h"
 #include "black_utils.h"
 
 #include <algorithm>
 #include <cassert>
 
 namespace Black {
-  Cell::Cell(ISheet& sheet, Position pos, std::string text, bool has_incoming_refs)
+  namespace {
+    // Formula cells being evaluated by the thread, each one reading the next.
+    thread_local size_t evaluation_depth = 0;
+    // Deeper evaluations compute their inputs bottom-up first, so that a long
+    // chain of formulas doesn't overflow the call stack.
+    constexpr size_t kMaxEvaluationDepth = 256;
+
+    // Storage of the stack of Validate() kept between the calls. Taken by the
+    // call, so a nested one would just allocate its own.
+    thread_local std::vector<std::pair<const Cell*, bool>> validation_stack;
+
+    struct EvaluationDepthGuard {
+      EvaluationDepthGuard() {
+        ++evaluation_depth;
+      }
+      ~EvaluationDepthGuard() {
+        --evaluation_depth;
+      }
+    };
+  }
+
+  Cell::Cell(Sheet& sheet)
     : sheet_(sheet)
+    , data_("")
+    , version_(sheet.NextEditEpoch())
   {
+  }
+
+  void Cell::Set(Position pos, std::string text) {
+    Data data;
     if (text.empty() || text.front() == kEscapeSign || text.front() != kFormulaSign) {
-      data_ = std::move(text);
+      data = std::move(text);
     } else {
-      data_ =  ParseFormula(text.substr(1));
+      {
+        ScopedTimer timer(sheet_.GetCounters(), Counter::ParseNanoseconds);
+        TraceSpan span(sheet_.GetTracer(), "ParseFormula");
+        span.SetCell(pos);
+        data = ParseFormula(text.substr(1));
+      }
+      BLACK_COUNT(sheet_.GetCounters(), Counter::Parses, 1);
 
-      if (CheckForCircularDependency(pos, has_incoming_refs)) {
+      if (CheckForCircularDependency(pos, *data.GetFormula())) {
         throw CircularDependencyException(
           pos.ToString() + "=" + text
         );
       }
     }
+
+    data_ = std::move(data);
+    referenced_cells_.clear();
+    InvalidateCache();
+  }
+
+  void Cell::Set(std::unique_ptr<Black::Formula> formula) {
+    data_ = std::move(formula);
+    referenced_cells_.clear();
+    InvalidateCache();
+  }
+
+  void Cell::BindReferences() {
+    referenced_cells_.clear();
+    if (data_.IsFormula()) {
+      auto* formula = data_.GetFormula();
+      formula->BindReferences(sheet_);
+      for (Position pos : formula->GetReferencedCells()) {
+        auto* cell = sheet_.GetCellImpl(pos);
+        assert(cell);
+        referenced_cells_.push_back(cell);
+      }
+    }
   }
 
   ICell::Value Cell::GetValue() const {
-    if (!value_cache_) {
+    TraceSpan span(sheet_.GetTracer(), "GetValue");
+    Validate();
+    if (value_cache_) {
+      BLACK_COUNT(sheet_.GetCounters(), Counter::CacheHits, 1);
+      span.Cancel(); // only recalculations are traced
+    } else {
+      const auto pos = span ? sheet_.FindPosition(*this) : std::nullopt;
+      span.SetCell(pos);
+      BLACK_COUNT(sheet_.GetCounters(), Counter::CacheMisses, 1);
       if (data_.IsText()) {
         const auto& text = data_.GetText();
         value_cache_ = text.substr(!text.empty() && text.front() == kEscapeSign); // remove escape sign
       } else {
+        if (evaluation_depth >= kMaxEvaluationDepth) {
+          EvaluateInputs();
+        }
+        EvaluationDepthGuard depth_guard;
+        BLACK_COUNT(sheet_.GetCounters(), Counter::FormulaEvaluations, 1);
+        TraceSpan evaluate_span(sheet_.GetTracer(), "Formula::Evaluate");
+        evaluate_span.SetCell(pos);
+        ProfileScope profile(sheet_.GetProfiler(), this);
         std::visit([&] (auto val) { value_cache_ = val; },
                    data_.GetFormula()->Evaluate(sheet_));
       }
@@ -46,48 +119,171 @@ namespace Black {
            : std::vector<Position>{};
   }
 
-  void Cell::InvalidateCache() {
-    if (!value_cache_) {
+  const Black::Formula* Cell::GetFormula() const {
+    return data_.IsFormula() ? data_.GetFormula() : nullptr;
+  }
+
+  template <typename Func>
+  void Cell::ForEachInput(Func&& func) const {
+    if (!data_.IsFormula()) {
       return;
     }
+    for (const auto* cell : referenced_cells_) {
+      func(*cell);
+    }
+    // Edits of the text cells of a range invalidate the formula right away,
+    // only the values of its formula cells change unnoticed.
+    for (const auto* range : data_.GetFormula()->GetRanges()) {
+      if (const auto* cache = range->GetCache()) {
+        for (const auto& [offset, cell] : cache->Get(range->GetRange()).formula_cells) {
+          func(*cell);
+        }
+      }
+    }
+  }
+
+  uint64_t Cell::Validate() const {
+    const auto epoch = sheet_.GetEditEpoch();
+    if (verified_at_ == epoch) {
+      return version_;
+    }
 
-    if (data_.IsFormula()) {
-      data_.GetFormula()->InvalidateCache();
+    // The inputs of a cell are validated before it. A chain of formulas may be
+    // as long as the sheet, so the walk keeps its own stack of the cells and
+    // whether their inputs are already pushed.
+    auto stack = std::move(validation_stack);
+    stack.assign(1, {this, false});
+    while (!stack.empty()) {
+      const auto [cell, inputs_pushed] = stack.back();
+      if (cell->verified_at_ == epoch) {
+        stack.pop_back();
+        continue;
+      }
+      if (!inputs_pushed) {
+        BLACK_COUNT(sheet_.GetCounters(), Counter::ValidationVisits, 1);
+        stack.back().second = true;
+        cell->ForEachInput([&] (const Cell& input) {
+          if (input.verified_at_ != epoch) {
+            stack.emplace_back(&input, false);
+          }
+        });
+        continue;
+      }
+      stack.pop_back();
+      uint64_t inputs_version = 0;
+      cell->ForEachInput([&] (const Cell& input) {
+        inputs_version = std::max(inputs_version, input.version_);
+      });
+      if (inputs_version > cell->version_) {
+        cell->version_ = inputs_version;
+        cell->value_cache_ = std::nullopt;
+      }
+      cell->verified_at_ = epoch;
+    }
+    validation_stack = std::move(stack);
+    return version_;
+  }
+
+  void Cell::EvaluateInputs() const {
+    // Validate() has already dropped the stale caches of every cell reachable
+    // from this one.
+    std::vector<std::pair<const Cell*, bool>> stack;
+    ForEachInput([&] (const Cell& input) {
+      if (!input.value_cache_) {
+        stack.emplace_back(&input, false);
+      }
+    });
+    while (!stack.empty()) {
+      const auto [cell, inputs_pushed] = stack.back();
+      if (cell->value_cache_) {
+        stack.pop_back();
+        continue;
+      }
+      if (!inputs_pushed) {
+        stack.back().second = true;
+        cell->ForEachInput([&] (const Cell& input) {
+          if (!input.value_cache_) {
+            stack.emplace_back(&input, false);
+          }
+        });
+        continue;
+      }
+      stack.pop_back();
+      cell->GetValue(); // reads only cached values
+    }
+  }
+
+  void Cell::InvalidateCache() {
+    BLACK_COUNT(sheet_.GetCounters(), Counter::Invalidations, 1);
+    if (auto* tracer = sheet_.GetTracer()) {
+      if (const auto pos = sheet_.FindPosition(*this)) { // new cells have nothing to invalidate
+        tracer->AddInstant("InvalidateCache", pos);
+      }
     }
     value_cache_ = std::nullopt;
-    for (Position incoming_ref_pos : incoming_refs_) {
-      auto* cell = dynamic_cast<Black::Cell*>(sheet_.GetCell(incoming_ref_pos));
-      assert(cell); // only Black::Cell* supported
-      cell->InvalidateCache();
+    version_ = sheet_.NextEditEpoch();
+  }
+
+  void Cell::HandleRangeCellChanged(Position pos, const RangeInput& before, const RangeInput& after) {
+    if (data_.IsFormula()) {
+      data_.GetFormula()->HandleRangeCellChanged(pos, before, after);
+      InvalidateCache();
     }
+  }
 
+  Position Cell::GetPhysicalPosition() const {
+    return physical_pos_;
+  }
+
+  void Cell::SetPhysicalPosition(Position pos) {
+    physical_pos_ = pos;
   }
 
   bool Cell::HasIncomingRefs() const {
     return !incoming_refs_.empty();
   }
 
-  void Cell::AddIncomingRef(Position pos) {
-    auto pos_it = std::lower_bound(
-      std::begin(incoming_refs_), std::end(incoming_refs_), pos
+  const std::vector<Cell*>& Cell::GetIncomingRefs() const {
+    return incoming_refs_;
+  }
+
+  void Cell::AddIncomingRef(Cell* cell) {
+    auto cell_it = std::lower_bound(
+      std::begin(incoming_refs_), std::end(incoming_refs_), cell, std::less<>{}
     );
-    if(pos_it == std::end(incoming_refs_) || !(pos == *pos_it)) {
-      incoming_refs_.insert(pos_it, pos);
+    if(cell_it == std::end(incoming_refs_) || cell != *cell_it) {
+      incoming_refs_.insert(cell_it, cell);
     }
   }
 
-  void Cell::SetIncomingReferences(std::vector<Position> refs) {
-    incoming_refs_ = std::move(refs);
+  void Cell::RemoveIncomingRef(Cell* cell) {
+    auto cell_it = std::lower_bound(
+      std::begin(incoming_refs_), std::end(incoming_refs_), cell, std::less<>{}
+    );
+    if (cell_it != std::end(incoming_refs_) && cell == *cell_it) {
+      incoming_refs_.erase(cell_it);
+    }
   }
 
-  std::vector<Position> Cell::ReleaseIncomingReferences() {
-    return std::move(incoming_refs_); // incoming_refs_ is in unspecified state now, but it is
-  }                                   // expected that this cell is going to be destroyed soon
+  void Cell::DetachFromReferencedCells() {
+    for (auto* cell : referenced_cells_) {
+      cell->RemoveIncomingRef(this);
+    }
+  }
 
-  void Cell::RemoveIncomingRef(Position pos) {
-    auto pos_it = std::lower_bound(std::begin(incoming_refs_), std::end(incoming_refs_), pos);
-    if (pos_it != std::end(incoming_refs_))
-      incoming_refs_.erase(pos_it);
+  void Cell::AddMemoryUsage(MemoryBreakdown& usage) const {
+    usage.cells += sizeof(*this);
+    if (data_.IsText()) {
+      usage.texts += HeapBytes(data_.GetText());
+    } else {
+      usage.formulas += data_.GetFormula()->MemoryUsage();
+    }
+    usage.references += HeapBytes(referenced_cells_) + HeapBytes(incoming_refs_);
+    if (value_cache_) {
+      if (const auto* text = std::get_if<std::string>(&*value_cache_)) {
+        usage.value_caches += HeapBytes(*text);
+      }
+    }
   }
 
   bool Cell::Empty() const {
@@ -97,93 +293,99 @@ namespace Black {
   void Cell::Clear() {
     if (!Empty()){
       data_ = "";
+      referenced_cells_.clear();
       InvalidateCache();
     }
   }
 
-  bool Cell::CheckForCircularDependency(Position pos, bool has_incoming_refs) const {
-    if (has_incoming_refs) {
+  namespace {
+    bool RefersTo(const Black::Formula& formula, Position pos) {
+      const auto cells = formula.GetReferencedCells();
+      const auto& ranges = formula.GetReferencedRanges();
+      return std::binary_search(std::begin(cells), std::end(cells), pos)
+        || std::any_of(std::begin(ranges), std::end(ranges),
+                       [pos] (const CellRange& range) { return range.Contains(pos); });
+    }
+  }
+
+  bool Cell::CheckForCircularDependency(Position pos, const Black::Formula& formula) const {
+    if (HasIncomingRefs() || sheet_.HasRangeDependents(pos)) {
       std::unordered_set<Position, Black::PositionHash> checked;
-      return CheckForCircularDependencyImpl(pos, checked);
+      return CheckForCircularDependencyImpl(pos, formula, checked);
     }
 
-    const auto referenced_cells = GetReferencedCells();
-    return std::binary_search(std::begin(referenced_cells), std::end(referenced_cells), pos);
+    return RefersTo(formula, pos);
   }
-  bool Cell::CheckForCircularDependencyImpl(Position pos,
+  bool Cell::CheckForCircularDependencyImpl(Position pos, const Black::Formula& formula,
                                             std::unordered_set<Position, Black::PositionHash>& checked) const
   {
-    if (data_.IsText()) {
-      return false;
+    if (RefersTo(formula, pos)) {
+      return true;
     }
-    const auto referenced_cells = GetReferencedCells();
-    if (std::binary_search(std::begin(referenced_cells), std::end(referenced_cells), pos)) {
+    const auto visit = [&, pos] (Position cell_pos, const Cell* cell) {
+      if (checked.count(cell_pos)) {
+        return false;
+      }
+      BLACK_COUNT(sheet_.GetCounters(), Counter::CycleCheckVisits, 1);
+      bool result = false;
+      if (cell && cell->data_.IsFormula()) {
+        result = cell->CheckForCircularDependencyImpl(pos, *cell->data_.GetFormula(), checked);
+      }
+      checked.insert(cell_pos);
+      return result;
+    };
+    const auto cells = formula.GetReferencedCells();
+    if (std::any_of(std::begin(cells), std::end(cells),
+                    [&] (Position cell_pos) { return visit(cell_pos, sheet_.GetCellImpl(cell_pos)); }))
+    {
       return true;
     }
-    return std::any_of(std::begin(referenced_cells), std::end(referenced_cells),
-                       [&, pos] (Position cell_pos) {
-                         if (checked.count(cell_pos)) {
-                           return false;
-                         }
-                         bool result = false;
-                         auto* cell_ptr = sheet_.GetCell(cell_pos);
-                         if (cell_ptr) {
-                           auto* cell = dynamic_cast<Black::Cell*>(cell_ptr);
-                           assert(cell); // only Black::Cell* supported
-                           result = cell->CheckForCircularDependencyImpl(pos, checked);
-                           checked.insert(cell_pos);
-                         }
-                         return result;
-                       }
-    );
+    bool found = false;
+    for (const auto& range : formula.GetReferencedRanges()) {
+      sheet_.ForEachCellInRange(range, [&] (Position cell_pos, const Cell* cell) {
+        found = found || visit(cell_pos, cell);
+      });
+    }
+    return found;
   }
 
   void Cell::HandleInsertedRows(int before, int count) {
-    std::for_each(std::begin(incoming_refs_), std::end(incoming_refs_),
-                  [=] (Position& pos) { pos.row += count * (pos.row >= before); }
-    );
     if (data_.IsFormula()) {
-
-      data_.GetFormula()->HandleInsertedRows(before, count);
+      if (data_.GetFormula()->HandleInsertedRows(before, count)
+          == IFormula::HandlingResult::ReferencesChanged)
+      {
+        InvalidateCache(); // a range has grown or became invalid
+      }
     }
   }
 
   void Cell::HandleInsertedCols(int before, int count) {
-    std::for_each(std::begin(incoming_refs_), std::end(incoming_refs_),
-                  [=] (Position& pos) { pos.col += count * (pos.col >= before); }
-    );
     if (data_.IsFormula()) {
-      data_.GetFormula()->HandleInsertedCols(before, count);
+      if (data_.GetFormula()->HandleInsertedCols(before, count)
+          == IFormula::HandlingResult::ReferencesChanged)
+      {
+        InvalidateCache(); // a range has grown or became invalid
+      }
     }
   }
 
   void Cell::HandleDeletedRows(int first, int count) {
-    incoming_refs_.erase(
-      std::remove_if(std::begin(incoming_refs_), std::end(incoming_refs_),
-                     [=] (Position pos) { return ValidateBoundaries(first, first + count, pos.row); }
-      ),
-      std::end(incoming_refs_)
-    );
     if (data_.IsFormula()) {
       if (data_.GetFormula()->HandleDeletedRows(first, count)
         == IFormula::HandlingResult::ReferencesChanged)
       {
+        BindReferences();
         InvalidateCache();
       }
     }
   }
 
   void Cell::HandleDeletedCols(int first, int count) {
-    incoming_refs_.erase(
-      std::remove_if(std::begin(incoming_refs_), std::end(incoming_refs_),
-                     [=] (Position pos) { return ValidateBoundaries(first, first + count, pos.col); }
-      ),
-      std::end(incoming_refs_)
-    );
     if (data_.IsFormula()) {
       if (data_.GetFormula()->HandleDeletedCols(first, count)
           == IFormula::HandlingResult::ReferencesChanged)
       {
+        BindReferences();
         InvalidateCache();
       }
     }
@@ -3,6 +3,7 @@
 #include "formula.h"
 #include "black_position.h"
 #include "black_formula.h"
+#include "black_memory.h"
 
 #include <string>
 #include <vector>
@@ -10,8 +11,11 @@
 #include <optional>
 #include <variant>
 #include <unordered_set>
+#include <cstdint>
 
 namespace Black {
+  class Sheet;
+
   class Cell : public ICell {
     class Data : std::variant<std::string, std::unique_ptr<Black::Formula>> {
       using FormulaHolder = std::unique_ptr<Black::Formula>;
@@ -36,35 +40,72 @@ namespace Black {
       }
     };
 
-    ISheet& sheet_;
+    Sheet& sheet_;
     Data data_;
-    std::vector<Position> incoming_refs_;
+    std::vector<Cell*> referenced_cells_; // resolved once per formula, cells are never relocated
+    std::vector<Cell*> incoming_refs_;    // sorted, positions of the dependents are irrelevant
     mutable std::optional<ICell::Value> value_cache_;
+    mutable uint64_t version_ = 0;     // last edit epoch which may affect the value
+    mutable uint64_t verified_at_ = 0; // edit epoch at which version_ was last validated
+    Position physical_pos_{-1, -1};    // indices in the sheet storage, set once the cell is placed
 
   private:
-    bool CheckForCircularDependency(Position pos, bool has_incoming_refs) const;
-    bool CheckForCircularDependencyImpl(Position pos,
+    bool CheckForCircularDependency(Position pos, const Black::Formula& formula) const;
+    bool CheckForCircularDependencyImpl(Position pos, const Black::Formula& formula,
                                         std::unordered_set<Position, Black::PositionHash>& checked) const;
+    // Calls func(cell) for the cells the value depends on: the referenced
+    // cells and the formula cells of the ranges.
+    template <typename Func>
+    void ForEachInput(Func&& func) const;
+    // Brings version_ up to date with the inputs and drops the value cache if
+    // they changed, without evaluating anything.
+    uint64_t Validate() const;
+    // Computes the values of all the inputs, direct and indirect, lacking one
+    // in post order instead of recursively. Unlike the evaluation of the
+    // formula it also computes the inputs the formula may skip, e.g. the
+    // branch of IF not taken.
+    void EvaluateInputs() const;
 
   public:
-    Cell(ISheet& sheet, Position pos, std::string text, bool has_incoming_refs);
+    explicit Cell(Sheet& sheet);
+
+    // Replaces the cell content keeping the cell object (and so all the handles
+    // to it) alive. Leaves the cell untouched if an exception is thrown.
+    void Set(Position pos, std::string text);
+    // Sets an already built formula, e.g. restored from a snapshot. The formula
+    // isn't checked for circular references.
+    void Set(std::unique_ptr<Black::Formula> formula);
+    // Resolves the formula references to the cells of the sheet. All the
+    // referenced cells must exist.
+    void BindReferences();
 
     Value GetValue() const override;
 
     std::string GetText() const override;
 
     std::vector<Position> GetReferencedCells() const override;
+    // nullptr for text cells.
+    const Black::Formula* GetFormula() const;
+
+    Position GetPhysicalPosition() const;
+    void SetPhysicalPosition(Position pos);
 
     bool HasIncomingRefs() const;
-    void AddIncomingRef(Position pos);
-    void RemoveIncomingRef(Position pos);
-    void SetIncomingReferences(std::vector<Position> refs);
-    std::vector<Position> ReleaseIncomingReferences();
+    const std::vector<Cell*>& GetIncomingRefs() const;
+    void AddIncomingRef(Cell* cell);
+    void RemoveIncomingRef(Cell* cell);
+    // Removes this cell from the incoming references of all the cells it refers to.
+    void DetachFromReferencedCells();
+
+    // Adds the cell object and everything it owns to the usage.
+    void AddMemoryUsage(MemoryBreakdown& usage) const;
 
     bool Empty() const;
     void Clear();
 
     void InvalidateCache();
+    // A cell was edited inside some ranges the formula refers to.
+    void HandleRangeCellChanged(Position pos, const RangeInput& before, const RangeInput& after);
 
     void HandleInsertedRows(int before, int count);
     void HandleInsertedCols(int before, int count);
@@ -105,6 +105,8 @@ std::string_view FormulaError::ToString() const {
     return "#VALUE!";
   case Category::Div0:
     return "#DIV/0!";
+  case Category::NA:
+    return "#N/A";
   }
   return ""; // make compiler happy
 }
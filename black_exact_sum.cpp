@@ -0,0 +1,131 @@
+#include "black_exact_sum.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace Black {
+  namespace {
+    constexpr int64_t kChunkMask = (int64_t(1) << 32) - 1;
+  }
+
+  void ExactSum::Add(double value, int sign) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    int exponent = int(bits >> 52) & 0x7ff;
+    if (exponent == 0x7ff) {
+      non_finite_ += sign;
+      return;
+    }
+    uint64_t mantissa = bits & ((uint64_t(1) << 52) - 1);
+    if (exponent) {
+      mantissa |= uint64_t(1) << 52;
+    } else {
+      exponent = 1; // subnormal
+    }
+    if (bits >> 63) {
+      sign = -sign;
+    }
+
+    // The value is mantissa * 2^(exponent - 1) in units of 2^-1074, its 53
+    // bits land in three consecutive chunks.
+    const int chunk = (exponent - 1) / 32;
+    const int shift = (exponent - 1) % 32;
+    chunks_[chunk] += sign * int64_t((mantissa << shift) & kChunkMask);
+    chunks_[chunk + 1] += sign * int64_t((mantissa >> (32 - shift)) & kChunkMask);
+    if (shift) {
+      chunks_[chunk + 2] += sign * int64_t(mantissa >> (64 - shift));
+    }
+    if (++pending_ == kMaxPending) {
+      Propagate(chunks_);
+      pending_ = 0;
+    }
+  }
+
+  // Leaves every chunk but the last one in [0, 2^32), the last one keeps the
+  // sign of the sum.
+  void ExactSum::Propagate(std::array<int64_t, kChunks>& chunks) {
+    for (int i = 0; i + 1 < kChunks; ++i) {
+      const int64_t carry = chunks[i] >> 32;
+      chunks[i] &= kChunkMask;
+      chunks[i + 1] += carry;
+    }
+  }
+
+  void ExactSum::Add(double value) {
+    Add(value, 1);
+  }
+
+  void ExactSum::Add(const double* values, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      Add(values[i], 1);
+    }
+  }
+
+  void ExactSum::Add(const ExactSum& other) {
+    for (int i = 0; i < kChunks; ++i) {
+      chunks_[i] += other.chunks_[i];
+    }
+    non_finite_ += other.non_finite_;
+    // Each chunk is below (pending + 1) * 2^32 in magnitude.
+    pending_ += other.pending_ + 1;
+    if (pending_ >= kMaxPending) {
+      Propagate(chunks_);
+      pending_ = 0;
+    }
+  }
+
+  void ExactSum::Subtract(double value) {
+    Add(value, -1);
+  }
+
+  double ExactSum::Total() const {
+    if (non_finite_) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    auto chunks = chunks_;
+    Propagate(chunks);
+    const bool negative = chunks.back() < 0;
+    if (negative) {
+      for (auto& chunk : chunks) {
+        chunk = -chunk;
+      }
+      Propagate(chunks);
+    }
+
+    int top = kChunks - 1;
+    while (top >= 0 && !chunks[top]) {
+      --top;
+    }
+    if (top < 0) {
+      return 0.0;
+    }
+    assert(chunks[top] >> 32 == 0);
+    auto get = [&] (int i) { return i >= 0 ? uint64_t(chunks[i]) : 0; };
+
+    // The leading 64 bits with the bits below them folded into the lowest
+    // one, which rounds the same as the whole sum when converted.
+    const uint64_t high = get(top) << 32 | get(top - 1);
+    const uint64_t low = get(top - 2);
+    int shift = 0;
+    while (!(high >> (63 - shift) & 1)) {
+      ++shift;
+    }
+    uint64_t mantissa = high << shift;
+    bool sticky = false;
+    if (shift) {
+      mantissa |= low >> (32 - shift);
+      sticky = (low << (32 + shift)) != 0;
+    } else {
+      sticky = low != 0;
+    }
+    for (int i = top - 3; i >= 0 && !sticky; --i) {
+      sticky = chunks[i] != 0;
+    }
+    mantissa |= uint64_t(sticky);
+
+    const double magnitude = std::ldexp(double(mantissa), 32 * (top - 1) - shift - 1074);
+    return negative ? -magnitude : magnitude;
+  }
+} // namespace Black
@@ -0,0 +1,36 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace Black {
+// Sum of doubles kept exactly in fixed point: 32 bit chunks covering the whole
+// double range. Subtracting a value undoes adding it and the total doesn't
+// depend on the order of the additions, so the sum of a range can be updated
+// by deltas and still equal the sum computed from scratch.
+class ExactSum {
+  static constexpr int kChunks = 68;
+  // Chunks take this many additions before their carries must be propagated.
+  static constexpr uint64_t kMaxPending = uint64_t(1) << 30;
+
+  // Chunk i holds bits [32 i, 32 i + 32) of the sum in units of 2^-1074, the
+  // smallest subnormal, plus the carries not propagated yet.
+  std::array<int64_t, kChunks> chunks_{};
+  uint64_t pending_ = 0;
+  int64_t non_finite_ = 0;
+
+  void Add(double value, int sign);
+  static void Propagate(std::array<int64_t, kChunks>& chunks);
+
+public:
+  void Add(double value);
+  void Add(const double* values, size_t count);
+  void Add(const ExactSum& other);
+  // Undoes Add(value).
+  void Subtract(double value);
+
+  // The exact sum rounded to the nearest double, infinite if it overflows and
+  // NaN while the sum includes an infinity or a NaN.
+  double Total() const;
+};
+} // namespace Black
@@ -1,11 +1,15 @@
 #include "black_formula.h"
 #include "common.h"
 #include "black_utils.h"
+#include "black_memory.h"
+#include "black_functions.h"
 
 #include "FormulaLexer.h"
 #include "FormulaBaseListener.h"
 
+#include <cerrno>
 #include <cmath>
+#include <cstdlib>
 #include <algorithm>
 #include <iterator>
 #include <stack>
@@ -27,6 +31,10 @@ namespace Black::FormulaAst {
     return result;
   }
 
+  bool IsComparison(Node::Type type) {
+    return type >= Node::Type::Equal && type <= Node::Type::GreaterOrEqual;
+  }
+
   Number::Number(double value, std::string str_representation)
   : Node(Type::Number)
   , value_(value)
@@ -46,6 +54,20 @@ namespace Black::FormulaAst {
     return {};
   }
 
+  void Number::BindReferences(const ISheet& sheet) {
+  }
+
+  void Number::AppendRanges(std::vector<Range*>& /* ranges */) {
+  }
+
+  void Number::AppendTokens(std::vector<Token>& tokens) const {
+    tokens.push_back({type, {}, value_, str_representation_, {}, 0});
+  }
+
+  size_t Number::MemoryUsage() const {
+    return sizeof(*this) + HeapBytes(str_representation_);
+  }
+
   IFormula::HandlingResult Number::HandleInsertedRows(int before, int count) {
     return IFormula::HandlingResult::NothingChanged;
   }
@@ -79,23 +101,34 @@ namespace Black::FormulaAst {
     IFormula::Value operator() (const std::string& text) const {
       if (text.empty()) return 0.0;
 
-      try {
-        size_t pos = 0;
-        double result = std::stod(text, &pos); // TODO: check if str is fully number
-        if (pos == text.size()) {
-          return result;
-        }
-      } catch (...) {}
-
+      // Like std::stod, without throwing for every text which isn't a number:
+      // out of range numbers are errors too.
+      errno = 0;
+      char* end = nullptr;
+      const double result = std::strtod(text.c_str(), &end);
+      if (end == text.c_str() + text.size() && errno != ERANGE) {
+        return result;
+      }
       return FormulaError(FormulaError::Category::Value);
     }
   };
 
+  IFormula::Value EvaluateCellValue(const ICell::Value& value) {
+    return std::visit(CellEvaluater{}, value);
+  }
+
+  Position Cell::GetPosition() const {
+    return position_;
+  }
+
   IFormula::Value Cell::Evaluate(const ISheet& sheet) const {
+    if (cell_) {
+      return EvaluateCellValue(cell_->GetValue());
+    }
     if (position_.IsValid()){
       auto* cell = sheet.GetCell(position_);
       if (cell) {
-        return std::visit(CellEvaluater{}, cell->GetValue());
+        return EvaluateCellValue(cell->GetValue());
       }
       return 0.0;
     }
@@ -117,6 +150,21 @@ namespace Black::FormulaAst {
     return result;
   }
 
+  void Cell::BindReferences(const ISheet& sheet) {
+    cell_ = position_.IsValid() ? sheet.GetCell(position_) : nullptr;
+  }
+
+  void Cell::AppendRanges(std::vector<Range*>& /* ranges */) {
+  }
+
+  void Cell::AppendTokens(std::vector<Token>& tokens) const {
+    tokens.push_back({type, position_, 0, {}, {}, 0});
+  }
+
+  size_t Cell::MemoryUsage() const {
+    return sizeof(*this);
+  }
+
   IFormula::HandlingResult Cell::HandleInsertedImpl(int& dim, int before, int count) {
     if (position_.IsValid() && dim >= before) {
       dim += count;
@@ -129,6 +177,7 @@ namespace Black::FormulaAst {
     if (position_.IsValid() && dim >= first) {
       if (dim < first + count) {
         position_ = {-1, -1}; // invalid position
+        cell_ = nullptr;
         return HandlingResult::ReferencesChanged;
       }
       dim -= count;
@@ -153,6 +202,245 @@ namespace Black::FormulaAst {
     return HandleDeletedImpl(position_.col, first, count);
   }
 
+  Range::Range(Position first, Position last)
+  : Node(Type::Range)
+  , range_{
+      {std::min(first.row, last.row), std::min(first.col, last.col)},
+      {std::max(first.row, last.row), std::max(first.col, last.col)}
+    }
+  {
+  }
+
+  bool Range::IsValid() const {
+    return range_.first.IsValid();
+  }
+
+  const CellRange& Range::GetRange() const {
+    return range_;
+  }
+
+  void Range::SetAggregates(RangeCache::Aggregates aggregates) {
+    aggregates_ = aggregates;
+  }
+
+  const RangeCache* Range::GetCache() const {
+    return IsValid() ? cache_.get() : nullptr;
+  }
+
+  void Range::HandleCellChanged(Position pos, const RangeInput& before, const RangeInput& after) {
+    if (cache_) {
+      cache_->Update(range_, pos, before, after);
+    }
+  }
+
+  IFormula::Value Range::Evaluate(const ISheet& /* sheet */) const {
+    return FormulaError(IsValid() ? FormulaError::Category::Value : FormulaError::Category::Ref);
+  }
+
+  std::string Range::GetExpression() const {
+    if (IsValid()) {
+      return range_.ToString();
+    }
+    return std::string(FormulaError(FormulaError::Category::Ref).ToString());
+  }
+
+  std::vector<Position> Range::GetReferencedCells() const {
+    return {};
+  }
+
+  void Range::BindReferences(const ISheet& sheet) {
+    cache_ = RangeCache::Create(sheet, aggregates_);
+  }
+
+  void Range::AppendRanges(std::vector<Range*>& ranges) {
+    ranges.push_back(this);
+  }
+
+  void Range::AppendTokens(std::vector<Token>& tokens) const {
+    tokens.push_back({type, range_.first, 0, {}, range_.last, 0});
+  }
+
+  size_t Range::MemoryUsage() const {
+    return sizeof(*this) + (cache_ ? cache_->MemoryUsage() : 0);
+  }
+
+  // Offsets of the cells stay the same while the range only moves.
+  IFormula::HandlingResult Range::ResetCacheIfResized(const CellRange& old_range, HandlingResult result) {
+    const auto old_cols = old_range.last.col - old_range.first.col;
+    const auto old_rows = old_range.last.row - old_range.first.row;
+    if (cache_ && (result == HandlingResult::ReferencesChanged
+                   || range_.last.col - range_.first.col != old_cols
+                   || range_.last.row - range_.first.row != old_rows))
+    {
+      cache_->Reset();
+    }
+    return result;
+  }
+
+  // Rows/columns inserted inside the range extend it. The new cells are empty,
+  // but functions like SUMPRODUCT depend on the size of the range.
+  IFormula::HandlingResult Range::HandleInsertedImpl(int Position::* dim, int before, int count) {
+    if (!IsValid() || range_.last.*dim < before) {
+      return HandlingResult::NothingChanged;
+    }
+    const int max_index = (dim == &Position::row ? Position::kMaxRows : Position::kMaxCols) - 1;
+    const bool extended = range_.first.*dim < before;
+    if (!extended) {
+      range_.first.*dim += count;
+    }
+    range_.last.*dim = std::min(range_.last.*dim + count, max_index);
+    if (range_.first.*dim > max_index) {
+      range_ = {{-1, -1}, {-1, -1}};
+      return HandlingResult::ReferencesChanged;
+    }
+    return extended ? HandlingResult::ReferencesChanged : HandlingResult::ReferencesRenamedOnly;
+  }
+
+  // The range shrinks by the deleted rows/columns and becomes invalid only
+  // if all of them are deleted.
+  IFormula::HandlingResult Range::HandleDeletedImpl(int Position::* dim, int first, int count) {
+    if (!IsValid() || range_.last.*dim < first) {
+      return HandlingResult::NothingChanged;
+    }
+    int& range_first = range_.first.*dim;
+    int& range_last = range_.last.*dim;
+    const bool cells_deleted = range_first < first + count;
+    range_first = range_first < first ? range_first : std::max(first, range_first - count);
+    range_last = range_last < first + count ? first - 1 : range_last - count;
+    if (range_first > range_last) {
+      range_ = {{-1, -1}, {-1, -1}};
+      return HandlingResult::ReferencesChanged;
+    }
+    return cells_deleted ? HandlingResult::ReferencesChanged : HandlingResult::ReferencesRenamedOnly;
+  }
+
+  IFormula::HandlingResult Range::HandleInsertedRows(int before, int count) {
+    const auto old_range = range_;
+    return ResetCacheIfResized(old_range, HandleInsertedImpl(&Position::row, before, count));
+  }
+
+  IFormula::HandlingResult Range::HandleInsertedCols(int before, int count) {
+    const auto old_range = range_;
+    return ResetCacheIfResized(old_range, HandleInsertedImpl(&Position::col, before, count));
+  }
+
+  IFormula::HandlingResult Range::HandleDeletedRows(int first, int count) {
+    const auto old_range = range_;
+    return ResetCacheIfResized(old_range, HandleDeletedImpl(&Position::row, first, count));
+  }
+
+  IFormula::HandlingResult Range::HandleDeletedCols(int first, int count) {
+    const auto old_range = range_;
+    return ResetCacheIfResized(old_range, HandleDeletedImpl(&Position::col, first, count));
+  }
+
+  Call::Call(const FunctionInfo& function, std::vector<NodeHolder> args)
+  : Node(Type::Call)
+  , function_(&function)
+  , args_(std::move(args))
+  {
+    for (auto& arg : args_) {
+      if (arg->type == Type::Range) {
+        static_cast<Range&>(*arg).SetAggregates(function_->range_aggregates);
+      }
+    }
+  }
+
+  IFormula::Value Call::Evaluate(const ISheet& sheet) const {
+    return function_->impl(Args(args_.data(), args_.data() + args_.size()), sheet);
+  }
+
+  std::string Call::GetExpression() const {
+    std::string result(function_->name);
+    result += '(';
+    for (size_t i = 0; i < args_.size(); ++i) {
+      if (i) {
+        result += ',';
+      }
+      result += args_[i]->GetExpression();
+    }
+    result += ')';
+    return result;
+  }
+
+  std::vector<Position> Call::GetReferencedCells() const {
+    std::vector<Position> result;
+    for (const auto& arg : args_) {
+      const auto refs = arg->GetReferencedCells();
+      result.insert(std::end(result), std::begin(refs), std::end(refs));
+    }
+    std::sort(std::begin(result), std::end(result));
+    result.erase(std::unique(std::begin(result), std::end(result)), std::end(result));
+    return result;
+  }
+
+  void Call::BindReferences(const ISheet& sheet) {
+    for (auto& arg : args_) {
+      arg->BindReferences(sheet);
+    }
+  }
+
+  void Call::AppendRanges(std::vector<Range*>& ranges) {
+    for (auto& arg : args_) {
+      arg->AppendRanges(ranges);
+    }
+  }
+
+  void Call::AppendTokens(std::vector<Token>& tokens) const {
+    for (const auto& arg : args_) {
+      arg->AppendTokens(tokens);
+    }
+    tokens.push_back({type, {}, 0, function_->name, {}, uint32_t(args_.size())});
+  }
+
+  size_t Call::MemoryUsage() const {
+    size_t usage = sizeof(*this) + HeapBytes(args_);
+    for (const auto& arg : args_) {
+      usage += arg->MemoryUsage();
+    }
+    return usage;
+  }
+
+  // Every argument is updated, the result is the strongest change.
+  template <typename Handler>
+  IFormula::HandlingResult Call::HandleArgs(Handler&& handler) {
+    auto result = HandlingResult::NothingChanged;
+    for (auto& arg : args_) {
+      result = std::max(result, handler(*arg));
+    }
+    return result;
+  }
+
+  IFormula::HandlingResult Call::HandleInsertedRows(int before, int count) {
+    return HandleArgs([=] (Node& arg) { return arg.HandleInsertedRows(before, count); });
+  }
+
+  IFormula::HandlingResult Call::HandleInsertedCols(int before, int count) {
+    return HandleArgs([=] (Node& arg) { return arg.HandleInsertedCols(before, count); });
+  }
+
+  IFormula::HandlingResult Call::HandleDeletedRows(int first, int count) {
+    return HandleArgs([=] (Node& arg) { return arg.HandleDeletedRows(first, count); });
+  }
+
+  IFormula::HandlingResult Call::HandleDeletedCols(int first, int count) {
+    return HandleArgs([=] (Node& arg) { return arg.HandleDeletedCols(first, count); });
+  }
+
+  NodeHolder MakeCall(std::string_view name, std::vector<NodeHolder> args) {
+    const auto* function = FindFunction(name);
+    if (!function) {
+      throw FormulaException("Unknown function " + std::string(name) + ".");
+    }
+    if (args.size() < function->min_arg_count) {
+      throw FormulaException("Too few arguments of " + std::string(name) + ".");
+    }
+    if (args.size() > function->max_arg_count) {
+      throw FormulaException("Too many arguments of " + std::string(name) + ".");
+    }
+    return std::make_unique<Call>(*function, std::move(args));
+  }
+
   struct UnaryOpEvaluater {
     IFormula::Value operator() (double value,
                                 const std::function<double(double)>& unary_func) const {
@@ -189,7 +477,7 @@ namespace Black::FormulaAst {
     return GetOpSymbol()
       + ExprPrinter(
         node_->GetExpression(),
-        node_->type == Type::Addition || node_->type == Type::Subtraction
+        node_->type == Type::Addition || node_->type == Type::Subtraction || IsComparison(node_->type)
       );
   }
 
@@ -197,6 +485,23 @@ namespace Black::FormulaAst {
     return node_->GetReferencedCells();
   }
 
+  void UnaryOp::BindReferences(const ISheet& sheet) {
+    node_->BindReferences(sheet);
+  }
+
+  void UnaryOp::AppendRanges(std::vector<Range*>& ranges) {
+    node_->AppendRanges(ranges);
+  }
+
+  void UnaryOp::AppendTokens(std::vector<Token>& tokens) const {
+    node_->AppendTokens(tokens);
+    tokens.push_back({type, {}, 0, {}, {}, 0});
+  }
+
+  size_t UnaryOp::MemoryUsage() const {
+    return sizeof(*this) + node_->MemoryUsage();
+  }
+
   IFormula::HandlingResult UnaryOp::HandleInsertedRows(int before, int count) {
     return node_->HandleInsertedRows(before, count);
   }
@@ -241,10 +546,29 @@ namespace Black::FormulaAst {
     }
   };
 
-  const char BinaryOp::kOpSymbols[] = {'+', '-', '*', '/'};
-
-  char BinaryOp::GetOpSymbol() const {
-    return kOpSymbols[static_cast<size_t>(type) - static_cast<size_t>(Type::Addition)];
+  std::string_view BinaryOp::GetOpSymbol() const {
+    switch (type) {
+      case Type::Addition:
+        return "+";
+      case Type::Subtraction:
+        return "-";
+      case Type::Multiplication:
+        return "*";
+      case Type::Division:
+        return "/";
+      case Type::Equal:
+        return "=";
+      case Type::NotEqual:
+        return "<>";
+      case Type::Less:
+        return "<";
+      case Type::LessOrEqual:
+        return "<=";
+      case Type::Greater:
+        return ">";
+      default:
+        return ">=";
+    }
   }
 
   BinaryOp::BinaryOp(Node::Type type, NodeHolder left, NodeHolder right,
@@ -266,6 +590,10 @@ namespace Black::FormulaAst {
 
   bool BinaryOp::AreParenthesesNeeded(Node::Type parent_type, Node::Type child_type,
                                       BinaryOp::ChildNodePos child_pos) const {
+    if (IsComparison(child_type)) {
+      // Comparisons bind the loosest and are left associative.
+      return !IsComparison(parent_type) || child_pos == ChildNodePos::Right;
+    }
     switch (parent_type) {
     case Type::Subtraction:
       return (child_type == Type::Addition ||
@@ -287,7 +615,7 @@ namespace Black::FormulaAst {
 
   std::string BinaryOp::GetExpression() const {
     return ExprPrinter(left_->GetExpression(), AreParenthesesNeeded(type, left_->type, ChildNodePos::Left))
-      + GetOpSymbol()
+      + std::string(GetOpSymbol())
       + ExprPrinter(right_->GetExpression(), AreParenthesesNeeded(type, right_->type, ChildNodePos::Right));
   }
 
@@ -306,6 +634,26 @@ namespace Black::FormulaAst {
     return result;
   }
 
+  void BinaryOp::BindReferences(const ISheet& sheet) {
+    left_->BindReferences(sheet);
+    right_->BindReferences(sheet);
+  }
+
+  void BinaryOp::AppendRanges(std::vector<Range*>& ranges) {
+    left_->AppendRanges(ranges);
+    right_->AppendRanges(ranges);
+  }
+
+  void BinaryOp::AppendTokens(std::vector<Token>& tokens) const {
+    left_->AppendTokens(tokens);
+    right_->AppendTokens(tokens);
+    tokens.push_back({type, {}, 0, {}, {}, 0});
+  }
+
+  size_t BinaryOp::MemoryUsage() const {
+    return sizeof(*this) + left_->MemoryUsage() + right_->MemoryUsage();
+  }
+
   IFormula::HandlingResult BinaryOp::HandleInsertedRows(int before, int count) {
     return std::max(
       left_->HandleInsertedRows(before, count),
@@ -334,6 +682,53 @@ namespace Black::FormulaAst {
     );
   }
 
+  NodeHolder MakeUnaryOp(Node::Type type, NodeHolder node) {
+    std::function<double(double)> unary_func;
+    if (type == Node::Type::UnaryMinus) {
+      unary_func = std::negate<double>{};
+    } else {
+      unary_func = [] (double val) { return val; };
+    }
+    return std::make_unique<UnaryOp>(type, std::move(node), std::move(unary_func));
+  }
+
+  NodeHolder MakeBinaryOp(Node::Type type, NodeHolder left, NodeHolder right) {
+    std::function<double(double, double)> binary_func;
+    switch (type) {
+      case Node::Type::Multiplication:
+        binary_func = std::multiplies<double>{};
+        break;
+      case Node::Type::Division:
+        binary_func = std::divides<double>{};
+        break;
+      case Node::Type::Addition:
+        binary_func = std::plus<double>{};
+        break;
+      case Node::Type::Equal:
+        binary_func = std::equal_to<double>{};
+        break;
+      case Node::Type::NotEqual:
+        binary_func = std::not_equal_to<double>{};
+        break;
+      case Node::Type::Less:
+        binary_func = std::less<double>{};
+        break;
+      case Node::Type::LessOrEqual:
+        binary_func = std::less_equal<double>{};
+        break;
+      case Node::Type::Greater:
+        binary_func = std::greater<double>{};
+        break;
+      case Node::Type::GreaterOrEqual:
+        binary_func = std::greater_equal<double>{};
+        break;
+      default:
+        binary_func = std::minus<double>{};
+        break;
+    }
+    return std::make_unique<BinaryOp>(type, std::move(left), std::move(right), std::move(binary_func));
+  }
+
   class Listener : public FormulaBaseListener {
     std::stack<NodeHolder> nodes_;
 
@@ -368,20 +763,35 @@ namespace Black::FormulaAst {
       );
     }
 
-    void exitUnaryOp(FormulaParser::UnaryOpContext * ctx) override {
-      auto node = PopNode();
-      Node::Type type;
-      std::function<double(double)> unary_func;
-      if (ctx->SUB()) {
-        type = Node::Type::UnaryMinus;
-        unary_func = std::negate<double>{};
-      } else {
-        type = Node::Type::UnaryPlus;
-        unary_func = [] (double val) { return val; };
+    void exitRange(FormulaParser::RangeContext * ctx) override {
+      Position corners[2];
+      for (size_t i = 0; i < 2; ++i) {
+        corners[i] = Position::FromString(ctx->CELL(i)->getSymbol()->getText());
+        if (!corners[i].IsValid()) {
+          throw FormulaException(
+            "Invalid cell position: " + ctx->CELL(i)->getSymbol()->getText() + "."
+          );
+        }
+      }
+      nodes_.push(
+        std::make_unique<Range>(corners[0], corners[1])
+      );
+    }
+
+    void exitCall(FormulaParser::CallContext * ctx) override {
+      std::vector<NodeHolder> args(ctx->expr().size());
+      for (auto it = args.rbegin(); it != args.rend(); ++it) {
+        *it = PopNode();
       }
+      nodes_.push(
+        MakeCall(ctx->NAME()->getSymbol()->getText(), std::move(args))
+      );
+    }
 
+    void exitUnaryOp(FormulaParser::UnaryOpContext * ctx) override {
+      auto node = PopNode();
       nodes_.push(
-        std::make_unique<UnaryOp>(type, std::move(node), std::move(unary_func))
+        MakeUnaryOp(ctx->SUB() ? Node::Type::UnaryMinus : Node::Type::UnaryPlus, std::move(node))
       );
     }
 
@@ -389,24 +799,41 @@ namespace Black::FormulaAst {
       auto right = PopNode();
       auto left = PopNode();
       Node::Type type;
-      std::function<double(double, double)> binary_func;
-
       if (ctx->MUL()) {
         type = Node::Type::Multiplication;
-        binary_func = std::multiplies<double>{};
       } else if (ctx->DIV()) {
         type = Node::Type::Division;
-        binary_func = std::divides<double>{};
       } else if (ctx->ADD()) {
         type = Node::Type::Addition;
-        binary_func = std::plus<double>{};
       } else {
         type = Node::Type::Subtraction;
-        binary_func = std::minus<double>{};
       }
 
       nodes_.push(
-        std::make_unique<BinaryOp>(type, std::move(left), std::move(right), std::move(binary_func))
+        MakeBinaryOp(type, std::move(left), std::move(right))
+      );
+    }
+
+    void exitComparison(FormulaParser::ComparisonContext * ctx) override {
+      auto right = PopNode();
+      auto left = PopNode();
+      Node::Type type;
+      if (ctx->EQ()) {
+        type = Node::Type::Equal;
+      } else if (ctx->NE()) {
+        type = Node::Type::NotEqual;
+      } else if (ctx->LT()) {
+        type = Node::Type::Less;
+      } else if (ctx->LE()) {
+        type = Node::Type::LessOrEqual;
+      } else if (ctx->GT()) {
+        type = Node::Type::Greater;
+      } else {
+        type = Node::Type::GreaterOrEqual;
+      }
+
+      nodes_.push(
+        MakeBinaryOp(type, std::move(left), std::move(right))
       );
     }
 
@@ -432,13 +859,11 @@ namespace Black {
   Formula::Formula(Black::FormulaAst::NodeHolder node)
     : node_(std::move(node))
   {
+    node_->AppendRanges(ranges_);
   }
 
   IFormula::Value Formula::Evaluate(const ISheet& sheet) const {
-    if (!value_cache_) {
-      value_cache_ = node_->Evaluate(sheet);
-    }
-    return *value_cache_;
+    return node_->Evaluate(sheet);
   }
 
   std::string Formula::GetExpression() const {
@@ -455,15 +880,60 @@ namespace Black {
     return *referenced_cells_cache_;
   }
 
+  const std::vector<CellRange>& Formula::GetReferencedRanges() const {
+    if (!referenced_ranges_cache_) {
+      referenced_ranges_cache_.emplace();
+      for (const auto* range : ranges_) {
+        if (range->IsValid()) {
+          referenced_ranges_cache_->push_back(range->GetRange());
+        }
+      }
+    }
+    return *referenced_ranges_cache_;
+  }
+
+  const std::vector<FormulaAst::Range*>& Formula::GetRanges() const {
+    return ranges_;
+  }
+
+  void Formula::BindReferences(const ISheet& sheet) {
+    node_->BindReferences(sheet);
+  }
+
+  void Formula::HandleRangeCellChanged(Position pos, const RangeInput& before, const RangeInput& after) {
+    for (auto* range : ranges_) {
+      if (range->IsValid() && range->GetRange().Contains(pos)) {
+        range->HandleCellChanged(pos, before, after);
+      }
+    }
+  }
+
+  std::vector<FormulaAst::Token> Formula::GetTokens() const {
+    std::vector<FormulaAst::Token> tokens;
+    node_->AppendTokens(tokens);
+    return tokens;
+  }
+
+  size_t Formula::MemoryUsage() const {
+    size_t usage = sizeof(*this) + node_->MemoryUsage() + HeapBytes(ranges_);
+    if (expression_cache_) {
+      usage += HeapBytes(*expression_cache_);
+    }
+    if (referenced_cells_cache_) {
+      usage += HeapBytes(*referenced_cells_cache_);
+    }
+    if (referenced_ranges_cache_) {
+      usage += HeapBytes(*referenced_ranges_cache_);
+    }
+    return usage;
+  }
+
   void Formula::HandleInsertionOrDeletion(IFormula::HandlingResult result) {
     if (result >= IFormula::HandlingResult::ReferencesRenamedOnly) {
       expression_cache_ = std::nullopt;
       referenced_cells_cache_ = std::nullopt;
+      referenced_ranges_cache_ = std::nullopt;
     }
-    if (result == IFormula::HandlingResult::ReferencesChanged) {
-      value_cache_ = std::nullopt;
-    }
-
   }
 
   IFormula::HandlingResult Formula::HandleInsertedRows(int before, int count) {
@@ -491,9 +961,9 @@ namespace Black {
   }
 
   void Formula::InvalidateCache() {
-    value_cache_ = std::nullopt;
     expression_cache_ = std::nullopt;
     referenced_cells_cache_ = std::nullopt;
+    referenced_ranges_cache_ = std::nullopt;
   }
 
   std::unique_ptr<Black::Formula> ParseFormula(std::string expression) {
@@ -522,6 +992,63 @@ namespace Black {
     }
   }
 
+  std::unique_ptr<Black::Formula> BuildFormula(const FormulaAst::Token* first, const FormulaAst::Token* last) {
+    using namespace FormulaAst;
+    std::vector<NodeHolder> nodes;
+    auto pop_node = [&] {
+      if (nodes.empty()) {
+        throw FormulaException("Malformed formula tokens.");
+      }
+      auto node = std::move(nodes.back());
+      nodes.pop_back();
+      return node;
+    };
+
+    for (; first != last; ++first) {
+      switch (first->type) {
+        case Node::Type::Number:
+          nodes.push_back(std::make_unique<Number>(first->value, std::string(first->text)));
+          break;
+        case Node::Type::Cell:
+          nodes.push_back(std::make_unique<FormulaAst::Cell>(first->position));
+          break;
+        case Node::Type::Range:
+          if (first->position.IsValid() != first->last.IsValid()) {
+            throw FormulaException("Malformed formula tokens.");
+          }
+          nodes.push_back(std::make_unique<Range>(first->position, first->last));
+          break;
+        case Node::Type::UnaryPlus:
+        case Node::Type::UnaryMinus:
+          nodes.push_back(MakeUnaryOp(first->type, pop_node()));
+          break;
+        case Node::Type::Call: {
+          if (first->arg_count > nodes.size()) {
+            throw FormulaException("Malformed formula tokens.");
+          }
+          std::vector<NodeHolder> args(
+            std::make_move_iterator(std::end(nodes) - first->arg_count), std::make_move_iterator(std::end(nodes))
+          );
+          nodes.resize(nodes.size() - first->arg_count);
+          nodes.push_back(MakeCall(first->text, std::move(args)));
+          break;
+        }
+        default: {
+          auto right = pop_node();
+          auto left = pop_node();
+          nodes.push_back(MakeBinaryOp(first->type, std::move(left), std::move(right)));
+          break;
+        }
+      }
+    }
+
+    auto node = pop_node();
+    if (!nodes.empty()) {
+      throw FormulaException("Malformed formula tokens.");
+    }
+    return std::make_unique<Black::Formula>(std::move(node));
+  }
+
 } // namespace Black
 
 std::unique_ptr<IFormula> ParseFormula(std::string expression) {
@@ -1,11 +1,19 @@
 #pragma once
 
 #include "formula.h"
+#include "black_position.h"
+#include "black_range_cache.h"
 
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <optional>
+#include <string_view>
 
 namespace Black::FormulaAst {
+  struct Token;
+  class Range;
+  struct FunctionInfo;
 
   class Node : public IFormula {
   public:
@@ -17,15 +25,57 @@ namespace Black::FormulaAst {
       Addition,
       Subtraction,
       Multiplication,
-      Division
+      Division,
+      Range,
+      Call,
+      // Comparisons of numbers, 1 if true and 0 if false. They bind looser
+      // than the arithmetic operators.
+      Equal,
+      NotEqual,
+      Less,
+      LessOrEqual,
+      Greater,
+      GreaterOrEqual
     };
 
     const Type type;
     Node(Type type) : type(type) {}
+
+    // Resolves the referenced positions to the cells of the sheet once, so the
+    // evaluation doesn't have to look them up every time.
+    virtual void BindReferences(const ISheet& sheet) = 0;
+    // Range nodes of the subtree, including the invalid ones. The ranges are
+    // referenced in addition to GetReferencedCells().
+    virtual void AppendRanges(std::vector<Range*>& ranges) = 0;
+    // Writes the subtree in postfix order, see Token.
+    virtual void AppendTokens(std::vector<Token>& tokens) const = 0;
+    // Bytes used by the subtree.
+    virtual size_t MemoryUsage() const = 0;
   };
 
   using NodeHolder = std::unique_ptr<Node>;
 
+  // Formula body in postfix order. Snapshots keep formulas in this form to
+  // restore them without parsing the text.
+  struct Token {
+    Node::Type type;
+    Position position{};   // Cell
+    double value = 0;      // Number
+    std::string_view text; // Number as written in the formula, name of a Call
+    Position last{};       // Range, position is its first cell
+    uint32_t arg_count = 0; // Call, its arguments are the subtrees before it
+  };
+
+  // Value of a cell as an operand: numeric text is converted to a number,
+  // empty text is 0 and other text is #VALUE!.
+  IFormula::Value EvaluateCellValue(const ICell::Value& value);
+
+  NodeHolder MakeUnaryOp(Node::Type type, NodeHolder node);
+  // Throws FormulaException for an unknown function or a wrong number of
+  // arguments.
+  NodeHolder MakeCall(std::string_view name, std::vector<NodeHolder> args);
+  NodeHolder MakeBinaryOp(Node::Type type, NodeHolder left, NodeHolder right);
+
   class Number : public Node {
     double value_;
     const std::string str_representation_;
@@ -36,6 +86,10 @@ namespace Black::FormulaAst {
     std::string GetExpression() const override;
 
     std::vector<Position> GetReferencedCells() const override;
+    void BindReferences(const ISheet& sheet) override;
+    void AppendRanges(std::vector<Range*>& ranges) override;
+    void AppendTokens(std::vector<Token>& tokens) const override;
+    size_t MemoryUsage() const override;
 
     HandlingResult HandleInsertedRows(int before, int count = 1) override;
     HandlingResult HandleInsertedCols(int before, int count = 1) override;
@@ -46,16 +100,108 @@ namespace Black::FormulaAst {
 
   class Cell : public Node {
     Position position_;
+    const ICell* cell_ = nullptr;
 
     HandlingResult HandleInsertedImpl(int& dim, int before, int count);
     HandlingResult HandleDeletedImpl(int& dim, int first, int count);
   public:
     Cell(Position pos);
 
+    // Invalid once the cell is deleted.
+    Position GetPosition() const;
+
+    Value Evaluate(const ISheet& sheet) const override;
+    std::string GetExpression() const override;
+
+    std::vector<Position> GetReferencedCells() const override;
+    void BindReferences(const ISheet& sheet) override;
+    void AppendRanges(std::vector<Range*>& ranges) override;
+    void AppendTokens(std::vector<Token>& tokens) const override;
+    size_t MemoryUsage() const override;
+
+    HandlingResult HandleInsertedRows(int before, int count = 1) override;
+    HandlingResult HandleInsertedCols(int before, int count = 1) override;
+
+    HandlingResult HandleDeletedRows(int first, int count = 1) override;
+    HandlingResult HandleDeletedCols(int first, int count = 1) override;
+  };
+
+  // Rectangular range of cells, e.g. A1:B10. It is only a value for the
+  // functions taking ranges, on its own it evaluates to #VALUE!.
+  class Range : public Node {
+    CellRange range_;
+    RangeCache::Aggregates aggregates_ = RangeCache::Aggregates::None;
+    std::unique_ptr<RangeCache> cache_; // once bound to a Black::Sheet
+
+    HandlingResult HandleInsertedImpl(int Position::* dim, int before, int count);
+    HandlingResult HandleDeletedImpl(int Position::* dim, int first, int count);
+    HandlingResult ResetCacheIfResized(const CellRange& old_range, HandlingResult result);
+  public:
+    // Corners may be given in any order.
+    Range(Position first, Position last);
+
+    bool IsValid() const;
+    const CellRange& GetRange() const;
+
+    // Aggregates the cache keeps for the function taking the range.
+    void SetAggregates(RangeCache::Aggregates aggregates);
+    // Contents of the range kept up to date by the sheet the formula is bound
+    // to, nullptr for an invalid range or before the formula is bound.
+    const RangeCache* GetCache() const;
+    // A cell inside the range was edited, see RangeCache::Update().
+    void HandleCellChanged(Position pos, const RangeInput& before, const RangeInput& after);
+
     Value Evaluate(const ISheet& sheet) const override;
     std::string GetExpression() const override;
 
     std::vector<Position> GetReferencedCells() const override;
+    void BindReferences(const ISheet& sheet) override;
+    void AppendRanges(std::vector<Range*>& ranges) override;
+    void AppendTokens(std::vector<Token>& tokens) const override;
+    size_t MemoryUsage() const override;
+
+    HandlingResult HandleInsertedRows(int before, int count = 1) override;
+    HandlingResult HandleInsertedCols(int before, int count = 1) override;
+
+    HandlingResult HandleDeletedRows(int first, int count = 1) override;
+    HandlingResult HandleDeletedCols(int first, int count = 1) override;
+  };
+
+  // Built-in functions, see black_functions.h.
+  enum class Function {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+    SumProduct,
+    Match,
+    VLookup,
+    If,
+    And,
+    Or,
+    IfError,
+    kCount
+  };
+
+  // Function applied to its arguments, e.g. SUM(A1:A10,B1*2).
+  class Call : public Node {
+    const FunctionInfo* function_;
+    std::vector<NodeHolder> args_;
+
+    template <typename Handler>
+    HandlingResult HandleArgs(Handler&& handler);
+  public:
+    Call(const FunctionInfo& function, std::vector<NodeHolder> args);
+
+    Value Evaluate(const ISheet& sheet) const override;
+    std::string GetExpression() const override;
+
+    std::vector<Position> GetReferencedCells() const override;
+    void BindReferences(const ISheet& sheet) override;
+    void AppendRanges(std::vector<Range*>& ranges) override;
+    void AppendTokens(std::vector<Token>& tokens) const override;
+    size_t MemoryUsage() const override;
 
     HandlingResult HandleInsertedRows(int before, int count = 1) override;
     HandlingResult HandleInsertedCols(int before, int count = 1) override;
@@ -78,6 +224,10 @@ namespace Black::FormulaAst {
     std::string GetExpression() const override;
 
     std::vector<Position> GetReferencedCells() const override;
+    void BindReferences(const ISheet& sheet) override;
+    void AppendRanges(std::vector<Range*>& ranges) override;
+    void AppendTokens(std::vector<Token>& tokens) const override;
+    size_t MemoryUsage() const override;
 
     HandlingResult HandleInsertedRows(int before, int count = 1) override;
     HandlingResult HandleInsertedCols(int before, int count = 1) override;
@@ -91,8 +241,7 @@ namespace Black::FormulaAst {
     NodeHolder right_;
     const std::function<double(double, double)> binary_func_;
 
-    static const char kOpSymbols[];
-    char GetOpSymbol() const;
+    std::string_view GetOpSymbol() const;
 
     enum class ChildNodePos {Left, Right};
     bool AreParenthesesNeeded(Type parent_type, Type child_type, ChildNodePos child_pos) const;
@@ -104,6 +253,10 @@ namespace Black::FormulaAst {
     std::string GetExpression() const override;
 
     std::vector<Position> GetReferencedCells() const override;
+    void BindReferences(const ISheet& sheet) override;
+    void AppendRanges(std::vector<Range*>& ranges) override;
+    void AppendTokens(std::vector<Token>& tokens) const override;
+    size_t MemoryUsage() const override;
 
     HandlingResult HandleInsertedRows(int before, int count = 1) override;
     HandlingResult HandleInsertedCols(int before, int count = 1) override;
@@ -116,9 +269,10 @@ namespace Black::FormulaAst {
 namespace Black {
 class Formula : public IFormula {
     FormulaAst::NodeHolder node_;
-    mutable std::optional<Value> value_cache_;
     mutable std::optional<std::string> expression_cache_;
     mutable std::optional<std::vector<Position>> referenced_cells_cache_;
+    mutable std::optional<std::vector<CellRange>> referenced_ranges_cache_;
+    std::vector<FormulaAst::Range*> ranges_; // the nodes never change once parsed
 
   void HandleInsertionOrDeletion(HandlingResult result);
   public:
@@ -127,6 +281,16 @@ class Formula : public IFormula {
     std::string GetExpression() const override;
 
     std::vector<Position> GetReferencedCells() const override;
+    // Valid ranges referenced by the formula, see FormulaAst::Range.
+    const std::vector<CellRange>& GetReferencedRanges() const;
+    // Range nodes of the formula, including the invalid ones.
+    const std::vector<FormulaAst::Range*>& GetRanges() const;
+    void BindReferences(const ISheet& sheet);
+    // A cell was edited inside some ranges of the formula.
+    void HandleRangeCellChanged(Position pos, const RangeInput& before, const RangeInput& after);
+    std::vector<FormulaAst::Token> GetTokens() const;
+    // Bytes used by the formula, its AST and caches.
+    size_t MemoryUsage() const;
 
     HandlingResult HandleInsertedRows(int before, int count = 1) override;
     HandlingResult HandleInsertedCols(int before, int count = 1) override;
@@ -138,4 +302,7 @@ class Formula : public IFormula {
   };
 
   std::unique_ptr<Black::Formula> ParseFormula(std::string expression);
+  // Rebuilds a formula from the tokens of Formula::GetTokens().
+  // Throws FormulaException if the tokens don't form a single expression.
+  std::unique_ptr<Black::Formula> BuildFormula(const FormulaAst::Token* first, const FormulaAst::Token* last);
 } // namespace Black
@@ -0,0 +1,651 @@
+#include "black_functions.h"
+#include "black_exact_sum.h"
+#include "black_kernels.h"
+#include "black_sheet.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+
+namespace Black::FormulaAst {
+  namespace {
+    using Aggregates = RangeCache::Aggregates;
+
+    // A multiple of Kernels::kLanes, so the values keep their lanes across blocks.
+    constexpr size_t kBlockSize = 256;
+
+    IFormula::Value Finite(double value) {
+      if (std::isfinite(value)) {
+        return value;
+      }
+      return FormulaError(FormulaError::Category::Div0);
+    }
+
+    // Cells read by a reference argument, an invalid range for a deleted one.
+    std::optional<CellRange> GetReference(const Node& arg) {
+      switch (arg.type) {
+        case Node::Type::Cell: {
+          const auto pos = static_cast<const Cell&>(arg).GetPosition();
+          return CellRange{pos, pos};
+        }
+        case Node::Type::Range:
+          return static_cast<const Range&>(arg).GetRange();
+        default:
+          return std::nullopt;
+      }
+    }
+
+    // Calls func(cell) for the cells of the range, row by row. A Black::Sheet
+    // only visits the existing ones.
+    template <typename Func>
+    void ForEachCell(const ISheet& sheet, const CellRange& range, Func&& func) {
+      if (const auto* black_sheet = dynamic_cast<const Black::Sheet*>(&sheet)) {
+        black_sheet->ForEachCellInRange(range, [&] (Position, const Black::Cell* cell) { func(*cell); });
+        return;
+      }
+      const auto size = sheet.GetPrintableSize();
+      for (int row = range.first.row; row <= std::min(range.last.row, size.rows - 1); ++row) {
+        for (int col = range.first.col; col <= std::min(range.last.col, size.cols - 1); ++col) {
+          if (const auto* cell = sheet.GetCell({row, col})) {
+            func(*cell);
+          }
+        }
+      }
+    }
+
+    bool IsEmpty(const ICell::Value& value) {
+      const auto* text = std::get_if<std::string>(&value);
+      return text && text->empty();
+    }
+
+    // Numbers of the arguments of SUM, AVERAGE, MIN, MAX or COUNT. Only the
+    // parts the function needs are computed.
+    struct Totals {
+      bool needs_sum = false;
+      bool needs_order = false;
+      uint64_t count = 0;
+      ExactSum sum;
+      double min = std::numeric_limits<double>::infinity();
+      double max = -std::numeric_limits<double>::infinity();
+      bool has_nan = false;
+    };
+
+    // Adds the numbers of the arguments to the totals, gathering them in
+    // blocks for the kernels. Returns the first error unless errors are
+    // skipped. Ranges with a cache take the text cells from it and only read
+    // their formula cells.
+    std::optional<FormulaError> AddNumbers(Args args, const ISheet& sheet,
+                                           bool skip_errors, Totals& totals)
+    {
+      const auto& kernels = Kernels::GetKernels();
+      double block[kBlockSize];
+      size_t size = 0;
+      auto flush = [&] {
+        totals.count += size;
+        if (totals.needs_sum) {
+          totals.sum.Add(block, size);
+        }
+        if (totals.needs_order) {
+          totals.min = kernels.min(block, size, totals.min);
+          totals.max = kernels.max(block, size, totals.max);
+        }
+        size = 0;
+      };
+      std::optional<FormulaError> error;
+      auto add = [&] (const IFormula::Value& value) {
+        if (const auto* number = std::get_if<double>(&value)) {
+          totals.has_nan = totals.has_nan || std::isnan(*number);
+          block[size++] = *number;
+          if (size == kBlockSize) {
+            flush();
+          }
+        } else if (!skip_errors) {
+          error = std::get<FormulaError>(value);
+        }
+      };
+      auto add_cached = [&] (const RangeCache::Contents& contents) {
+        std::optional<std::pair<uint64_t, FormulaError>> first_error;
+        if (!skip_errors && !contents.errors.empty()) {
+          first_error = *contents.errors.begin();
+        }
+        for (const auto& [offset, cell] : contents.formula_cells) {
+          if (first_error && offset > first_error->first) {
+            break;
+          }
+          const auto value = EvaluateCellValue(cell->GetValue());
+          if (std::holds_alternative<double>(value)) {
+            add(value);
+          } else if (!skip_errors) {
+            first_error.emplace(offset, std::get<FormulaError>(value));
+            break;
+          }
+        }
+        if (first_error) {
+          error = first_error->second;
+          return;
+        }
+        totals.count += contents.count;
+        if (totals.needs_sum) {
+          totals.sum.Add(contents.sum);
+        }
+        if (totals.needs_order && !contents.numbers.empty()) {
+          totals.min = std::min(totals.min, *contents.numbers.begin());
+          totals.max = std::max(totals.max, *contents.numbers.rbegin());
+        }
+        totals.has_nan = totals.has_nan || contents.nan_count;
+      };
+
+      for (const auto& arg : args) {
+        const auto* cache = arg->type == Node::Type::Range ? static_cast<const Range&>(*arg).GetCache() : nullptr;
+        if (cache) {
+          add_cached(cache->Get(static_cast<const Range&>(*arg).GetRange()));
+        } else if (const auto range = GetReference(*arg)) {
+          if (!range->first.IsValid()) {
+            add(FormulaError(FormulaError::Category::Ref));
+          } else {
+            ForEachCell(sheet, *range, [&] (const ICell& cell) {
+              if (error) {
+                return;
+              }
+              const auto value = cell.GetValue();
+              if (!IsEmpty(value)) {
+                add(EvaluateCellValue(value));
+              }
+            });
+          }
+        } else {
+          add(arg->Evaluate(sheet));
+        }
+        if (error) {
+          return error;
+        }
+      }
+      flush();
+      return std::nullopt;
+    }
+
+    // Reads the values of rows cells from first down, empty cells being 0.
+    // Returns the row and the error of the first error. A Black::Sheet reads
+    // its numeric columns and only looks up formula cells.
+    std::optional<std::pair<int, FormulaError>> ReadColumn(const ISheet& sheet, Position first, int rows,
+                                                           double* values) {
+      std::fill(values, values + rows, 0.0);
+      std::optional<std::pair<int, FormulaError>> error;
+      auto read = [&] (int row, const ICell& cell) {
+        const auto value = cell.GetValue();
+        if (IsEmpty(value)) {
+          return;
+        }
+        const auto number = EvaluateCellValue(value);
+        if (const auto* number_error = std::get_if<FormulaError>(&number)) {
+          error.emplace(row, *number_error);
+        } else {
+          values[row] = std::get<double>(number);
+        }
+      };
+
+      if (const auto* black_sheet = dynamic_cast<const Black::Sheet*>(&sheet)) {
+        const CellRange range{first, {first.row + rows - 1, first.col}};
+        black_sheet->ForEachColumnRun(range, [&] (Position pos, const NumericColumn& column, int begin, int end) {
+          if (error) {
+            return;
+          }
+          const int offset = pos.row - first.row;
+          std::copy(column.Numbers() + begin, column.Numbers() + end, values + offset);
+          column.ForEachOther(begin, end, [&] (int row, NumericColumn::Kind kind) {
+            const int i = offset + row - begin;
+            if (error) {
+              return;
+            }
+            if (kind == NumericColumn::Kind::Error) {
+              error.emplace(i, FormulaError(FormulaError::Category::Value));
+            } else {
+              read(i, *black_sheet->GetCellImpl({first.row + i, first.col}));
+            }
+          });
+        });
+        return error;
+      }
+      for (int row = 0; row < rows && !error; ++row) {
+        if (const auto* cell = sheet.GetCell({first.row + row, first.col})) {
+          read(row, *cell);
+        }
+      }
+      return error;
+    }
+
+    IFormula::Value SumProduct(Args args, const ISheet& sheet) {
+      std::vector<CellRange> ranges;
+      for (const auto& arg : args) {
+        const auto range = GetReference(*arg);
+        if (!range) {
+          return FormulaError(FormulaError::Category::Value);
+        }
+        if (!range->first.IsValid()) {
+          return FormulaError(FormulaError::Category::Ref);
+        }
+        ranges.push_back(*range);
+      }
+      const int rows = ranges[0].last.row - ranges[0].first.row + 1;
+      const int cols = ranges[0].last.col - ranges[0].first.col + 1;
+      // Cells beyond the printable area are empty, their products are 0.
+      const auto printable = sheet.GetPrintableSize();
+      int scan_rows = 0;
+      int scan_cols = 0;
+      for (const auto& range : ranges) {
+        if (range.last.row - range.first.row + 1 != rows || range.last.col - range.first.col + 1 != cols) {
+          return FormulaError(FormulaError::Category::Value);
+        }
+        scan_rows = std::max(scan_rows, std::min(rows, printable.rows - range.first.row));
+        scan_cols = std::max(scan_cols, std::min(cols, printable.cols - range.first.col));
+      }
+
+      // Column by column: products of all the ranges but the last one, and the
+      // column being read.
+      std::vector<double> products(std::max(scan_rows, 0));
+      std::vector<double> column_values(products.size());
+      // The first error row by row, as (row, range, column).
+      std::optional<std::pair<std::tuple<int, size_t, int>, FormulaError>> first_error;
+      const auto& kernels = Kernels::GetKernels();
+      Kernels::SumState sum;
+      for (int col = 0; col < scan_cols && scan_rows > 0; ++col) {
+        for (size_t i = 0; i < ranges.size(); ++i) {
+          auto& values = i == 0 ? products : column_values;
+          const Position first{ranges[i].first.row, ranges[i].first.col + col};
+          if (const auto error = ReadColumn(sheet, first, scan_rows, values.data())) {
+            const auto key = std::make_tuple(error->first, i, col);
+            if (!first_error || key < first_error->first) {
+              first_error.emplace(key, error->second);
+            }
+          }
+          if (i > 0 && i + 1 < ranges.size()) {
+            std::transform(std::begin(products), std::end(products), std::begin(column_values),
+                           std::begin(products), std::multiplies<>{});
+          }
+        }
+        if (first_error) {
+          continue;
+        }
+        if (ranges.size() == 1) {
+          kernels.sum(products.data(), products.size(), sum);
+        } else {
+          kernels.sum_products(products.data(), column_values.data(), products.size(), sum);
+        }
+      }
+      if (first_error) {
+        return first_error->second;
+      }
+      return Finite(sum.Total());
+    }
+
+    enum class MatchType {
+      Exact,
+      NotAbove, // the largest number not above the one looked up
+      NotBelow  // the smallest number not below it
+    };
+
+    // A number found at an offset of the range looked up.
+    struct Match {
+      double number;
+      int offset;
+    };
+
+    // Whether the number at the offset matches better than the best match so
+    // far. Equal numbers match best at their first offset.
+    bool IsBetterMatch(MatchType type, double looked_up, double number, int offset, const std::optional<Match>& best) {
+      if (std::isnan(number)) {
+        return false;
+      }
+      switch (type) {
+        case MatchType::Exact:
+          return number == looked_up && (!best || offset < best->offset);
+        case MatchType::NotAbove:
+          return number <= looked_up
+                 && (!best || number > best->number || (number == best->number && offset < best->offset));
+        case MatchType::NotBelow:
+          return number >= looked_up
+                 && (!best || number < best->number || (number == best->number && offset < best->offset));
+      }
+      return false;
+    }
+
+    std::optional<double> GetNumber(const ICell& cell) {
+      const auto value = cell.GetValue();
+      if (IsEmpty(value)) {
+        return std::nullopt;
+      }
+      const auto number = EvaluateCellValue(value);
+      if (const auto* result = std::get_if<double>(&number)) {
+        return *result;
+      }
+      return std::nullopt;
+    }
+
+    // Looks the number up in a one column range of a Black::Sheet: the text
+    // cells with the lookup index of the column, then the formula cells.
+    std::optional<Match> FindInColumn(const Black::Sheet& sheet, const CellRange& range, double looked_up,
+                                      MatchType type) {
+      const auto kind = type == MatchType::Exact ? LookupIndex::Kind::Exact : LookupIndex::Kind::Ordered;
+      const auto* index = sheet.GetLookupIndex(range.first.col, kind);
+      if (!index) {
+        return std::nullopt;
+      }
+      const int first_row = range.first.row;
+      const int last_row = range.last.row;
+      std::optional<Match> best;
+      if (type == MatchType::Exact) {
+        if (const auto row = index->FindFirst(looked_up, first_row, last_row)) {
+          best = Match{looked_up, *row - first_row};
+        }
+      } else {
+        const auto entry = type == MatchType::NotAbove ? index->FindNotAbove(looked_up, first_row, last_row)
+                                                       : index->FindNotBelow(looked_up, first_row, last_row);
+        if (entry) {
+          best = Match{entry->number, entry->row - first_row};
+        }
+      }
+      const auto& formula_rows = index->GetFormulaRows();
+      for (auto it = formula_rows.lower_bound(first_row); it != formula_rows.end() && *it <= last_row; ++it) {
+        const int offset = *it - first_row;
+        if (type == MatchType::Exact && best && offset > best->offset) {
+          break;
+        }
+        const auto number = GetNumber(*sheet.GetCellImpl({*it, range.first.col}));
+        if (number && IsBetterMatch(type, looked_up, *number, offset, best)) {
+          best = Match{*number, offset};
+        }
+      }
+      return best;
+    }
+
+    // Looks the number up in a one row or one column range, cells which are
+    // not numbers never match.
+    std::optional<Match> Find(const ISheet& sheet, const CellRange& range, double looked_up, MatchType type) {
+      const bool is_column = range.first.col == range.last.col;
+      if (const auto* black_sheet = dynamic_cast<const Black::Sheet*>(&sheet); black_sheet && is_column) {
+        return FindInColumn(*black_sheet, range, looked_up, type);
+      }
+      // Cells beyond the printable area are empty.
+      const auto printable = sheet.GetPrintableSize();
+      const int size = is_column ? std::min(range.last.row, printable.rows - 1) - range.first.row + 1
+                                 : std::min(range.last.col, printable.cols - 1) - range.first.col + 1;
+      std::optional<Match> best;
+      for (int offset = 0; offset < size; ++offset) {
+        const Position pos = is_column ? Position{range.first.row + offset, range.first.col}
+                                       : Position{range.first.row, range.first.col + offset};
+        const auto* cell = sheet.GetCell(pos);
+        const auto number = cell ? GetNumber(*cell) : std::nullopt;
+        if (number && IsBetterMatch(type, looked_up, *number, offset, best)) {
+          best = Match{*number, offset};
+          if (type == MatchType::Exact) {
+            break;
+          }
+        }
+      }
+      return best;
+    }
+
+    // MATCH(number, range[, type]) and VLOOKUP(number, table, column[, approximate]).
+    template <Function function>
+    IFormula::Value Lookup(Args args, const ISheet& sheet) {
+      const auto looked_up = args[0]->Evaluate(sheet);
+      if (const auto* error = std::get_if<FormulaError>(&looked_up)) {
+        return *error;
+      }
+      const auto range = GetReference(*args[1]);
+      if (!range) {
+        return FormulaError(FormulaError::Category::Value);
+      }
+      if (!range->first.IsValid()) {
+        return FormulaError(FormulaError::Category::Ref);
+      }
+      // At most the match type, or the column and the match type.
+      std::array<double, 2> numbers{};
+      for (size_t i = 2; i < args.size(); ++i) {
+        const auto number = args[i]->Evaluate(sheet);
+        if (const auto* error = std::get_if<FormulaError>(&number)) {
+          return *error;
+        }
+        if (std::isnan(std::get<double>(number))) {
+          return FormulaError(FormulaError::Category::Value);
+        }
+        numbers[i - 2] = std::get<double>(number);
+      }
+      const double number = std::get<double>(looked_up);
+      if (std::isnan(number)) {
+        return FormulaError(FormulaError::Category::NA);
+      }
+
+      if constexpr (function == Function::Match) {
+        const double match_type = args.size() > 2 ? numbers[0] : 1;
+        const auto type = match_type > 0 ? MatchType::NotAbove
+                        : match_type < 0 ? MatchType::NotBelow
+                        : MatchType::Exact;
+        if (range->first.row != range->last.row && range->first.col != range->last.col) {
+          return FormulaError(FormulaError::Category::NA);
+        }
+        if (const auto match = Find(sheet, *range, number, type)) {
+          return double(match->offset + 1);
+        }
+        return FormulaError(FormulaError::Category::NA);
+      }
+
+      const double column = std::trunc(numbers[0]);
+      if (column < 1) {
+        return FormulaError(FormulaError::Category::Value);
+      }
+      if (column > range->last.col - range->first.col + 1) {
+        return FormulaError(FormulaError::Category::Ref);
+      }
+      const bool approximate = args.size() < 4 || numbers[1] != 0;
+      const CellRange keys{range->first, {range->last.row, range->first.col}};
+      const auto match = Find(sheet, keys, number, approximate ? MatchType::NotAbove : MatchType::Exact);
+      if (!match) {
+        return FormulaError(FormulaError::Category::NA);
+      }
+      // Read like a Cell node.
+      const auto* cell = sheet.GetCell({range->first.row + match->offset, range->first.col + int(column) - 1});
+      return cell ? EvaluateCellValue(cell->GetValue()) : 0.0;
+    }
+
+    // IF, AND, OR and IFERROR evaluate their arguments in order until the
+    // result is known, the skipped ones don't compute the cells they read.
+
+    // IF(condition, then[, else]).
+    IFormula::Value If(Args args, const ISheet& sheet) {
+      const auto condition = args[0]->Evaluate(sheet);
+      if (const auto* error = std::get_if<FormulaError>(&condition)) {
+        return *error;
+      }
+      if (std::get<double>(condition) != 0) {
+        return args[1]->Evaluate(sheet);
+      }
+      return args.size() > 2 ? args[2]->Evaluate(sheet) : 0.0;
+    }
+
+    // IFERROR(value, fallback).
+    IFormula::Value IfError(Args args, const ISheet& sheet) {
+      auto value = args[0]->Evaluate(sheet);
+      if (std::holds_alternative<FormulaError>(value)) {
+        return args[1]->Evaluate(sheet);
+      }
+      return value;
+    }
+
+    // AND stops at the first false argument, OR at the first true one.
+    template <Function function>
+    IFormula::Value Logical(Args args, const ISheet& sheet) {
+      constexpr bool decisive = function == Function::Or;
+      for (const auto& arg : args) {
+        const auto value = arg->Evaluate(sheet);
+        if (const auto* error = std::get_if<FormulaError>(&value)) {
+          return *error;
+        }
+        if ((std::get<double>(value) != 0) == decisive) {
+          return double(decisive);
+        }
+      }
+      return double(!decisive);
+    }
+
+    // SUM, AVERAGE, MIN, MAX and COUNT.
+    template <Function function>
+    IFormula::Value Aggregate(Args args, const ISheet& sheet) {
+      Totals totals;
+      totals.needs_sum = function == Function::Sum || function == Function::Average;
+      totals.needs_order = function == Function::Min || function == Function::Max;
+      if (const auto error = AddNumbers(args, sheet, function == Function::Count, totals)) {
+        return *error;
+      }
+      if constexpr (function == Function::Sum) {
+        return Finite(totals.sum.Total());
+      } else if constexpr (function == Function::Average) {
+        if (!totals.count) {
+          return FormulaError(FormulaError::Category::Div0);
+        }
+        return Finite(totals.sum.Total() / totals.count);
+      } else if constexpr (function == Function::Min || function == Function::Max) {
+        if (totals.has_nan) {
+          return FormulaError(FormulaError::Category::Div0);
+        }
+        const double result = !totals.count ? 0.0 : function == Function::Min ? totals.min : totals.max;
+        // Zeros of both signs compare equal, which one is found first depends
+        // on the kernel or the cache.
+        return Finite(result == 0 ? 0.0 : result);
+      } else {
+        static_assert(function == Function::Count);
+        return double(totals.count);
+      }
+    }
+
+    // Indexed by Function.
+    constexpr FunctionInfo kFunctions[] = {
+      {"SUM", 1, kAnyArgCount, Aggregates::Totals, Aggregate<Function::Sum>},
+      {"AVERAGE", 1, kAnyArgCount, Aggregates::Totals, Aggregate<Function::Average>},
+      {"MIN", 1, kAnyArgCount, Aggregates::Ordered, Aggregate<Function::Min>},
+      {"MAX", 1, kAnyArgCount, Aggregates::Ordered, Aggregate<Function::Max>},
+      {"COUNT", 1, kAnyArgCount, Aggregates::Totals, Aggregate<Function::Count>},
+      {"SUMPRODUCT", 1, kAnyArgCount, Aggregates::None, SumProduct},
+      {"MATCH", 2, 3, Aggregates::None, Lookup<Function::Match>},
+      {"VLOOKUP", 3, 4, Aggregates::None, Lookup<Function::VLookup>},
+      {"IF", 2, 3, Aggregates::None, If},
+      {"AND", 1, kAnyArgCount, Aggregates::None, Logical<Function::And>},
+      {"OR", 1, kAnyArgCount, Aggregates::None, Logical<Function::Or>},
+      {"IFERROR", 2, 2, Aggregates::None, IfError},
+    };
+
+    constexpr bool AreValidFunctions() {
+      for (size_t i = 0; i < std::size(kFunctions); ++i) {
+        if (!IsValidFunction(kFunctions[i])) {
+          return false;
+        }
+        for (size_t j = 0; j < i; ++j) {
+          if (kFunctions[i].name == kFunctions[j].name) {
+            return false;
+          }
+        }
+      }
+      return true;
+    }
+
+    // Names of the Function values, whatever order kFunctions is written in.
+    constexpr std::pair<Function, std::string_view> kFunctionNames[] = {
+      {Function::Sum, "SUM"},
+      {Function::Average, "AVERAGE"},
+      {Function::Min, "MIN"},
+      {Function::Max, "MAX"},
+      {Function::Count, "COUNT"},
+      {Function::SumProduct, "SUMPRODUCT"},
+      {Function::Match, "MATCH"},
+      {Function::VLookup, "VLOOKUP"},
+      {Function::If, "IF"},
+      {Function::And, "AND"},
+      {Function::Or, "OR"},
+      {Function::IfError, "IFERROR"},
+    };
+
+    constexpr bool IsIndexedByFunction() {
+      for (const auto& [function, name] : kFunctionNames) {
+        if (kFunctions[size_t(function)].name != name) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    static_assert(std::size(kFunctions) == size_t(Function::kCount), "every Function needs an entry");
+    static_assert(std::size(kFunctionNames) == size_t(Function::kCount), "every Function needs a name");
+    static_assert(AreValidFunctions(), "invalid or duplicate built-in function");
+    static_assert(IsIndexedByFunction(), "kFunctions is out of the order of Function");
+
+    // Functions registered by the application, found by name only when
+    // formulas are built.
+    class Registry {
+      std::shared_mutex mutex_;
+      std::deque<std::string> names_;
+      std::deque<FunctionInfo> functions_; // never move, Call nodes point to them
+      std::unordered_map<std::string_view, const FunctionInfo*> by_name_;
+
+    public:
+      void Add(const FunctionInfo& info) {
+        std::unique_lock lock(mutex_);
+        if (by_name_.count(info.name)) {
+          throw FormulaException("Function " + std::string(info.name) + " is already registered.");
+        }
+        auto& function = functions_.emplace_back(info);
+        function.name = names_.emplace_back(info.name);
+        by_name_.emplace(function.name, &function);
+      }
+
+      const FunctionInfo* Find(std::string_view name) {
+        std::shared_lock lock(mutex_);
+        const auto it = by_name_.find(name);
+        return it == by_name_.end() ? nullptr : it->second;
+      }
+    };
+
+    Registry& GetRegistry() {
+      static Registry registry;
+      return registry;
+    }
+
+    const FunctionInfo* FindBuiltInFunction(std::string_view name) {
+      for (const auto& function : kFunctions) {
+        if (function.name == name) {
+          return &function;
+        }
+      }
+      return nullptr;
+    }
+  }
+
+  const FunctionInfo& GetFunction(Function function) {
+    return kFunctions[size_t(function)];
+  }
+
+  void RegisterFunction(const FunctionInfo& info) {
+    if (!IsValidFunction(info) || !info.impl) {
+      throw FormulaException("Invalid function " + std::string(info.name) + ".");
+    }
+    if (FindBuiltInFunction(info.name)) {
+      throw FormulaException("Function " + std::string(info.name) + " is built in.");
+    }
+    GetRegistry().Add(info);
+  }
+
+  const FunctionInfo* FindFunction(std::string_view name) {
+    if (const auto* function = FindBuiltInFunction(name)) {
+      return function;
+    }
+    return GetRegistry().Find(name);
+  }
+} // namespace Black::FormulaAst
@@ -0,0 +1,85 @@
+#pragma once
+#include "black_formula.h"
+#include "black_range.h"
+
+#include <cstddef>
+#include <limits>
+#include <string_view>
+
+namespace Black::FormulaAst {
+// Arguments of a call, a view of the argument nodes stored contiguously in the
+// Call node. A function evaluates the ones it needs or reads the cells of the
+// references.
+using Args = ::Range<const NodeHolder*>;
+using FunctionImpl = IFormula::Value (*)(Args args, const ISheet& sheet);
+
+inline constexpr size_t kAnyArgCount = std::numeric_limits<size_t>::max();
+
+// Function callable from formulas as NAME(args...). A Call node is bound to
+// it once, when the formula is parsed or rebuilt from tokens, and evaluates by
+// calling impl directly.
+struct FunctionInfo {
+  std::string_view name;                   // [A-Z]+, like NAME in Formula.g4
+  size_t min_arg_count;
+  size_t max_arg_count;                    // kAnyArgCount if not limited
+  RangeCache::Aggregates range_aggregates; // what the caches of the range arguments keep
+  FunctionImpl impl;                       // always called with an allowed number of arguments
+};
+
+// Whether the name and the argument counts are valid. Checked for the built-in
+// functions at compile time, applications can static_assert it for theirs.
+constexpr bool IsValidFunction(const FunctionInfo& info) {
+  if (info.name.empty() || info.min_arg_count > info.max_arg_count) {
+    return false;
+  }
+  for (char c : info.name) {
+    if (c < 'A' || c > 'Z') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Built-in functions. SUM, AVERAGE, MIN, MAX and COUNT take any mix of ranges,
+// cell references and expressions:
+// * referenced cells are read like by a Cell node (numeric text is a number,
+//   other text is #VALUE!), except that empty cells are skipped;
+// * the first error of the arguments, in order, is the result, COUNT skips
+//   errors and counts the numbers only;
+// * MIN/MAX of no numbers is 0, AVERAGE of no numbers is #DIV/0!;
+// * SUM and AVERAGE add exactly, see ExactSum, so the result doesn't depend on
+//   the order of the numbers or on the edits the cached sums went through;
+// * infinities and NaNs make the result #DIV/0!, like any non-finite result.
+// SUMPRODUCT takes references of the same size and sums the products of the
+// cells at the same offsets, empty cells being 0.
+// MATCH(number, range[, type]) gives the 1-based offset of the number in a one
+// row or one column range and VLOOKUP(number, table, column[, approximate])
+// the cell in the given column of the row holding the number in the first
+// column of the table. Only numbers match, the first one of equal numbers:
+// * MATCH type 0 and VLOOKUP approximate 0 look for the number itself;
+// * MATCH type 1 (the default) and VLOOKUP approximate non-zero (the default)
+//   take the largest number not above it, MATCH type -1 the smallest number
+//   not below it; unlike in Excel the range doesn't need to be sorted;
+// * #N/A when nothing matches.
+// Lookups in a column of a Black::Sheet use its LookupIndex and read only the
+// formula cells of the range.
+// Ranges bound to a Black::Sheet read the text cells from their RangeCache,
+// which is built from the NumericColumns of the sheet, SUMPRODUCT reads the
+// columns directly. Other numbers are gathered in blocks for the kernels of
+// black_kernels.h.
+// IF(condition, then[, else]) gives then if the condition is not 0 and else
+// (0 by default) otherwise, AND and OR give 1 or 0 and IFERROR(value, fallback)
+// gives the fallback if the value is an error. They take expressions, a range
+// is #VALUE!, and evaluate only the arguments needed for the result: AND stops
+// at the first 0 and OR at the first non-zero argument, so unlike in Excel an
+// error after them is not the result. The formula still references the cells
+// of every argument, only the evaluation is lazy.
+const FunctionInfo& GetFunction(Function function);
+// Makes the function callable from the formulas parsed from now on, e.g. by an
+// application embedding the sheet. Functions can't be unregistered, the Call
+// nodes keep pointing to them. Throws FormulaException if the function isn't
+// valid or the name is taken.
+void RegisterFunction(const FunctionInfo& info);
+// Built-in or registered function, nullptr if there is none.
+const FunctionInfo* FindFunction(std::string_view name);
+} // namespace Black::FormulaAst
@@ -0,0 +1,87 @@
+#include "black_import.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace Black {
+  namespace {
+    constexpr size_t kBlockSize = 1 << 20;
+
+    // Reads the input in large blocks and calls on_line for every line without
+    // the line break. Only a line crossing a block boundary is copied.
+    template <typename LineFunc>
+    void ForEachLine(std::istream& input, LineFunc&& on_line) {
+      std::vector<char> block(kBlockSize);
+      size_t kept = 0; // beginning of an unfinished line moved to the block start
+
+      while (input) {
+        input.read(block.data() + kept, block.size() - kept);
+        const size_t size = kept + input.gcount();
+        if (size == kept && !input) {
+          break;
+        }
+
+        std::string_view data(block.data(), size);
+        for (auto eol = data.find('\n'); eol != std::string_view::npos; eol = data.find('\n')) {
+          on_line(data.substr(0, eol));
+          data.remove_prefix(eol + 1);
+        }
+
+        kept = data.size();
+        std::memmove(block.data(), data.data(), kept);
+        if (kept == block.size()) {
+          block.resize(block.size() * 2);
+        }
+      }
+      if (kept) {
+        on_line(std::string_view(block.data(), kept));
+      }
+    }
+
+    Size CountSize(std::istream& input) {
+      Size size{};
+      ForEachLine(input, [&] (std::string_view line) {
+        ++size.rows;
+        size.cols = std::max<int>(size.cols, std::count(std::begin(line), std::end(line), '\t') + 1);
+      });
+      return size;
+    }
+  }
+
+  void ImportTsv(std::istream& input, Sheet& sheet) {
+    // Seekable inputs are scanned twice: the first pass only counts rows and
+    // columns so the storage is allocated at once.
+    if (const auto start = input.tellg(); start != std::istream::pos_type(-1)) {
+      sheet.Reserve(CountSize(input));
+      input.clear();
+      input.seekg(start);
+    }
+
+    int row = 0;
+    ForEachLine(input, [&] (std::string_view line) {
+      if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+      }
+      for (int col = 0; !line.empty(); ++col) {
+        const auto field = line.substr(0, line.find('\t'));
+        if (!field.empty()) {
+          sheet.SetCell({row, col}, std::string(field));
+        }
+        line.remove_prefix(std::min(field.size() + 1, line.size()));
+      }
+      ++row;
+    });
+  }
+
+  void ImportTsv(const std::filesystem::path& path, Sheet& sheet) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+      throw std::runtime_error("cannot open " + path.string());
+    }
+    ImportTsv(input, sheet);
+  }
+} // namespace Black
@@ -0,0 +1,17 @@
+#pragma once
+#include "black_sheet.h"
+
+#include <istream>
+#include <filesystem>
+
+namespace Black {
+  // Fills the sheet from tab separated rows, the format written by
+  // Sheet::PrintTexts. Empty fields leave the cells untouched, '\r' before a
+  // line break is ignored. Formula and position errors are reported by the same
+  // exceptions SetCell throws.
+  // Seekable inputs are counted first to Reserve the sheet; every field is
+  // still set through SetCell, so formulas are parsed and linked one by one
+  // and the import is bound by that rather than by reading the input.
+  void ImportTsv(std::istream& input, Sheet& sheet);
+  void ImportTsv(const std::filesystem::path& path, Sheet& sheet);
+} // namespace Black
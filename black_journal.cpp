@@ -0,0 +1,418 @@
+#include "black_journal.h"
+#include "black_snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string_view>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace Black {
+  namespace {
+    struct RecordHeader {
+      uint32_t checksum; // of the rest of the header and the text
+      uint32_t text_size;
+      uint64_t seq;
+      uint32_t op;
+      int32_t first;
+      int32_t second;
+      uint32_t reserved;
+    };
+    static_assert(sizeof(RecordHeader) == 32);
+
+    constexpr std::string_view kCheckpointPrefix = "checkpoint-";
+    constexpr std::string_view kCheckpointSuffix = ".snap";
+    constexpr std::string_view kJournalPrefix = "journal-";
+    constexpr std::string_view kJournalSuffix = ".log";
+
+    fs::path FileName(std::string_view prefix, uint64_t seq, std::string_view suffix) {
+      return std::string(prefix) + std::to_string(seq) + std::string(suffix);
+    }
+
+    std::optional<uint64_t> ParseFileName(const std::string& name, std::string_view prefix, std::string_view suffix) {
+      if (name.size() <= prefix.size() + suffix.size()
+          || name.compare(0, prefix.size(), prefix) != 0
+          || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+        return std::nullopt;
+      }
+      const auto seq = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+      if (!std::all_of(std::begin(seq), std::end(seq), [] (char c) { return c >= '0' && c <= '9'; })) {
+        return std::nullopt;
+      }
+      return std::stoull(seq);
+    }
+
+    // FNV-1a
+    uint32_t Checksum(const RecordHeader& header, std::string_view text) {
+      uint32_t hash = 2166136261u;
+      auto add = [&] (const char* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+          hash = (hash ^ uint8_t(data[i])) * 16777619u;
+        }
+      };
+      const auto* bytes = reinterpret_cast<const char*>(&header);
+      add(bytes + sizeof(header.checksum), sizeof(header) - sizeof(header.checksum));
+      add(text.data(), text.size());
+      return hash;
+    }
+
+    // Unbuffered file opened for writing, with optional fsync after writes.
+    class OutputFile {
+      int fd_ = -1;
+      bool fsync_;
+
+    public:
+      OutputFile(const fs::path& path, bool truncate, bool fsync) : fsync_(fsync) {
+        const int flags = O_WRONLY | O_CREAT | (truncate ? O_TRUNC : O_APPEND);
+#ifdef _WIN32
+        fd_ = ::_wopen(path.c_str(), flags | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        fd_ = ::open(path.c_str(), flags, 0644);
+#endif
+        if (fd_ < 0) {
+          throw std::runtime_error("cannot open " + path.string());
+        }
+      }
+
+      ~OutputFile() {
+#ifdef _WIN32
+        ::_close(fd_);
+#else
+        ::close(fd_);
+#endif
+      }
+
+      OutputFile(const OutputFile&) = delete;
+      OutputFile& operator=(const OutputFile&) = delete;
+
+      void Write(const std::vector<char>& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+#ifdef _WIN32
+          const auto result = ::_write(fd_, data.data() + written, unsigned(data.size() - written));
+#else
+          const auto result = ::write(fd_, data.data() + written, data.size() - written);
+#endif
+          if (result < 0) {
+            throw std::runtime_error("journal write failed");
+          }
+          written += result;
+        }
+        if (fsync_ && !data.empty()) {
+#ifdef _WIN32
+          const int result = ::_commit(fd_);
+#else
+          const int result = ::fsync(fd_);
+#endif
+          if (result != 0) {
+            throw std::runtime_error("journal fsync failed");
+          }
+        }
+      }
+    };
+
+    void SyncDirectory(const fs::path& dir) {
+#ifndef _WIN32
+      const int fd = ::open(dir.c_str(), O_RDONLY);
+      if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+      }
+#endif
+    }
+  }
+
+  JournaledSheet::JournaledSheet(fs::path dir, JournalOptions options)
+    : dir_(std::move(dir))
+    , options_(options)
+  {
+    Recover();
+    writer_ = std::thread([this] { WriterLoop(); });
+  }
+
+  JournaledSheet::~JournaledSheet() {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    wake_writer_.notify_one();
+    writer_.join();
+  }
+
+  void JournaledSheet::Recover() {
+    fs::create_directories(dir_);
+
+    std::optional<uint64_t> checkpoint_seq;
+    std::vector<std::pair<uint64_t, fs::path>> journals;
+    for (const auto& entry : fs::directory_iterator(dir_)) {
+      const auto name = entry.path().filename().string();
+      if (const auto seq = ParseFileName(name, kCheckpointPrefix, kCheckpointSuffix)) {
+        checkpoint_seq = std::max(checkpoint_seq.value_or(0), *seq);
+      } else if (const auto seq = ParseFileName(name, kJournalPrefix, kJournalSuffix)) {
+        journals.emplace_back(*seq, entry.path());
+      }
+    }
+
+    uint64_t last_seq = 0;
+    if (checkpoint_seq) {
+      LoadSnapshot(dir_ / FileName(kCheckpointPrefix, *checkpoint_seq, kCheckpointSuffix), sheet_);
+      last_seq = *checkpoint_seq;
+    }
+
+    // A journal ends with the first incomplete or damaged record, which is
+    // where writing was interrupted, or with a gap in the sequence. Whatever
+    // follows is cut off so that new records are not appended after it.
+    std::sort(std::begin(journals), std::end(journals));
+    bool complete = true;
+    for (const auto& [start_seq, path] : journals) {
+      if (!complete) {
+        fs::remove(path);
+        continue;
+      }
+      std::ifstream input(path, std::ios::binary);
+      const std::string data{std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()};
+      input.close();
+      std::string_view records = data;
+      size_t valid_size = 0;
+      while (records.size() >= sizeof(RecordHeader)) {
+        RecordHeader header;
+        std::memcpy(&header, records.data(), sizeof(header));
+        if (header.text_size > records.size() - sizeof(header)) {
+          break;
+        }
+        const auto text = records.substr(sizeof(header), header.text_size);
+        if (header.checksum != Checksum(header, text) || header.seq > last_seq + 1) {
+          break;
+        }
+        if (header.seq == last_seq + 1) {
+          Apply(Op(header.op), header.first, header.second, std::string(text));
+          last_seq = header.seq;
+        }
+        records.remove_prefix(sizeof(header) + header.text_size);
+        valid_size = data.size() - records.size();
+      }
+      if (valid_size != data.size()) {
+        fs::resize_file(path, valid_size);
+        complete = false;
+      }
+    }
+
+    next_seq_ = last_seq + 1;
+    written_seq_ = last_seq;
+    journal_start_seq_ = last_seq;
+  }
+
+  void JournaledSheet::Apply(Op op, int first, int second, std::string text) {
+    switch (op) {
+      case Op::SetCell:
+        sheet_.SetCell({first, second}, std::move(text));
+        break;
+      case Op::ClearCell:
+        sheet_.ClearCell({first, second});
+        break;
+      case Op::InsertRows:
+        sheet_.InsertRows(first, second);
+        break;
+      case Op::InsertCols:
+        sheet_.InsertCols(first, second);
+        break;
+      case Op::DeleteRows:
+        sheet_.DeleteRows(first, second);
+        break;
+      case Op::DeleteCols:
+        sheet_.DeleteCols(first, second);
+        break;
+      default:
+        throw std::runtime_error("unknown journal record");
+    }
+  }
+
+  void JournaledSheet::Append(Op op, int first, int second, std::string_view text) {
+    RecordHeader header{0, uint32_t(text.size()), 0, uint32_t(op), first, second, 0};
+
+    std::lock_guard lock(mutex_);
+    header.seq = next_seq_++;
+    header.checksum = Checksum(header, text);
+
+    const bool writer_idle = pending_.empty();
+    const auto* bytes = reinterpret_cast<const char*>(&header);
+    pending_.insert(std::end(pending_), bytes, bytes + sizeof(header));
+    pending_.insert(std::end(pending_), std::begin(text), std::end(text));
+    if (writer_idle) {
+      wake_writer_.notify_one();
+    }
+  }
+
+  void JournaledSheet::WriterLoop() {
+    std::optional<OutputFile> journal;
+    std::vector<char> batch;
+
+    std::unique_lock lock(mutex_);
+    while (true) {
+      wake_writer_.wait(lock, [&] { return stop_ || checkpoint_ || !pending_.empty(); });
+
+      if (checkpoint_) {
+        auto checkpoint = std::move(*checkpoint_);
+        checkpoint_.reset();
+        lock.unlock();
+        try {
+          if (!error_) {
+            if (!journal) {
+              journal.emplace(dir_ / FileName(kJournalPrefix, journal_start_seq_, kJournalSuffix), false, options_.fsync);
+            }
+            journal->Write(checkpoint.records);
+
+            const auto checkpoint_name = FileName(kCheckpointPrefix, checkpoint.seq, kCheckpointSuffix);
+            auto temp_path = dir_ / checkpoint_name;
+            temp_path += ".tmp";
+            OutputFile(temp_path, true, options_.fsync).Write(checkpoint.image);
+            fs::rename(temp_path, dir_ / checkpoint_name);
+
+            const auto journal_name = FileName(kJournalPrefix, checkpoint.seq, kJournalSuffix);
+            journal.reset();
+            journal.emplace(dir_ / journal_name, true, options_.fsync);
+            if (options_.fsync) {
+              SyncDirectory(dir_);
+            }
+
+            std::vector<fs::path> stale_files;
+            for (const auto& entry : fs::directory_iterator(dir_)) {
+              const auto name = entry.path().filename();
+              if (name != checkpoint_name && name != journal_name
+                  && (ParseFileName(name.string(), kCheckpointPrefix, kCheckpointSuffix)
+                      || ParseFileName(name.string(), kJournalPrefix, kJournalSuffix))) {
+                stale_files.push_back(entry.path());
+              }
+            }
+            for (const auto& path : stale_files) {
+              fs::remove(path);
+            }
+          }
+        } catch (...) {
+          std::lock_guard error_lock(mutex_);
+          error_ = std::current_exception();
+        }
+        lock.lock();
+        journal_start_seq_ = checkpoint.seq;
+        written_seq_ = std::max(written_seq_, checkpoint.seq);
+        written_checkpoint_seq_ = checkpoint.seq;
+      } else if (!pending_.empty()) {
+        batch.swap(pending_);
+        const auto batch_seq = next_seq_ - 1;
+        lock.unlock();
+        try {
+          if (!error_) {
+            if (!journal) {
+              journal.emplace(dir_ / FileName(kJournalPrefix, journal_start_seq_, kJournalSuffix), false, options_.fsync);
+            }
+            journal->Write(batch);
+          }
+        } catch (...) {
+          std::lock_guard error_lock(mutex_);
+          error_ = std::current_exception();
+        }
+        batch.clear();
+        lock.lock();
+        written_seq_ = batch_seq;
+      } else if (stop_) {
+        break;
+      }
+      written_.notify_all();
+    }
+  }
+
+  void JournaledSheet::SetCell(Position pos, std::string text) {
+    sheet_.SetCell(pos, text);
+    Append(Op::SetCell, pos.row, pos.col, text);
+  }
+
+  const ICell* JournaledSheet::GetCell(Position pos) const {
+    return sheet_.GetCell(pos);
+  }
+
+  ICell* JournaledSheet::GetCell(Position pos) {
+    return sheet_.GetCell(pos);
+  }
+
+  void JournaledSheet::ClearCell(Position pos) {
+    sheet_.ClearCell(pos);
+    Append(Op::ClearCell, pos.row, pos.col);
+  }
+
+  void JournaledSheet::InsertRows(int before, int count) {
+    sheet_.InsertRows(before, count);
+    Append(Op::InsertRows, before, count);
+  }
+
+  void JournaledSheet::InsertCols(int before, int count) {
+    sheet_.InsertCols(before, count);
+    Append(Op::InsertCols, before, count);
+  }
+
+  void JournaledSheet::DeleteRows(int first, int count) {
+    sheet_.DeleteRows(first, count);
+    Append(Op::DeleteRows, first, count);
+  }
+
+  void JournaledSheet::DeleteCols(int first, int count) {
+    sheet_.DeleteCols(first, count);
+    Append(Op::DeleteCols, first, count);
+  }
+
+  Size JournaledSheet::GetPrintableSize() const {
+    return sheet_.GetPrintableSize();
+  }
+
+  void JournaledSheet::PrintValues(std::ostream& output) const {
+    sheet_.PrintValues(output);
+  }
+
+  void JournaledSheet::PrintTexts(std::ostream& output) const {
+    sheet_.PrintTexts(output);
+  }
+
+  const Sheet& JournaledSheet::GetSheet() const {
+    return sheet_;
+  }
+
+  void JournaledSheet::Checkpoint() {
+    auto image = SerializeSnapshot(sheet_);
+
+    std::lock_guard lock(mutex_);
+    const uint64_t seq = next_seq_ - 1;
+    if (checkpoint_) {
+      checkpoint_->records.insert(std::end(checkpoint_->records), std::begin(pending_), std::end(pending_));
+      checkpoint_->seq = seq;
+      checkpoint_->image = std::move(image);
+    } else {
+      checkpoint_ = PendingCheckpoint{seq, std::move(pending_), std::move(image)};
+    }
+    pending_.clear();
+    requested_checkpoint_seq_ = seq;
+    wake_writer_.notify_one();
+  }
+
+  void JournaledSheet::Sync() {
+    std::unique_lock lock(mutex_);
+    const uint64_t seq = next_seq_ - 1;
+    const uint64_t checkpoint_seq = requested_checkpoint_seq_;
+    written_.wait(lock, [&] {
+      return written_seq_ >= seq && written_checkpoint_seq_ >= checkpoint_seq;
+    });
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+} // namespace Black
@@ -0,0 +1,97 @@
+#pragma once
+#include "black_sheet.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace Black {
+struct JournalOptions {
+  bool fsync = false; // fsync every journal batch and checkpoint before going on
+};
+
+// Sheet keeping its edits durable in a directory:
+// * checkpoint-<seq>.snap - snapshot of the sheet after the edit <seq>;
+// * journal-<seq>.log     - edits following the edit <seq>, one record each.
+// Edits are encoded on the calling thread and written by a background thread
+// in batches (group commit), so the mutations don't wait for the disk.
+// Checkpoint() folds the journal into a new snapshot: the image is built on the
+// calling thread, then written, and the old files are removed in background.
+class JournaledSheet : public ISheet {
+  struct PendingCheckpoint {
+    uint64_t seq;
+    std::vector<char> records; // edits up to seq not written yet
+    std::vector<char> image;
+  };
+
+  Sheet sheet_;
+  std::filesystem::path dir_;
+  JournalOptions options_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_writer_;
+  std::condition_variable written_;
+  std::vector<char> pending_;
+  std::optional<PendingCheckpoint> checkpoint_;
+  uint64_t next_seq_ = 1;
+  uint64_t written_seq_ = 0;
+  uint64_t journal_start_seq_ = 0;
+  uint64_t requested_checkpoint_seq_ = 0;
+  uint64_t written_checkpoint_seq_ = 0;
+  bool stop_ = false;
+  std::exception_ptr error_;
+  std::thread writer_;
+
+  enum class Op : uint32_t {
+    SetCell,
+    ClearCell,
+    InsertRows,
+    InsertCols,
+    DeleteRows,
+    DeleteCols
+  };
+
+  void Recover();
+  void Apply(Op op, int first, int second, std::string text);
+  void Append(Op op, int first, int second, std::string_view text = {});
+  void WriterLoop();
+
+public:
+  explicit JournaledSheet(std::filesystem::path dir, JournalOptions options = {});
+  ~JournaledSheet() override;
+
+  JournaledSheet(const JournaledSheet&) = delete;
+  JournaledSheet& operator=(const JournaledSheet&) = delete;
+
+  void SetCell(Position pos, std::string text) override;
+
+  const ICell* GetCell(Position pos) const override;
+  ICell* GetCell(Position pos) override;
+
+  void ClearCell(Position pos) override;
+
+  void InsertRows(int before, int count = 1) override;
+  void InsertCols(int before, int count = 1) override;
+
+  void DeleteRows(int first, int count = 1) override;
+  void DeleteCols(int first, int count = 1) override;
+
+  Size GetPrintableSize() const override;
+
+  void PrintValues(std::ostream& output) const override;
+  void PrintTexts(std::ostream& output) const override;
+
+  const Sheet& GetSheet() const;
+
+  // Starts folding the journal into a new checkpoint.
+  void Checkpoint();
+  // Waits until all the edits made so far (and checkpoints) are written.
+  // Rethrows the error of the background writer if any.
+  void Sync();
+};
+} // namespace Black
@@ -0,0 +1,244 @@
+#include "black_kernels.h"
+
+#include <algorithm>
+#include <cassert>
+
+// SSE2 is part of x86-64, only the AVX2 kernels need a target and a CPU check.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BLACK_KERNELS_X86
+#define BLACK_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define BLACK_KERNELS_X86
+#define BLACK_TARGET_AVX2
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+namespace Black::Kernels {
+  double SumState::Total() const {
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]))
+         + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+  }
+
+  namespace {
+    // The vector kernels process whole groups of kLanes values and leave the
+    // tail to these, so every value lands in the same lane.
+    void SumTail(const double* values, size_t first, size_t count, SumState& state) {
+      for (size_t i = first; i < count; ++i) {
+        state.lanes[i % kLanes] += values[i];
+      }
+    }
+
+    void SumProductsTail(const double* left, const double* right, size_t first, size_t count, SumState& state) {
+      for (size_t i = first; i < count; ++i) {
+        state.lanes[i % kLanes] += left[i] * right[i];
+      }
+    }
+
+    void ScalarSum(const double* values, size_t count, SumState& state) {
+      SumTail(values, 0, count, state);
+    }
+
+    void ScalarSumProducts(const double* left, const double* right, size_t count, SumState& state) {
+      SumProductsTail(left, right, 0, count, state);
+    }
+
+    double ScalarMin(const double* values, size_t count, double init) {
+      double result = init;
+      for (size_t i = 0; i < count; ++i) {
+        result = std::min(result, values[i]);
+      }
+      return result;
+    }
+
+    double ScalarMax(const double* values, size_t count, double init) {
+      double result = init;
+      for (size_t i = 0; i < count; ++i) {
+        result = std::max(result, values[i]);
+      }
+      return result;
+    }
+
+    constexpr KernelTable kScalar{Isa::Scalar, ScalarSum, ScalarSumProducts, ScalarMin, ScalarMax};
+
+#ifdef BLACK_KERNELS_X86
+    // Four accumulators of two lanes each.
+    void Sse2Sum(const double* values, size_t count, SumState& state) {
+      __m128d acc[4];
+      for (size_t j = 0; j < 4; ++j) {
+        acc[j] = _mm_loadu_pd(state.lanes + 2 * j);
+      }
+      const size_t whole = count / kLanes * kLanes;
+      for (size_t i = 0; i < whole; i += kLanes) {
+        for (size_t j = 0; j < 4; ++j) {
+          acc[j] = _mm_add_pd(acc[j], _mm_loadu_pd(values + i + 2 * j));
+        }
+      }
+      for (size_t j = 0; j < 4; ++j) {
+        _mm_storeu_pd(state.lanes + 2 * j, acc[j]);
+      }
+      SumTail(values, whole, count, state);
+    }
+
+    void Sse2SumProducts(const double* left, const double* right, size_t count, SumState& state) {
+      __m128d acc[4];
+      for (size_t j = 0; j < 4; ++j) {
+        acc[j] = _mm_loadu_pd(state.lanes + 2 * j);
+      }
+      const size_t whole = count / kLanes * kLanes;
+      for (size_t i = 0; i < whole; i += kLanes) {
+        for (size_t j = 0; j < 4; ++j) {
+          const auto product = _mm_mul_pd(_mm_loadu_pd(left + i + 2 * j), _mm_loadu_pd(right + i + 2 * j));
+          acc[j] = _mm_add_pd(acc[j], product);
+        }
+      }
+      for (size_t j = 0; j < 4; ++j) {
+        _mm_storeu_pd(state.lanes + 2 * j, acc[j]);
+      }
+      SumProductsTail(left, right, whole, count, state);
+    }
+
+    double Sse2Min(const double* values, size_t count, double init) {
+      auto acc = _mm_set1_pd(init);
+      const size_t whole = count / 2 * 2;
+      for (size_t i = 0; i < whole; i += 2) {
+        acc = _mm_min_pd(acc, _mm_loadu_pd(values + i));
+      }
+      double lanes[2];
+      _mm_storeu_pd(lanes, acc);
+      return ScalarMin(values + whole, count - whole, std::min(lanes[0], lanes[1]));
+    }
+
+    double Sse2Max(const double* values, size_t count, double init) {
+      auto acc = _mm_set1_pd(init);
+      const size_t whole = count / 2 * 2;
+      for (size_t i = 0; i < whole; i += 2) {
+        acc = _mm_max_pd(acc, _mm_loadu_pd(values + i));
+      }
+      double lanes[2];
+      _mm_storeu_pd(lanes, acc);
+      return ScalarMax(values + whole, count - whole, std::max(lanes[0], lanes[1]));
+    }
+
+    constexpr KernelTable kSse2{Isa::Sse2, Sse2Sum, Sse2SumProducts, Sse2Min, Sse2Max};
+
+    // Two accumulators of four lanes each.
+    BLACK_TARGET_AVX2 void Avx2Sum(const double* values, size_t count, SumState& state) {
+      auto low = _mm256_loadu_pd(state.lanes);
+      auto high = _mm256_loadu_pd(state.lanes + 4);
+      const size_t whole = count / kLanes * kLanes;
+      for (size_t i = 0; i < whole; i += kLanes) {
+        low = _mm256_add_pd(low, _mm256_loadu_pd(values + i));
+        high = _mm256_add_pd(high, _mm256_loadu_pd(values + i + 4));
+      }
+      _mm256_storeu_pd(state.lanes, low);
+      _mm256_storeu_pd(state.lanes + 4, high);
+      SumTail(values, whole, count, state);
+    }
+
+    BLACK_TARGET_AVX2 void Avx2SumProducts(const double* left, const double* right, size_t count, SumState& state) {
+      auto low = _mm256_loadu_pd(state.lanes);
+      auto high = _mm256_loadu_pd(state.lanes + 4);
+      const size_t whole = count / kLanes * kLanes;
+      for (size_t i = 0; i < whole; i += kLanes) {
+        // Separate multiply and add: a fused one would round differently.
+        low = _mm256_add_pd(low, _mm256_mul_pd(_mm256_loadu_pd(left + i), _mm256_loadu_pd(right + i)));
+        high = _mm256_add_pd(high, _mm256_mul_pd(_mm256_loadu_pd(left + i + 4), _mm256_loadu_pd(right + i + 4)));
+      }
+      _mm256_storeu_pd(state.lanes, low);
+      _mm256_storeu_pd(state.lanes + 4, high);
+      SumProductsTail(left, right, whole, count, state);
+    }
+
+    BLACK_TARGET_AVX2 double Avx2Min(const double* values, size_t count, double init) {
+      auto acc = _mm256_set1_pd(init);
+      const size_t whole = count / 4 * 4;
+      for (size_t i = 0; i < whole; i += 4) {
+        acc = _mm256_min_pd(acc, _mm256_loadu_pd(values + i));
+      }
+      double lanes[4];
+      _mm256_storeu_pd(lanes, acc);
+      return ScalarMin(values + whole, count - whole, std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3])));
+    }
+
+    BLACK_TARGET_AVX2 double Avx2Max(const double* values, size_t count, double init) {
+      auto acc = _mm256_set1_pd(init);
+      const size_t whole = count / 4 * 4;
+      for (size_t i = 0; i < whole; i += 4) {
+        acc = _mm256_max_pd(acc, _mm256_loadu_pd(values + i));
+      }
+      double lanes[4];
+      _mm256_storeu_pd(lanes, acc);
+      return ScalarMax(values + whole, count - whole, std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3])));
+    }
+
+    constexpr KernelTable kAvx2{Isa::Avx2, Avx2Sum, Avx2SumProducts, Avx2Min, Avx2Max};
+
+    bool CpuSupportsAvx2() {
+#if defined(__GNUC__)
+      return __builtin_cpu_supports("avx2");
+#else
+      int info[4];
+      __cpuidex(info, 0, 0);
+      if (info[0] < 7) {
+        return false;
+      }
+      __cpuidex(info, 1, 0);
+      const bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+      __cpuidex(info, 7, 0);
+      return os_saves_ymm && (info[1] & (1 << 5));
+#endif
+    }
+#endif
+  }
+
+  bool IsSupported(Isa isa) {
+    switch (isa) {
+      case Isa::Scalar:
+        return true;
+#ifdef BLACK_KERNELS_X86
+      case Isa::Sse2:
+        return true;
+      case Isa::Avx2: {
+        static const bool supported = CpuSupportsAvx2();
+        return supported;
+      }
+#endif
+      default:
+        return false;
+    }
+  }
+
+  const char* GetIsaName(Isa isa) {
+    switch (isa) {
+      case Isa::Sse2:
+        return "sse2";
+      case Isa::Avx2:
+        return "avx2";
+      default:
+        return "scalar";
+    }
+  }
+
+  const KernelTable& GetKernels(Isa isa) {
+    assert(IsSupported(isa));
+    switch (isa) {
+#ifdef BLACK_KERNELS_X86
+      case Isa::Sse2:
+        return kSse2;
+      case Isa::Avx2:
+        return kAvx2;
+#endif
+      default:
+        return kScalar;
+    }
+  }
+
+  const KernelTable& GetKernels() {
+    static const KernelTable& best = GetKernels(
+      IsSupported(Isa::Avx2) ? Isa::Avx2 : IsSupported(Isa::Sse2) ? Isa::Sse2 : Isa::Scalar
+    );
+    return best;
+  }
+} // namespace Black::Kernels
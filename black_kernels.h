@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+
+namespace Black::Kernels {
+enum class Isa {
+  Scalar,
+  Sse2,
+  Avx2
+};
+
+// Sums are kept in kLanes partial sums, value i of a block going to lane
+// i % kLanes, and combined in a fixed order. Every kernel adds in the same
+// order, so results don't depend on the instruction set picked at runtime.
+constexpr size_t kLanes = 8;
+
+struct SumState {
+  double lanes[kLanes] = {};
+
+  double Total() const;
+};
+
+struct KernelTable {
+  Isa isa;
+  // Adds values to the lanes of the state.
+  void (*sum)(const double* values, size_t count, SumState& state);
+  // Adds the products of the pairs of values to the lanes of the state.
+  void (*sum_products)(const double* left, const double* right, size_t count, SumState& state);
+  // Minimum/maximum of init and the values.
+  double (*min)(const double* values, size_t count, double init);
+  double (*max)(const double* values, size_t count, double init);
+};
+
+bool IsSupported(Isa isa);
+const char* GetIsaName(Isa isa);
+
+// Kernels for the instruction set, which must be supported.
+const KernelTable& GetKernels(Isa isa);
+// Kernels for the best instruction set of the CPU, detected once.
+const KernelTable& GetKernels();
+} // namespace Black::Kernels
@@ -0,0 +1,202 @@
+#include "black_lookup_index.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <utility>
+
+namespace Black {
+  LookupIndex::LookupIndex(std::set<int> formula_rows)
+    : formula_rows_(std::move(formula_rows))
+  {
+  }
+
+  bool LookupIndex::Has(Kind kind) const {
+    return kind == Kind::Exact ? exact_.has_value() : ordered_.has_value();
+  }
+
+  LookupIndex::Block& LookupIndex::GetBlock(int row) {
+    const size_t block_index = row / kBlockRows;
+    if (block_index >= ordered_->size()) {
+      ordered_->resize(block_index + 1);
+    }
+    auto& numbers = (*ordered_)[block_index].numbers;
+    const size_t offset = row % kBlockRows;
+    if (offset >= numbers.size()) {
+      numbers.resize(offset + 1, std::numeric_limits<double>::quiet_NaN());
+    }
+    return (*ordered_)[block_index];
+  }
+
+  void LookupIndex::Build(Kind kind, const std::vector<Entry>& entries) {
+    if (kind == Kind::Exact) {
+      exact_.emplace();
+      for (const auto& entry : entries) {
+        if (!std::isnan(entry.number)) {
+          auto& rows = (*exact_)[entry.number];
+          rows.insert(rows.end(), entry.row);
+        }
+      }
+    } else {
+      ordered_.emplace();
+      for (const auto& entry : entries) {
+        if (!std::isnan(entry.number)) {
+          auto& block = GetBlock(entry.row);
+          block.sorted.emplace_back(entry.number, entry.row);
+          block.numbers[entry.row % kBlockRows] = entry.number;
+        }
+      }
+      for (auto& block : *ordered_) {
+        std::sort(std::begin(block.sorted), std::end(block.sorted));
+      }
+    }
+  }
+
+  void LookupIndex::Add(int row, NumericColumn::Kind kind, double number) {
+    if (kind == NumericColumn::Kind::Formula) {
+      formula_rows_.insert(row);
+      return;
+    }
+    if (kind != NumericColumn::Kind::Number || std::isnan(number)) {
+      return;
+    }
+    if (exact_) {
+      (*exact_)[number].insert(row);
+    }
+    if (ordered_) {
+      auto& block = GetBlock(row);
+      const std::pair entry{number, row};
+      block.sorted.insert(std::lower_bound(std::begin(block.sorted), std::end(block.sorted), entry), entry);
+      block.numbers[row % kBlockRows] = number;
+    }
+  }
+
+  void LookupIndex::Remove(int row, NumericColumn::Kind kind, double number) {
+    if (kind == NumericColumn::Kind::Formula) {
+      formula_rows_.erase(row);
+      return;
+    }
+    if (kind != NumericColumn::Kind::Number || std::isnan(number)) {
+      return;
+    }
+    if (exact_) {
+      const auto it = exact_->find(number);
+      assert(it != exact_->end());
+      it->second.erase(row);
+      if (it->second.empty()) {
+        exact_->erase(it);
+      }
+    }
+    if (ordered_) {
+      auto& block = (*ordered_)[row / kBlockRows];
+      const auto it = std::lower_bound(std::begin(block.sorted), std::end(block.sorted), std::pair{number, row});
+      assert(it != std::end(block.sorted) && it->second == row);
+      block.sorted.erase(it);
+      block.numbers[row % kBlockRows] = std::numeric_limits<double>::quiet_NaN();
+    }
+  }
+
+  void LookupIndex::Update(int row, NumericColumn::Kind old_kind, double old_number,
+                           NumericColumn::Kind new_kind, double new_number) {
+    Remove(row, old_kind, old_number);
+    Add(row, new_kind, new_number);
+  }
+
+  std::optional<int> LookupIndex::FindFirst(double number, int first_row, int last_row) const {
+    assert(exact_);
+    const auto it = exact_->find(number);
+    if (it == exact_->end()) {
+      return std::nullopt;
+    }
+    const auto row = it->second.lower_bound(first_row);
+    if (row == it->second.end() || *row > last_row) {
+      return std::nullopt;
+    }
+    return *row;
+  }
+
+  std::optional<LookupIndex::Entry> LookupIndex::FindClosest(double number, int first_row, int last_row,
+                                                             bool not_above) const {
+    assert(ordered_);
+    std::optional<Entry> best;
+    // Blocks and rows are visited in order, so a number already found has the
+    // first row holding it.
+    auto is_better = [&] (double found) {
+      return !best || (not_above ? found > best->number : found < best->number);
+    };
+
+    first_row = std::max(first_row, 0);
+    const int last_block = std::min(last_row / kBlockRows, int(ordered_->size()) - 1);
+    for (int block_index = first_row / kBlockRows; block_index <= last_block; ++block_index) {
+      const auto& block = (*ordered_)[block_index];
+      const int block_first_row = block_index * kBlockRows;
+      if (block.sorted.empty() || !is_better(not_above ? block.sorted.back().first : block.sorted.front().first)) {
+        continue;
+      }
+      if (block_first_row < first_row || block_first_row + int(block.numbers.size()) - 1 > last_row) {
+        // Partly within the rows, only those are read.
+        const int end = std::min<int>(last_row - block_first_row + 1, block.numbers.size());
+        for (int offset = std::max(first_row - block_first_row, 0); offset < end; ++offset) {
+          const double found = block.numbers[offset];
+          if ((not_above ? found <= number : found >= number) && is_better(found)) {
+            best = Entry{found, block_first_row + offset};
+          }
+        }
+        continue;
+      }
+      // The entries are sorted by number and row, so the closest number comes
+      // with its first row.
+      const auto& sorted = block.sorted;
+      if (not_above) {
+        const auto it = std::upper_bound(std::begin(sorted), std::end(sorted),
+                                         std::pair{number, std::numeric_limits<int>::max()});
+        if (it != std::begin(sorted) && is_better(std::prev(it)->first)) {
+          const auto first = std::lower_bound(std::begin(sorted), it,
+                                              std::pair{std::prev(it)->first, std::numeric_limits<int>::min()});
+          best = Entry{first->first, first->second};
+        }
+      } else {
+        const auto it = std::lower_bound(std::begin(sorted), std::end(sorted),
+                                         std::pair{number, std::numeric_limits<int>::min()});
+        if (it != std::end(sorted) && is_better(it->first)) {
+          best = Entry{it->first, it->second};
+        }
+      }
+    }
+    return best;
+  }
+
+  std::optional<LookupIndex::Entry> LookupIndex::FindNotAbove(double number, int first_row, int last_row) const {
+    return FindClosest(number, first_row, last_row, true);
+  }
+
+  std::optional<LookupIndex::Entry> LookupIndex::FindNotBelow(double number, int first_row, int last_row) const {
+    return FindClosest(number, first_row, last_row, false);
+  }
+
+  const std::set<int>& LookupIndex::GetFormulaRows() const {
+    return formula_rows_;
+  }
+
+  size_t LookupIndex::MemoryUsage() const {
+    // Tree nodes: an element plus three pointers and the color.
+    constexpr size_t kNodeOverhead = 4 * sizeof(void*);
+    size_t usage = sizeof(*this) + formula_rows_.size() * (sizeof(int) + kNodeOverhead);
+    if (exact_) {
+      usage += exact_->bucket_count() * sizeof(void*)
+             + exact_->size() * (sizeof(std::pair<const double, std::set<int>>) + sizeof(void*));
+      for (const auto& [number, rows] : *exact_) {
+        usage += rows.size() * (sizeof(int) + kNodeOverhead);
+      }
+    }
+    if (ordered_) {
+      usage += ordered_->capacity() * sizeof(Block);
+      for (const auto& block : *ordered_) {
+        usage += block.sorted.capacity() * sizeof(std::pair<double, int>) + block.numbers.capacity() * sizeof(double);
+      }
+    }
+    return usage;
+  }
+} // namespace Black
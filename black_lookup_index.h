@@ -0,0 +1,75 @@
+#pragma once
+#include "black_numeric_column.h"
+
+#include <cstddef>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Black {
+// Numbers of a column by value for MATCH and VLOOKUP, by logical row. The
+// sheet builds each part on the first lookup needing it, passes every edit
+// of a cell of the column to Update() and drops the index when rows move.
+// Formula cells are only listed, their values are read on every lookup.
+class LookupIndex {
+public:
+  enum class Kind {
+    Exact,  // hash of the numbers
+    Ordered // numbers in order, for approximate matches
+  };
+
+  // A number at a logical row.
+  struct Entry {
+    double number;
+    int row;
+  };
+
+private:
+  // Rows of a block of the ordered part.
+  static constexpr int kBlockRows = 4096;
+  struct Block {
+    std::vector<std::pair<double, int>> sorted; // by number and row
+    std::vector<double> numbers;                // by row within the block, NaN for none
+  };
+
+  // Both without NaNs, which match nothing. The exact part keeps the rows of
+  // every number in order, the ordered one a block per kBlockRows rows, so a
+  // lookup in a slice of the column only searches the blocks within it.
+  std::optional<std::unordered_map<double, std::set<int>>> exact_;
+  std::optional<std::vector<Block>> ordered_;
+  std::set<int> formula_rows_;
+
+  void Add(int row, NumericColumn::Kind kind, double number);
+  void Remove(int row, NumericColumn::Kind kind, double number);
+  // The block of the ordered part holding the row, with room for it.
+  Block& GetBlock(int row);
+  // FindNotAbove if not_above, FindNotBelow otherwise.
+  std::optional<Entry> FindClosest(double number, int first_row, int last_row, bool not_above) const;
+
+public:
+  explicit LookupIndex(std::set<int> formula_rows);
+
+  bool Has(Kind kind) const;
+  void Build(Kind kind, const std::vector<Entry>& entries);
+
+  // The cell at the logical row changed, parts not built yet are skipped.
+  void Update(int row, NumericColumn::Kind old_kind, double old_number,
+              NumericColumn::Kind new_kind, double new_number);
+
+  // The first row in [first_row, last_row] holding the number, O(log k) for
+  // a number repeated k times. Needs Kind::Exact.
+  std::optional<int> FindFirst(double number, int first_row, int last_row) const;
+  // The largest number not above the given one, or the smallest number not
+  // below it, in [first_row, last_row], with the first row holding it. A binary
+  // search per block within the rows plus a scan of the rows in the two blocks
+  // crossing their bounds. Needs Kind::Ordered.
+  std::optional<Entry> FindNotAbove(double number, int first_row, int last_row) const;
+  std::optional<Entry> FindNotBelow(double number, int first_row, int last_row) const;
+
+  const std::set<int>& GetFormulaRows() const;
+
+  size_t MemoryUsage() const;
+};
+} // namespace Black
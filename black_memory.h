@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace Black {
+// Bytes used by a sheet, see Sheet::MemoryUsage(). Heap blocks are counted by
+// their requested size, without the allocator overhead.
+struct MemoryBreakdown {
+  size_t table = 0;        // the sheet object, table_ rows, row/column maps, numeric columns, lookup indexes and counters
+  size_t cells = 0;        // Cell objects
+  size_t texts = 0;        // contents of text cells
+  size_t formulas = 0;     // formula ASTs with their expression, reference and range caches
+  size_t references = 0;   // referenced/incoming cell vectors and the dependents index
+  size_t value_caches = 0; // cached string values
+
+  size_t Total() const {
+    return table + cells + texts + formulas + references + value_caches;
+  }
+};
+
+template <typename T>
+size_t HeapBytes(const std::vector<T>& vec) {
+  return vec.capacity() * sizeof(T);
+}
+
+// Short strings are kept inside the object and take no heap memory.
+inline size_t HeapBytes(const std::string& str) {
+  const char* data = str.data();
+  const auto* object = reinterpret_cast<const char*>(&str);
+  const bool is_inline = data >= object && data < object + sizeof(str);
+  return is_inline ? 0 : str.capacity() + 1;
+}
+} // namespace Black
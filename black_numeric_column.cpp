@@ -0,0 +1,79 @@
+#include "black_numeric_column.h"
+
+namespace Black {
+  void NumericColumn::Set(int row, Kind kind, double number) {
+    if (size_t(row) >= numbers_.size()) {
+      if (kind == Kind::Empty) {
+        return;
+      }
+      numbers_.resize(row + 1);
+      const size_t words = (numbers_.size() + 63) / 64;
+      number_bits_.resize(words);
+      error_bits_.resize(words);
+      formula_bits_.resize(words);
+    }
+    const uint64_t bit = uint64_t(1) << (row % 64);
+    auto assign = [&] (std::vector<uint64_t>& bits, bool value) {
+      bits[row / 64] = value ? bits[row / 64] | bit : bits[row / 64] & ~bit;
+    };
+    assign(number_bits_, kind == Kind::Number);
+    assign(error_bits_, kind == Kind::Error);
+    assign(formula_bits_, kind == Kind::Formula);
+    numbers_[row] = kind == Kind::Number ? number : 0;
+  }
+
+  void NumericColumn::Clear() {
+    numbers_.clear();
+    number_bits_.clear();
+    error_bits_.clear();
+    formula_bits_.clear();
+  }
+
+  uint64_t NumericColumn::WordMask(int word, int begin, int end) {
+    uint64_t mask = ~uint64_t(0);
+    if (word == begin / 64) {
+      mask &= ~uint64_t(0) << (begin % 64);
+    }
+    if ((word + 1) * 64 > end) {
+      mask &= ~uint64_t(0) >> (64 - end % 64);
+    }
+    return mask;
+  }
+
+  int NumericColumn::Size() const {
+    return numbers_.size();
+  }
+
+  NumericColumn::Kind NumericColumn::GetKind(int row) const {
+    if (size_t(row) >= numbers_.size()) {
+      return Kind::Empty;
+    }
+    const int word = row / 64;
+    const int shift = row % 64;
+    if (number_bits_[word] >> shift & 1) {
+      return Kind::Number;
+    }
+    if (error_bits_[word] >> shift & 1) {
+      return Kind::Error;
+    }
+    return formula_bits_[word] >> shift & 1 ? Kind::Formula : Kind::Empty;
+  }
+
+  const double* NumericColumn::Numbers() const {
+    return numbers_.data();
+  }
+
+  size_t NumericColumn::CountNumbers(int begin, int end) const {
+    end = std::min<int>(end, number_bits_.size() * 64);
+    size_t count = 0;
+    for (int word = begin / 64; word * 64 < end; ++word) {
+      count += BitCount(number_bits_[word] & WordMask(word, begin, end));
+    }
+    return count;
+  }
+
+  size_t NumericColumn::MemoryUsage() const {
+    return numbers_.capacity() * sizeof(double)
+         + (number_bits_.capacity() + error_bits_.capacity() + formula_bits_.capacity()) * sizeof(uint64_t);
+  }
+} // namespace Black
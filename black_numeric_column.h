@@ -0,0 +1,123 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+namespace Black {
+// Numeric shadow of the cells of a physical column: the numbers of the text
+// cells in a contiguous array and bitmaps telling what every cell holds, so
+// range scans read a few dense arrays instead of following a pointer per cell
+// and parsing its text. The sheet updates it on every edit of a cell.
+// Formula cells are only flagged: their values are computed lazily on read
+// and are read through the cells.
+class NumericColumn {
+public:
+  enum class Kind : uint8_t {
+    Empty,
+    Number,
+    Error,  // text which isn't a number, i.e. #VALUE!
+    Formula
+  };
+
+private:
+  // By physical row, 0 unless the cell is a number.
+  std::vector<double> numbers_;
+  // One bit per physical row, 64 rows per word.
+  std::vector<uint64_t> number_bits_;
+  std::vector<uint64_t> error_bits_;
+  std::vector<uint64_t> formula_bits_;
+
+  // Index of the lowest set bit of a non-zero word.
+  static int LowestBit(uint64_t word);
+  // Number of the set bits of the word.
+  static int BitCount(uint64_t word);
+  // Bits of the word within the rows [begin, end).
+  static uint64_t WordMask(int word, int begin, int end);
+  // Calls func(row) for the set bits of the words in the rows [begin, end).
+  template <typename WordFunc, typename Func>
+  static void ForEachBit(int words, WordFunc&& get_word, int begin, int end, Func&& func);
+
+public:
+  void Set(int row, Kind kind, double number = 0);
+  // Makes every cell empty, e.g. once the physical column is released.
+  void Clear();
+
+  // Rows from Size() on are empty.
+  int Size() const;
+  Kind GetKind(int row) const;
+  // Numbers of the rows [0, Size()), other cells read as 0 so that a sum of a
+  // slice only adds its numbers.
+  const double* Numbers() const;
+
+  // Number of the numbers in the rows [begin, end).
+  size_t CountNumbers(int begin, int end) const;
+  // Calls func(row) for the numbers in the rows [begin, end), in order.
+  template <typename Func>
+  void ForEachNumber(int begin, int end, Func&& func) const;
+  // Calls func(row, kind) for the errors and formulas in the rows [begin, end),
+  // in order.
+  template <typename Func>
+  void ForEachOther(int begin, int end, Func&& func) const;
+
+  size_t MemoryUsage() const;
+};
+
+inline int NumericColumn::LowestBit(uint64_t word) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanForward64(&index, word);
+  return int(index);
+#else
+  int index = 0;
+  for (; !(word & 1); word >>= 1) {
+    ++index;
+  }
+  return index;
+#endif
+}
+
+inline int NumericColumn::BitCount(uint64_t word) {
+#if defined(__GNUC__)
+  return __builtin_popcountll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  return int(__popcnt64(word));
+#else
+  int count = 0;
+  for (; word; word &= word - 1) {
+    ++count;
+  }
+  return count;
+#endif
+}
+
+template <typename WordFunc, typename Func>
+void NumericColumn::ForEachBit(int words, WordFunc&& get_word, int begin, int end, Func&& func) {
+  end = std::min(end, words * 64);
+  for (int word = begin / 64; word * 64 < end; ++word) {
+    uint64_t mask = get_word(word) & WordMask(word, begin, end);
+    while (mask) {
+      func(word * 64 + LowestBit(mask));
+      mask &= mask - 1;
+    }
+  }
+}
+
+template <typename Func>
+void NumericColumn::ForEachNumber(int begin, int end, Func&& func) const {
+  ForEachBit(number_bits_.size(), [&] (int word) { return number_bits_[word]; }, begin, end, func);
+}
+
+template <typename Func>
+void NumericColumn::ForEachOther(int begin, int end, Func&& func) const {
+  // Errors and formulas are rare, both bitmaps are walked in one pass.
+  ForEachBit(error_bits_.size(), [&] (int word) { return error_bits_[word] | formula_bits_[word]; }, begin, end,
+             [&] (int row) { func(row, error_bits_[row / 64] >> (row % 64) & 1 ? Kind::Error : Kind::Formula); });
+}
+} // namespace Black
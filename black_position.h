@@ -3,10 +3,31 @@
 #include "common.h"
 #include "black_utils.h"
 
+#include <string>
+
 namespace Black {
   struct PositionHash {
     std::size_t operator () (const Position& pos) const {
       return ComputeCombinedHash(pos.row, pos.col);
     }
   };
+
+  // Rectangle of cells, both corners included.
+  struct CellRange {
+    Position first; // top left
+    Position last;  // bottom right
+
+    bool Contains(Position pos) const {
+      return ValidateBoundaries(first.row, last.row + 1, pos.row)
+          && ValidateBoundaries(first.col, last.col + 1, pos.col);
+    }
+
+    std::string ToString() const {
+      return first.ToString() + ":" + last.ToString();
+    }
+
+    bool operator==(const CellRange& rhs) const {
+      return first == rhs.first && last == rhs.last;
+    }
+  };
 } // namespace Black
\ No newline at end of file
@@ -0,0 +1,76 @@
+#include "black_profiler.h"
+#include "black_sheet.h"
+
+#include <algorithm>
+#include <iomanip>
+
+namespace Black {
+  void Profiler::Enter() {
+    nested_.emplace_back();
+  }
+
+  void Profiler::Leave(const Cell* cell, Clock::duration elapsed) {
+    auto& entry = entries_[cell];
+    ++entry.evaluations;
+    entry.inclusive += elapsed;
+    entry.exclusive += elapsed - nested_.back();
+    nested_.pop_back();
+    if (!nested_.empty()) {
+      nested_.back() += elapsed;
+    }
+  }
+
+  void Profiler::Forget(const Cell* cell) {
+    entries_.erase(cell);
+  }
+
+  void Profiler::Clear() {
+    entries_.clear();
+  }
+
+  std::vector<Profiler::CellProfile> Profiler::GetTop(const Sheet& sheet, size_t count) const {
+    std::vector<CellProfile> profiles;
+    sheet.ForEachCell([&] (Position pos, const Cell& cell) {
+      const auto* formula = cell.GetFormula();
+      auto it = entries_.find(&cell);
+      if (formula && it != entries_.end()) {
+        const auto& entry = it->second;
+        profiles.push_back(CellProfile{
+          pos, formula->GetExpression(), entry.evaluations, entry.inclusive, entry.exclusive,
+          sheet.CountDependents(pos)
+        });
+      }
+    });
+
+    count = std::min(count, profiles.size());
+    std::partial_sort(std::begin(profiles), std::begin(profiles) + count, std::end(profiles),
+                      [] (const CellProfile& lhs, const CellProfile& rhs) {
+                        return lhs.exclusive > rhs.exclusive;
+                      }
+    );
+    profiles.resize(count);
+    return profiles;
+  }
+
+  void Profiler::WriteReport(std::ostream& output, const Sheet& sheet, size_t count) const {
+    auto microseconds = [] (Clock::duration duration) {
+      return std::chrono::duration<double, std::micro>(duration).count();
+    };
+
+    const auto flags = output.flags();
+    const auto precision = output.precision();
+    output << std::left << std::setw(10) << "cell" << std::right << std::setw(12) << "evaluations"
+           << std::setw(16) << "inclusive us" << std::setw(16) << "exclusive us" << std::setw(12) << "dependents"
+           << "  expression\n" << std::fixed << std::setprecision(1);
+    for (const auto& profile : GetTop(sheet, count)) {
+      output << std::left << std::setw(10) << profile.pos.ToString() << std::right
+             << std::setw(12) << profile.evaluations
+             << std::setw(16) << microseconds(profile.inclusive)
+             << std::setw(16) << microseconds(profile.exclusive)
+             << std::setw(12) << profile.dependents
+             << "  =" << profile.expression << '\n';
+    }
+    output.flags(flags);
+    output.precision(precision);
+  }
+} // namespace Black
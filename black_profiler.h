@@ -0,0 +1,80 @@
+#pragma once
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Black {
+class Cell;
+class Sheet;
+
+// Measures the formula evaluations of a sheet, see Sheet::SetProfiler().
+// Inclusive time of an evaluation covers the recalculation of its inputs,
+// exclusive time doesn't. Cells are evaluated on a single thread, so the
+// profiler isn't thread safe.
+class Profiler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct CellProfile {
+    Position pos;
+    std::string expression;
+    uint64_t evaluations = 0;
+    Clock::duration inclusive{};
+    Clock::duration exclusive{};
+    size_t dependents = 0;
+  };
+
+  void Enter();
+  void Leave(const Cell* cell, Clock::duration elapsed);
+  // Drops the measurements of a destroyed cell whose address is reused.
+  void Forget(const Cell* cell);
+  void Clear();
+
+  // Formula cells of the sheet with the largest exclusive time, the most
+  // expensive first.
+  std::vector<CellProfile> GetTop(const Sheet& sheet, size_t count) const;
+  void WriteReport(std::ostream& output, const Sheet& sheet, size_t count) const;
+
+private:
+  struct Entry {
+    uint64_t evaluations = 0;
+    Clock::duration inclusive{};
+    Clock::duration exclusive{};
+  };
+
+  std::unordered_map<const Cell*, Entry> entries_;
+  std::vector<Clock::duration> nested_; // time of the inner evaluations of the running ones
+};
+
+// Reports its lifetime as an evaluation of the cell if profiling is enabled.
+class ProfileScope {
+  Profiler* profiler_;
+  const Cell* cell_;
+  Profiler::Clock::time_point start_;
+
+public:
+  ProfileScope(Profiler* profiler, const Cell* cell)
+    : profiler_(profiler)
+    , cell_(cell)
+  {
+    if (profiler_) {
+      profiler_->Enter();
+      start_ = Profiler::Clock::now();
+    }
+  }
+
+  ~ProfileScope() {
+    if (profiler_) {
+      profiler_->Leave(cell_, Profiler::Clock::now() - start_);
+    }
+  }
+
+  ProfileScope(const ProfileScope&) = delete;
+  ProfileScope& operator=(const ProfileScope&) = delete;
+};
+} // namespace Black
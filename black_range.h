@@ -21,9 +21,17 @@ public:
   size_t size() const {
     return last_ - first_;
   }
+  decltype(auto) operator[](size_t i) const {
+    return first_[i];
+  }
 };
 
 template <typename Container>
-auto Head(Container& c, size_t count) {
+auto Head(Container&& c, size_t count) {
   return Range{std::begin(c), std::next(std::begin(c), std::min(c.size(), count))};
-}
\ No newline at end of file
+}
+
+template <typename Container>
+auto Tail(Container&& c, size_t first) {
+  return Range{std::next(std::begin(c), std::min(c.size(), first)), std::end(c)};
+}
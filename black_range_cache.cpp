@@ -0,0 +1,159 @@
+#include "black_range_cache.h"
+#include "black_sheet.h"
+
+#include <cassert>
+#include <cmath>
+
+namespace Black {
+  RangeInput GetRangeInput(const Cell* cell) {
+    if (!cell) {
+      return {};
+    }
+    if (cell->GetFormula()) {
+      return cell;
+    }
+    // The value of a text cell is computed here rather than by GetValue(),
+    // which would cache it for every edited cell.
+    auto text = cell->GetText();
+    if (!text.empty() && text.front() == kEscapeSign) {
+      text.erase(0, 1);
+    }
+    if (text.empty()) {
+      return {};
+    }
+    return FormulaAst::EvaluateCellValue(text);
+  }
+
+  RangeCache::RangeCache(const Sheet& sheet, Aggregates aggregates)
+    : sheet_(sheet)
+    , aggregates_(aggregates)
+  {
+  }
+
+  std::unique_ptr<RangeCache> RangeCache::Create(const ISheet& sheet, Aggregates aggregates) {
+    if (const auto* black_sheet = dynamic_cast<const Sheet*>(&sheet)) {
+      return std::make_unique<RangeCache>(*black_sheet, aggregates);
+    }
+    return nullptr;
+  }
+
+  uint64_t RangeCache::GetOffset(const CellRange& range, Position pos) {
+    const uint64_t cols = range.last.col - range.first.col + 1;
+    return (pos.row - range.first.row) * cols + (pos.col - range.first.col);
+  }
+
+  void RangeCache::Add(uint64_t offset, const RangeInput& input) const {
+    if (const auto* cell = std::get_if<const Cell*>(&input)) {
+      contents_->formula_cells.emplace(offset, *cell);
+      return;
+    }
+    const auto* value = std::get_if<IFormula::Value>(&input);
+    if (!value || aggregates_ == Aggregates::None) {
+      return;
+    }
+    if (const auto* error = std::get_if<FormulaError>(value)) {
+      contents_->errors.emplace(offset, *error);
+      return;
+    }
+    const double number = std::get<double>(*value);
+    ++contents_->count;
+    contents_->sum.Add(number);
+    if (aggregates_ == Aggregates::Ordered) {
+      if (std::isnan(number)) {
+        ++contents_->nan_count;
+      } else {
+        contents_->numbers.insert(number);
+      }
+    }
+  }
+
+  void RangeCache::Remove(uint64_t offset, const RangeInput& input) const {
+    if (std::holds_alternative<const Cell*>(input)) {
+      contents_->formula_cells.erase(offset);
+      return;
+    }
+    const auto* value = std::get_if<IFormula::Value>(&input);
+    if (!value || aggregates_ == Aggregates::None) {
+      return;
+    }
+    if (std::holds_alternative<FormulaError>(*value)) {
+      contents_->errors.erase(offset);
+      return;
+    }
+    const double number = std::get<double>(*value);
+    --contents_->count;
+    contents_->sum.Subtract(number);
+    if (aggregates_ == Aggregates::Ordered) {
+      if (std::isnan(number)) {
+        --contents_->nan_count;
+      } else {
+        const auto it = contents_->numbers.find(number);
+        assert(it != contents_->numbers.end());
+        contents_->numbers.erase(it);
+      }
+    }
+  }
+
+  const RangeCache::Contents& RangeCache::Get(const CellRange& range) const {
+    if (!contents_) {
+      BLACK_COUNT(sheet_.GetCounters(), Counter::RangeCacheBuilds, 1);
+      contents_.emplace();
+      // Text cells are read from the numeric columns of the sheet, only the
+      // formula cells are looked up.
+      sheet_.ForEachColumnRun(range, [&] (Position first, const NumericColumn& column, int begin, int end) {
+        auto get_position = [&] (int row) { return Position{first.row + row - begin, first.col}; };
+        column.ForEachOther(begin, end, [&] (int row, NumericColumn::Kind kind) {
+          const auto pos = get_position(row);
+          if (kind == NumericColumn::Kind::Formula) {
+            contents_->formula_cells.emplace(GetOffset(range, pos), sheet_.GetCellImpl(pos));
+          } else if (aggregates_ != Aggregates::None) {
+            contents_->errors.emplace(GetOffset(range, pos), FormulaError(FormulaError::Category::Value));
+          }
+        });
+        if (aggregates_ == Aggregates::None) {
+          return;
+        }
+        const double* numbers = column.Numbers();
+        contents_->count += column.CountNumbers(begin, end);
+        // Other cells read as 0 and add nothing.
+        contents_->sum.Add(numbers + begin, end - begin);
+        if (aggregates_ == Aggregates::Ordered) {
+          column.ForEachNumber(begin, end, [&] (int row) {
+            if (std::isnan(numbers[row])) {
+              ++contents_->nan_count;
+            } else {
+              contents_->numbers.insert(numbers[row]);
+            }
+          });
+        }
+      });
+    }
+    return *contents_;
+  }
+
+  void RangeCache::Reset() {
+    contents_ = std::nullopt;
+  }
+
+  void RangeCache::Update(const CellRange& range, Position pos, const RangeInput& before, const RangeInput& after) {
+    if (!contents_) {
+      return;
+    }
+    BLACK_COUNT(sheet_.GetCounters(), Counter::RangeCacheUpdates, 1);
+    const auto offset = GetOffset(range, pos);
+    Remove(offset, before);
+    Add(offset, after);
+  }
+
+  size_t RangeCache::MemoryUsage() const {
+    size_t usage = sizeof(*this);
+    if (contents_) {
+      // Tree nodes: an element plus three pointers and the color.
+      constexpr size_t kNodeOverhead = 4 * sizeof(void*);
+      usage += contents_->formula_cells.size() * (sizeof(std::pair<uint64_t, const Cell*>) + kNodeOverhead)
+             + contents_->numbers.size() * (sizeof(double) + kNodeOverhead)
+             + contents_->errors.size() * (sizeof(std::pair<uint64_t, FormulaError>) + kNodeOverhead);
+    }
+    return usage;
+  }
+} // namespace Black
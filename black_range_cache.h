@@ -0,0 +1,72 @@
+#pragma once
+#include "common.h"
+#include "formula.h"
+#include "black_exact_sum.h"
+#include "black_position.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <variant>
+
+namespace Black {
+class Cell;
+class Sheet;
+
+// What a cell contributes to the ranges containing it: nothing when empty,
+// the value of a text cell as an operand, a formula cell itself as its value
+// changes without the cell being edited.
+using RangeInput = std::variant<std::monostate, IFormula::Value, const Cell*>;
+
+RangeInput GetRangeInput(const Cell* cell);
+
+// Contents of a range reference of a formula, built by a scan of the range on
+// first use and then kept up to date by the sheet, which passes every edit of
+// a cell inside the range to Update(). Cells are identified by their offset
+// in the range, row by row, which doesn't change when the whole range moves.
+class RangeCache {
+public:
+  enum class Aggregates {
+    None,    // only the formula cells, e.g. for SUMPRODUCT
+    Totals,  // numbers are counted and summed, errors are kept
+    Ordered  // Totals and the numbers in order, for MIN/MAX
+  };
+
+  struct Contents {
+    std::map<uint64_t, const Cell*> formula_cells;
+    // Numbers and errors of the text cells, unless Aggregates::None.
+    uint64_t count = 0;
+    ExactSum sum;
+    std::multiset<double> numbers; // Aggregates::Ordered only, without NaNs
+    uint64_t nan_count = 0;
+    std::map<uint64_t, FormulaError> errors;
+  };
+
+private:
+  const Sheet& sheet_;
+  Aggregates aggregates_;
+  mutable std::optional<Contents> contents_;
+
+  void Add(uint64_t offset, const RangeInput& input) const;
+  void Remove(uint64_t offset, const RangeInput& input) const;
+
+public:
+  RangeCache(const Sheet& sheet, Aggregates aggregates);
+  // nullptr unless the sheet is a Black::Sheet, which keeps caches up to date.
+  static std::unique_ptr<RangeCache> Create(const ISheet& sheet, Aggregates aggregates);
+
+  static uint64_t GetOffset(const CellRange& range, Position pos);
+
+  // Scans the range if the contents were dropped.
+  const Contents& Get(const CellRange& range) const;
+  // Drops the contents, e.g. once the range is resized.
+  void Reset();
+  // A cell inside the range changed from before to after. O(log n), and
+  // nothing to do while the contents aren't built.
+  void Update(const CellRange& range, Position pos, const RangeInput& before, const RangeInput& after);
+
+  size_t MemoryUsage() const;
+};
+} // namespace Black
@@ -0,0 +1,117 @@
+#include "black_range_index.h"
+#include "black_memory.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace Black {
+  void RangeIndex::InsertIntoTree(int id) {
+    const auto& range = entries_[id].range;
+    // Canonical cover of [first, last] by the nodes of a bottom-up segment tree.
+    for (int left = leaves_ + range.first.row, right = leaves_ + range.last.row + 1;
+         left < right; left /= 2, right /= 2) {
+      if (left & 1) {
+        tree_[left++].push_back(id);
+      }
+      if (right & 1) {
+        tree_[--right].push_back(id);
+      }
+    }
+  }
+
+  void RangeIndex::Rebuild(int leaves) {
+    std::vector<Entry> entries;
+    for (const auto& entry : entries_) {
+      if (entry.alive) {
+        entries.push_back(entry);
+      }
+    }
+    entries_ = std::move(entries);
+    dead_ = 0;
+
+    leaves_ = leaves;
+    tree_.assign(2 * size_t(leaves_), {});
+    cell_entries_.clear();
+    by_last_row_.clear();
+    by_last_col_.clear();
+    for (int id = 0; id < int(entries_.size()); ++id) {
+      const auto& entry = entries_[id];
+      InsertIntoTree(id);
+      cell_entries_.emplace(entry.cell, id);
+      by_last_row_.emplace(entry.range.last.row, id);
+      by_last_col_.emplace(entry.range.last.col, id);
+    }
+  }
+
+  void RangeIndex::Add(Cell* cell, CellRange range) {
+    const int id = entries_.size();
+    entries_.push_back({cell, range, true});
+    cell_entries_.emplace(cell, id);
+    by_last_row_.emplace(range.last.row, id);
+    by_last_col_.emplace(range.last.col, id);
+
+    if (range.last.row >= leaves_) {
+      int leaves = std::max(leaves_, 64);
+      while (leaves <= range.last.row) {
+        leaves *= 2;
+      }
+      Rebuild(leaves); // inserts the new entry too
+    } else {
+      InsertIntoTree(id);
+    }
+  }
+
+  void RangeIndex::Remove(const Cell* cell) {
+    auto [first, last] = cell_entries_.equal_range(cell);
+    if (first == last) {
+      return;
+    }
+    for (auto it = first; it != last; ++it) {
+      auto& entry = entries_[it->second];
+      entry.alive = false;
+      by_last_row_.erase({entry.range.last.row, it->second});
+      by_last_col_.erase({entry.range.last.col, it->second});
+      ++dead_;
+    }
+    cell_entries_.erase(first, last);
+
+    if (dead_ > entries_.size() / 2) {
+      Rebuild(leaves_);
+    }
+  }
+
+  bool RangeIndex::Empty() const {
+    return cell_entries_.empty();
+  }
+
+  std::vector<Cell*> RangeIndex::Collect(const std::set<std::pair<int, int>>& by_last, int first,
+                                         const std::vector<Entry>& entries) {
+    std::vector<Cell*> result;
+    for (auto it = by_last.lower_bound({first, std::numeric_limits<int>::min()}); it != by_last.end(); ++it) {
+      result.push_back(entries[it->second].cell);
+    }
+    std::sort(std::begin(result), std::end(result), std::less<>{});
+    result.erase(std::unique(std::begin(result), std::end(result)), std::end(result));
+    return result;
+  }
+
+  std::vector<Cell*> RangeIndex::CollectFromRow(int row) const {
+    return Collect(by_last_row_, row, entries_);
+  }
+
+  std::vector<Cell*> RangeIndex::CollectFromCol(int col) const {
+    return Collect(by_last_col_, col, entries_);
+  }
+
+  size_t RangeIndex::MemoryUsage() const {
+    size_t usage = HeapBytes(entries_) + HeapBytes(tree_);
+    for (const auto& node : tree_) {
+      usage += HeapBytes(node);
+    }
+    // Node based containers: an element plus a couple of pointers per node.
+    usage += cell_entries_.size() * (sizeof(std::pair<const Cell*, int>) + 2 * sizeof(void*))
+           + cell_entries_.bucket_count() * sizeof(void*);
+    usage += (by_last_row_.size() + by_last_col_.size()) * (sizeof(std::pair<int, int>) + 4 * sizeof(void*));
+    return usage;
+  }
+} // namespace Black
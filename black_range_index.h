@@ -0,0 +1,74 @@
+#pragma once
+#include "common.h"
+#include "black_position.h"
+
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Black {
+class Cell;
+
+// Formula cells referring to cell ranges, one entry per range reference
+// instead of a dependency edge per cell of the range.
+// * The ranges containing a cell are found with a segment tree over the rows
+//   in O(log rows + k), k being the number of ranges spanning the row.
+// * The ranges ending at or after a row/column, which move on row/column
+//   insertion and deletion, come from sets ordered by the last row/column.
+// Removed entries are only marked dead in the tree and swept out when they
+// outnumber the live ones.
+class RangeIndex {
+  struct Entry {
+    Cell* cell;
+    CellRange range;
+    bool alive;
+  };
+
+  std::vector<Entry> entries_;
+  std::vector<std::vector<int>> tree_; // node -> entries covering its rows, leaves_ + row is the leaf
+  int leaves_ = 0;
+  size_t dead_ = 0;
+  std::unordered_multimap<const Cell*, int> cell_entries_;
+  std::set<std::pair<int, int>> by_last_row_; // (last row, entry)
+  std::set<std::pair<int, int>> by_last_col_;
+
+  void InsertIntoTree(int id);
+  void Rebuild(int leaves);
+  static std::vector<Cell*> Collect(const std::set<std::pair<int, int>>& by_last, int first,
+                                    const std::vector<Entry>& entries);
+
+public:
+  void Add(Cell* cell, CellRange range);
+  // Removes all the ranges of the cell.
+  void Remove(const Cell* cell);
+
+  bool Empty() const;
+
+  // Calls func(cell) for every range containing the position, a cell is
+  // passed once per such range.
+  template <typename Func>
+  void ForEachContaining(Position pos, Func&& func) const;
+
+  // Cells with ranges ending at or after the row/column, without duplicates.
+  std::vector<Cell*> CollectFromRow(int row) const;
+  std::vector<Cell*> CollectFromCol(int col) const;
+
+  size_t MemoryUsage() const;
+};
+
+template <typename Func>
+void RangeIndex::ForEachContaining(Position pos, Func&& func) const {
+  if (pos.row >= leaves_) {
+    return;
+  }
+  for (int node = leaves_ + pos.row; node > 0; node /= 2) {
+    for (int id : tree_[node]) {
+      const auto& entry = entries_[id];
+      if (entry.alive && entry.range.Contains(pos)) {
+        func(entry.cell);
+      }
+    }
+  }
+}
+} // namespace Black
@@ -2,6 +2,8 @@
 #include "black_utils.h"
 
 #include <algorithm>
+#include <cassert>
+#include <iterator>
 
 namespace Black {
   void Sheet::ValidatePosition(Position pos) const {
@@ -11,55 +13,305 @@ namespace Black {
   }
 
   Size Sheet::GetPrintableSize() const {
-    Size size{};
-
-    int rows = 0;
-    for (auto& row : table_) {
-      ++rows;
-      int cols = 0;
-      for (auto& cell : row) {
-        ++cols;
-        if (cell && !cell->Empty()) {
-          size.rows = rows;
-          size.cols = std::max(size.cols, cols);
-        }
-      }
-    }
-    return size;
+    return printable_size_;
   }
-void Sheet::PrintValues(std::ostream& output) const {
-    PrintImpl(output,
-      [] (std::ostream& output, const auto& cell_holder) {
-        std::visit([&] (const auto& value) { output << value; }, cell_holder->GetValue());
-      }
-    );
+
+  namespace {
+    const auto kValuePrinter = [] (BufferedWriter& writer, const Black::Cell* cell) {
+      std::visit([&] (const auto& value) { writer.Write(value); }, cell->GetValue());
+    };
+    const auto kTextPrinter = [] (BufferedWriter& writer, const Black::Cell* cell) {
+      writer.Write(cell->GetText());
+    };
+  }
+
+  void Sheet::PrintValues(std::ostream& output) const {
+    PrintImpl(output, kValuePrinter);
   }
 
   void Sheet::PrintTexts(std::ostream& output) const {
-    PrintImpl(output,
-      [] (std::ostream& output, const auto& cell_holder) {
-        output << cell_holder->GetText();
-      }
-    );
+    PrintImpl(output, kTextPrinter);
+  }
+
+  void Sheet::PrintValues(std::ostream& output, const ExportOptions& options) const {
+    PrintBands(output, options, [] (const Black::Cell* cell) { cell->GetValue(); }, kValuePrinter);
+  }
+
+  void Sheet::PrintTexts(std::ostream& output, const ExportOptions& options) const {
+    PrintBands(output, options, [] (const Black::Cell* cell) { cell->GetText(); }, kTextPrinter);
   }
 
   Black::Cell* Sheet::GetCellImpl(Position pos) const {
     ValidatePosition(pos);
 
-    if (size_t(pos.row) < table_.size()) {
-      auto& row = table_[pos.row];
-      if (size_t(pos.col) < row.size()) {
-        return row[pos.col].get();
+    if (size_t(pos.row) < rows_.size() && size_t(pos.col) < cols_.size()) {
+      const int row = rows_[pos.row];
+      const int col = cols_[pos.col];
+      if (row != kNoIndex && col != kNoIndex && size_t(col) < table_[row].size()) {
+        return table_[row][col].get();
       }
     }
     return nullptr;
   }
 
-  std::unique_ptr<Black::Cell>& Sheet::GetCellRef(Position pos) {
-    table_.resize(std::max<size_t>(table_.size(), pos.row + 1));
-    auto& row  = table_[pos.row];
-    row.resize(std::max<size_t>(row.size(), pos.col + 1));
-    return row[pos.col];
+  int Sheet::AllocateIndex(std::vector<int>& cells_count, std::vector<int>& free_indices) {
+    if (free_indices.empty()) {
+      cells_count.push_back(0);
+      return cells_count.size() - 1;
+    }
+    const int index = free_indices.back();
+    free_indices.pop_back();
+    return index;
+  }
+
+  Black::Cell* Sheet::PlaceCell(Position pos, std::unique_ptr<Black::Cell> cell) {
+    rows_.resize(std::max<size_t>(rows_.size(), pos.row + 1), kNoIndex);
+    cols_.resize(std::max<size_t>(cols_.size(), pos.col + 1), kNoIndex);
+
+    auto& row = rows_[pos.row];
+    if (row == kNoIndex) {
+      row = AllocateIndex(row_cells_, free_rows_);
+      table_.resize(row_cells_.size());
+      row_values_.resize(row_cells_.size());
+      row_dependents_.resize(row_cells_.size());
+      if (!logical_maps_stale_) {
+        logical_rows_.resize(row_cells_.size(), kNoIndex);
+        logical_rows_[row] = pos.row;
+      }
+    }
+    auto& col = cols_[pos.col];
+    if (col == kNoIndex) {
+      col = AllocateIndex(col_cells_, free_cols_);
+      col_values_.resize(col_cells_.size());
+      columns_.resize(col_cells_.size());
+      lookup_indexes_.resize(col_cells_.size());
+      col_dependents_.resize(col_cells_.size());
+      if (!logical_maps_stale_) {
+        logical_cols_.resize(col_cells_.size(), kNoIndex);
+        logical_cols_[col] = pos.col;
+      }
+    }
+
+    auto& cells = table_[row];
+    if (cells.empty() && pos.row < reserved_size_.rows) {
+      cells.reserve(reserved_size_.cols);
+    }
+    cells.resize(std::max<size_t>(cells.size(), col + 1));
+    ++row_cells_[row];
+    ++col_cells_[col];
+
+    cell->SetPhysicalPosition({row, col});
+    if (profiler_) {
+      profiler_->Forget(cell.get());
+    }
+    cells[col] = std::move(cell);
+    return cells[col].get();
+  }
+
+  void Sheet::RemoveCell(Position pos) {
+    const int row = rows_[pos.row];
+    const int col = cols_[pos.col];
+    table_[row][col] = nullptr;
+    columns_[col].Set(row, NumericColumn::Kind::Empty);
+    --row_cells_[row];
+    --col_cells_[col];
+  }
+
+  void Sheet::UpdateNumericColumn(Position pos, const Black::Cell& cell, const RangeInput& input) {
+    const auto physical_pos = cell.GetPhysicalPosition();
+    auto& column = columns_[physical_pos.col];
+    auto kind = NumericColumn::Kind::Empty;
+    double number = 0;
+    if (std::holds_alternative<const Black::Cell*>(input)) {
+      kind = NumericColumn::Kind::Formula;
+    } else if (const auto* value = std::get_if<IFormula::Value>(&input)) {
+      if (const auto* value_number = std::get_if<double>(value)) {
+        kind = NumericColumn::Kind::Number;
+        number = *value_number;
+      } else {
+        kind = NumericColumn::Kind::Error;
+      }
+    }
+    if (const auto& index = lookup_indexes_[physical_pos.col]) {
+      const auto old_kind = column.GetKind(physical_pos.row);
+      const double old_number = old_kind == NumericColumn::Kind::Number ? column.Numbers()[physical_pos.row] : 0;
+      index->Update(pos.row, old_kind, old_number, kind, number);
+    }
+    column.Set(physical_pos.row, kind, number);
+  }
+
+  void Sheet::DropLookupIndexes() {
+    for (auto& index : lookup_indexes_) {
+      index = nullptr;
+    }
+  }
+
+  const LookupIndex* Sheet::GetLookupIndex(int col, LookupIndex::Kind kind) const {
+    if (size_t(col) >= cols_.size() || cols_[col] == kNoIndex) {
+      return nullptr;
+    }
+    const auto& column = columns_[cols_[col]];
+    auto& index = lookup_indexes_[cols_[col]];
+    if (index && index->Has(kind)) {
+      return index.get();
+    }
+    BLACK_COUNT(counters_, Counter::LookupIndexBuilds, 1);
+    std::vector<LookupIndex::Entry> entries;
+    std::set<int> formula_rows;
+    for (int row = 0; row < int(rows_.size()); ++row) {
+      const int physical_row = rows_[row];
+      if (physical_row == kNoIndex) {
+        continue;
+      }
+      switch (column.GetKind(physical_row)) {
+        case NumericColumn::Kind::Number:
+          entries.push_back({column.Numbers()[physical_row], row});
+          break;
+        case NumericColumn::Kind::Formula:
+          formula_rows.insert(formula_rows.end(), row);
+          break;
+        default:
+          break;
+      }
+    }
+    if (!index) {
+      index = std::make_unique<LookupIndex>(std::move(formula_rows));
+    }
+    index->Build(kind, entries);
+    return index.get();
+  }
+
+  void Sheet::AddDependent(Black::Cell* cell, Position referenced_pos) {
+    row_dependents_[rows_[referenced_pos.row]].push_back(cell);
+    col_dependents_[cols_[referenced_pos.col]].push_back(cell);
+  }
+
+  void Sheet::RemoveDependent(Black::Cell* cell, Position referenced_pos) {
+    RemoveOneOf(row_dependents_[rows_[referenced_pos.row]], cell);
+    RemoveOneOf(col_dependents_[cols_[referenced_pos.col]], cell);
+  }
+
+  void Sheet::RemoveOneOf(std::vector<Black::Cell*>& cells, Black::Cell* cell) {
+    auto cell_it = std::find(std::begin(cells), std::end(cells), cell);
+    assert(cell_it != std::end(cells));
+    *cell_it = cells.back();
+    cells.pop_back();
+  }
+
+  std::vector<Black::Cell*> Sheet::CollectDependents(
+    const std::vector<int>& order, const std::vector<std::vector<Black::Cell*>>& dependents, int first
+  ) {
+    std::vector<Black::Cell*> result;
+    for (int index : Tail(order, first)) {
+      if (index != kNoIndex) {
+        result.insert(std::end(result), std::begin(dependents[index]), std::end(dependents[index]));
+      }
+    }
+    std::sort(std::begin(result), std::end(result), std::less<>{});
+    result.erase(std::unique(std::begin(result), std::end(result)), std::end(result));
+    return result;
+  }
+
+  uint64_t Sheet::GetEditEpoch() const {
+    return edit_epoch_;
+  }
+
+  uint64_t Sheet::NextEditEpoch() {
+    return ++edit_epoch_;
+  }
+
+  SheetStats Sheet::GetStats() const {
+    return counters_.Snapshot();
+  }
+
+  SheetCounters& Sheet::GetCounters() const {
+    return counters_;
+  }
+
+  void Sheet::SetTracer(Tracer* tracer) {
+    tracer_ = tracer;
+  }
+
+  Tracer* Sheet::GetTracer() const {
+    return tracer_;
+  }
+
+  void Sheet::SetProfiler(Profiler* profiler) {
+    profiler_ = profiler;
+  }
+
+  Profiler* Sheet::GetProfiler() const {
+    return profiler_;
+  }
+
+  std::optional<Position> Sheet::FindPosition(const Black::Cell& cell) const {
+    const auto physical_pos = cell.GetPhysicalPosition();
+    if (physical_pos.row == kNoIndex) {
+      return std::nullopt;
+    }
+    if (logical_maps_stale_) {
+      auto invert = [] (const std::vector<int>& order, std::vector<int>& inverse, size_t size) {
+        inverse.assign(size, kNoIndex);
+        for (int i = 0; i < int(order.size()); ++i) {
+          if (order[i] != kNoIndex) {
+            inverse[order[i]] = i;
+          }
+        }
+      };
+      invert(rows_, logical_rows_, row_cells_.size());
+      invert(cols_, logical_cols_, col_cells_.size());
+      logical_maps_stale_ = false;
+    }
+    return Position{logical_rows_[physical_pos.row], logical_cols_[physical_pos.col]};
+  }
+
+  MemoryBreakdown Sheet::MemoryUsage() const {
+    MemoryBreakdown usage;
+    usage.table = sizeof(*this) + HeapBytes(table_)
+                + HeapBytes(rows_) + HeapBytes(cols_)
+                + HeapBytes(row_cells_) + HeapBytes(col_cells_)
+                + HeapBytes(row_values_) + HeapBytes(col_values_)
+                + HeapBytes(free_rows_) + HeapBytes(free_cols_)
+                + HeapBytes(logical_rows_) + HeapBytes(logical_cols_)
+                + HeapBytes(columns_) + HeapBytes(lookup_indexes_);
+    for (const auto& column : columns_) {
+      usage.table += column.MemoryUsage();
+    }
+    for (const auto& index : lookup_indexes_) {
+      usage.table += index ? index->MemoryUsage() : 0;
+    }
+    usage.references = HeapBytes(row_dependents_) + HeapBytes(col_dependents_) + range_index_.MemoryUsage();
+    for (const auto& dependents : row_dependents_) {
+      usage.references += HeapBytes(dependents);
+    }
+    for (const auto& dependents : col_dependents_) {
+      usage.references += HeapBytes(dependents);
+    }
+    for (const auto& cells : table_) {
+      usage.table += HeapBytes(cells);
+      for (const auto& cell : cells) {
+        if (cell) {
+          cell->AddMemoryUsage(usage);
+        }
+      }
+    }
+    return usage;
+  }
+
+  void Sheet::Reserve(Size size) {
+    const size_t rows = std::clamp(size.rows, 0, int(Position::kMaxRows));
+    const size_t cols = std::clamp(size.cols, 0, int(Position::kMaxCols));
+    for (auto* row_vector : {&rows_, &row_cells_, &row_values_}) {
+      row_vector->reserve(rows);
+    }
+    table_.reserve(rows);
+    row_dependents_.reserve(rows);
+    for (auto* col_vector : {&cols_, &col_cells_, &col_values_}) {
+      col_vector->reserve(cols);
+    }
+    columns_.reserve(cols);
+    col_dependents_.reserve(cols);
+    reserved_size_ = {int(rows), int(cols)};
   }
 
   const ICell* Sheet::GetCell(Position pos) const {
@@ -70,181 +322,478 @@ void Sheet::PrintValues(std::ostream& output) const {
     return GetCellImpl(pos);
   }
 
-  void Sheet::ShrinkRow(std::vector<std::unique_ptr<Cell>>& row) {
-    while (!row.empty() && !row.back()) {
-      row.pop_back();
+  void Sheet::ShrinkTable() {
+    while (!rows_.empty() && (rows_.back() == kNoIndex || !row_cells_[rows_.back()])) {
+      if (rows_.back() != kNoIndex) {
+        table_[rows_.back()].clear();
+        free_rows_.push_back(rows_.back());
+      }
+      rows_.pop_back();
+    }
+    while (!cols_.empty() && (cols_.back() == kNoIndex || !col_cells_[cols_.back()])) {
+      if (cols_.back() != kNoIndex) {
+        columns_[cols_.back()].Clear();
+        lookup_indexes_[cols_.back()] = nullptr;
+        free_cols_.push_back(cols_.back());
+      }
+      cols_.pop_back();
     }
   }
 
-  void Sheet::ShrinkTable() {
-    while (!table_.empty() && table_.back().empty()) {
-      table_.pop_back();
+  void Sheet::UpdatePrintableSize(Position pos, bool was_empty, bool is_empty) {
+    if (was_empty == is_empty) {
+      return;
+    }
+
+    const int delta = was_empty ? 1 : -1;
+    row_values_[rows_[pos.row]] += delta;
+    col_values_[cols_[pos.col]] += delta;
+
+    if (is_empty) {
+      ShrinkPrintableSize();
+    } else {
+      printable_size_.rows = std::max(printable_size_.rows, pos.row + 1);
+      printable_size_.cols = std::max(printable_size_.cols, pos.col + 1);
     }
   }
 
-  void Sheet::DeleteReferencesForCell(Position pos, const std::vector<Position>& refs) {
-    for (auto referenced_cell_pos : refs) {
-      auto& row = table_[referenced_cell_pos.row];
-      auto& cell = row[referenced_cell_pos.col];
+  void Sheet::ShrinkPrintableSize() {
+    printable_size_.rows = LastUsedIndex(rows_, row_values_, printable_size_.rows) + 1;
+    printable_size_.cols = LastUsedIndex(cols_, col_values_, printable_size_.cols) + 1;
+    if (!printable_size_.rows || !printable_size_.cols) {
+      printable_size_ = {};
+    }
+  }
 
-      cell->RemoveIncomingRef(pos);
-      if (cell->Empty() && !cell->HasIncomingRefs()) {
-        cell = nullptr;
+  int Sheet::LastUsedIndex(const std::vector<int>& order, const std::vector<int>& values_count, int end) {
+    int index = std::min<int>(end, order.size()) - 1;
+    while (index >= 0 && (order[index] == kNoIndex || !values_count[order[index]])) {
+      --index;
+    }
+    return index;
+  }
 
-        ShrinkRow(row);
+  void Sheet::DeleteReferencesForCell(Black::Cell* cell, const std::vector<Position>& refs) {
+    range_index_.Remove(cell);
+    for (auto referenced_cell_pos : refs) {
+      GetCellImpl(referenced_cell_pos)->RemoveIncomingRef(cell);
+      RemoveDependent(cell, referenced_cell_pos);
+    }
+    DeleteUnusedCells(refs);
+  }
+
+  void Sheet::DeleteUnusedCells(std::vector<Position> positions) {
+    for (auto pos : positions) {
+      auto* cell = GetCellImpl(pos);
+      if (cell && cell->Empty() && !cell->HasIncomingRefs()) {
+        RemoveCell(pos);
       }
     }
     ShrinkTable();
   }
 
+  std::vector<Black::Cell*> Sheet::CollectRangeDependents(Position pos) const {
+    std::vector<Black::Cell*> dependents;
+    range_index_.ForEachContaining(pos, [&] (Black::Cell* dependent) { dependents.push_back(dependent); });
+    std::sort(std::begin(dependents), std::end(dependents), std::less<>{});
+    dependents.erase(std::unique(std::begin(dependents), std::end(dependents)), std::end(dependents));
+    return dependents;
+  }
+
+  void Sheet::UpdateRangeDependents(const std::vector<Black::Cell*>& dependents, Position pos,
+                                    const RangeInput& before, const RangeInput& after) {
+    for (auto* dependent : dependents) {
+      dependent->HandleRangeCellChanged(pos, before, after);
+    }
+  }
+
   void Sheet::ClearCell(Position pos) {
     auto* cell = GetCellImpl(pos);
     if (!cell) {
       return;
     }
 
-    DeleteReferencesForCell(pos, cell->GetReferencedCells());
+    const auto range_dependents = CollectRangeDependents(pos);
+    if (!range_dependents.empty()) {
+      UpdateRangeDependents(range_dependents, pos, GetRangeInput(cell), {});
+    }
+    DeleteReferencesForCell(cell, cell->GetReferencedCells());
+    UpdatePrintableSize(pos, cell->Empty(), true);
+    UpdateNumericColumn(pos, *cell, {});
 
     if (cell->HasIncomingRefs()) {
       cell->Clear();
       return;
     }
 
-    auto& row = table_[pos.row];
-    row[pos.col] = nullptr;
-
-    ShrinkRow(row);
+    RemoveCell(pos);
     ShrinkTable();
   }
 
   void Sheet::SetCell(Position pos, std::string text) {
     ValidatePosition(pos);
 
-    auto& cell = GetCellRef(pos);
+    auto* cell = GetCellImpl(pos);
 
     if (cell && cell->GetText() == text) {
       return;
     }
 
-    auto new_cell_holder = std::make_unique<Black::Cell>(
-      *this, pos, std::move(text), cell && cell->HasIncomingRefs()
-    );
-    if (cell) {
-      cell->InvalidateCache();
-      DeleteReferencesForCell(pos, cell->GetReferencedCells());
-      new_cell_holder->SetIncomingReferences(cell->ReleaseIncomingReferences());
+    // Formulas over ranges get the value the cell had before the edit, so
+    // they can update their aggregates instead of scanning the range.
+    const auto range_dependents = CollectRangeDependents(pos);
+    const auto before = range_dependents.empty() ? RangeInput{} : GetRangeInput(cell);
+
+    if (!cell) {
+      auto new_cell_holder = std::make_unique<Black::Cell>(*this);
+      new_cell_holder->Set(pos, std::move(text));
+      cell = PlaceCell(pos, std::move(new_cell_holder));
+      UpdatePrintableSize(pos, true, cell->Empty());
+    } else {
+      const bool was_empty = cell->Empty();
+      auto old_referenced_cells = cell->GetReferencedCells();
+      cell->Set(pos, std::move(text));
+      UpdatePrintableSize(pos, was_empty, cell->Empty());
+      DeleteReferencesForCell(cell, old_referenced_cells);
+    }
+
+    LinkReferences(cell);
+    const auto after = GetRangeInput(cell);
+    UpdateNumericColumn(pos, *cell, after);
+    if (!range_dependents.empty()) {
+      UpdateRangeDependents(range_dependents, pos, before, after);
     }
-    cell = std::move(new_cell_holder);
+  }
+
+  void Sheet::SetFormula(Position pos, std::unique_ptr<Black::Formula> formula) {
+    ValidatePosition(pos);
+
+    auto* cell = GetCellImpl(pos);
+    const auto range_dependents = CollectRangeDependents(pos);
+    const auto before = range_dependents.empty() ? RangeInput{} : GetRangeInput(cell);
+    if (!cell) {
+      cell = PlaceCell(pos, std::make_unique<Black::Cell>(*this));
+    }
+    const bool was_empty = cell->Empty();
+    auto old_referenced_cells = cell->GetReferencedCells();
+    cell->Set(std::move(formula));
+    UpdatePrintableSize(pos, was_empty, false);
+    DeleteReferencesForCell(cell, old_referenced_cells);
+
+    LinkReferences(cell);
+    const auto after = GetRangeInput(cell);
+    UpdateNumericColumn(pos, *cell, after);
+    if (!range_dependents.empty()) {
+      UpdateRangeDependents(range_dependents, pos, before, after);
+    }
+  }
 
+  void Sheet::LinkReferences(Black::Cell* cell) {
     for (auto referenced_cell_pos : cell->GetReferencedCells()) {
-      auto& referenced_cell = GetCellRef(referenced_cell_pos);
+      auto* referenced_cell = GetCellImpl(referenced_cell_pos);
       if (!referenced_cell) {
-        referenced_cell = std::make_unique<Black::Cell>(*this, referenced_cell_pos, "", false);
+        referenced_cell = PlaceCell(referenced_cell_pos, std::make_unique<Black::Cell>(*this));
       }
-      referenced_cell->AddIncomingRef(pos);
+      referenced_cell->AddIncomingRef(cell);
+      AddDependent(cell, referenced_cell_pos);
     }
+    IndexRanges(cell);
+    cell->BindReferences();
+  }
+
+  void Sheet::IndexRanges(Black::Cell* cell) {
+    if (const auto* formula = cell->GetFormula()) {
+      for (const auto& range : formula->GetReferencedRanges()) {
+        range_index_.Add(cell, range);
+      }
+    }
+  }
+
+  std::vector<Black::Cell*> Sheet::MergeRangeDependents(
+    std::vector<Black::Cell*> dependents, const std::vector<Black::Cell*>& range_dependents
+  ) {
+    if (range_dependents.empty()) {
+      return dependents;
+    }
+    for (auto* cell : range_dependents) {
+      range_index_.Remove(cell);
+    }
+    std::vector<Black::Cell*> result;
+    std::set_union(std::begin(dependents), std::end(dependents),
+                   std::begin(range_dependents), std::end(range_dependents),
+                   std::back_inserter(result), std::less<>{});
+    return result;
+  }
+
+  bool Sheet::HasRangeDependents(Position pos) const {
+    bool found = false;
+    range_index_.ForEachContaining(pos, [&] (Black::Cell*) { found = true; });
+    return found;
+  }
+
+  size_t Sheet::CountDependents(Position pos) const {
+    auto dependents = CollectRangeDependents(pos);
+    if (const auto* cell = GetCellImpl(pos)) {
+      const auto& refs = cell->GetIncomingRefs();
+      dependents.insert(std::end(dependents), std::begin(refs), std::end(refs));
+      std::sort(std::begin(dependents), std::end(dependents), std::less<>{});
+      dependents.erase(std::unique(std::begin(dependents), std::end(dependents)), std::end(dependents));
+    }
+    return dependents.size();
   }
 
   void Sheet::InsertRows(int before, int count) {
-    bool insert_in_the_middle = table_.size() > size_t(before);
+    TraceSpan span(tracer_, "InsertRows", {"before", before}, {"count", count});
+    logical_maps_stale_ = true;
+    bool insert_in_the_middle = rows_.size() > size_t(before);
 
-    int new_rows = (table_.size() + count) * insert_in_the_middle + (before + count) * !insert_in_the_middle;
+    int new_rows = (rows_.size() + count) * insert_in_the_middle + (before + count) * !insert_in_the_middle;
     if (new_rows > Position::kMaxRows) {
       throw TableTooBigException("");
     }
 
-    if (insert_in_the_middle && count) {
-       for (auto& row : table_) {
-         for(auto& cell : row) {
-           if (cell) {
-             cell->HandleInsertedRows(before, count);
-           }
-         }
-       }
-
-      table_.resize(table_.size() + count);
-      std::rotate(std::begin(table_) + before, std::end(table_) - count, std::end(table_));
+    if (!count) {
+      return;
+    }
+    // Ranges may reach beyond the table, they move even when the table doesn't.
+    const auto range_dependents = range_index_.CollectFromRow(before);
+    const auto dependents = MergeRangeDependents(
+      insert_in_the_middle ? CollectDependents(rows_, row_dependents_, before) : std::vector<Black::Cell*>{},
+      range_dependents
+    );
+    for (auto* cell : dependents) {
+      cell->HandleInsertedRows(before, count);
+    }
+    BLACK_COUNT(counters_, Counter::StructuralCellsTouched, dependents.size());
+    if (insert_in_the_middle) {
+      DropLookupIndexes();
+      rows_.insert(std::begin(rows_) + before, count, kNoIndex);
+      printable_size_.rows += count * (before < printable_size_.rows);
+    }
+    for (auto* cell : range_dependents) {
+      IndexRanges(cell);
     }
   }
 
   void Sheet::InsertCols(int before, int count) {
-    auto max_cols_it = std::max_element(
-      std::begin(table_), std::end(table_),
-      [] (const auto& lhs, const auto& rhs) { return lhs.size() < rhs.size(); }
-    );
-    const int max_cols = max_cols_it == std::end(table_) ? 0 : max_cols_it->size();
-    bool insert_in_the_middle = max_cols > before;
+    TraceSpan span(tracer_, "InsertCols", {"before", before}, {"count", count});
+    logical_maps_stale_ = true;
+    bool insert_in_the_middle = cols_.size() > size_t(before);
 
-    int new_cols = (max_cols + count) * insert_in_the_middle + (before + count) * !insert_in_the_middle;
+    int new_cols = (cols_.size() + count) * insert_in_the_middle + (before + count) * !insert_in_the_middle;
     if (new_cols > Position::kMaxCols) {
       throw TableTooBigException("");
     }
 
-    if (insert_in_the_middle && count) {
-      for (auto& row : table_) {
-        for (auto& cell : row) {
-          if(cell) {
-            cell->HandleInsertedCols(before, count);
+    if (!count) {
+      return;
+    }
+    // Ranges may reach beyond the table, they move even when the table doesn't.
+    const auto range_dependents = range_index_.CollectFromCol(before);
+    const auto dependents = MergeRangeDependents(
+      insert_in_the_middle ? CollectDependents(cols_, col_dependents_, before) : std::vector<Black::Cell*>{},
+      range_dependents
+    );
+    for (auto* cell : dependents) {
+      cell->HandleInsertedCols(before, count);
+    }
+    BLACK_COUNT(counters_, Counter::StructuralCellsTouched, dependents.size());
+    if (insert_in_the_middle) {
+      cols_.insert(std::begin(cols_) + before, count, kNoIndex);
+      printable_size_.cols += count * (before < printable_size_.cols);
+    }
+    for (auto* cell : range_dependents) {
+      IndexRanges(cell);
+    }
+  }
+
+  void Sheet::DeleteRows(int first, int count) {
+    TraceSpan span(tracer_, "DeleteRows", {"first", first}, {"count", count});
+    logical_maps_stale_ = true;
+    if (!count) {
+      return;
+    }
+    if (rows_.size() <= size_t(first)) {
+      // Only ranges reach beyond the table.
+      const auto range_dependents = range_index_.CollectFromRow(first);
+      for (auto* cell : MergeRangeDependents({}, range_dependents)) {
+        cell->HandleDeletedRows(first, count);
+      }
+      BLACK_COUNT(counters_, Counter::StructuralCellsTouched, range_dependents.size());
+      for (auto* cell : range_dependents) {
+        IndexRanges(cell);
+      }
+      return;
+    }
+
+    DropLookupIndexes();
+    auto deleted_rows = Head(Tail(rows_, first), count);
+    std::vector<Position> released_refs;
+    for (int row : deleted_rows) {
+      if (row == kNoIndex) {
+        continue;
+      }
+      for (auto& cell : table_[row]) {
+        if (cell) {
+          auto refs = cell->GetReferencedCells();
+          for (auto referenced_cell_pos : refs) {
+            RemoveDependent(cell.get(), referenced_cell_pos);
           }
-        }
-        if (row.size() > size_t(before)) {
-          row.resize(row.size() + count);
-          std::rotate(std::begin(row) + before, std::end(row) - count, std::end(row));
+          cell->DetachFromReferencedCells();
+          range_index_.Remove(cell.get());
+          released_refs.insert(std::end(released_refs), std::begin(refs), std::end(refs));
         }
       }
     }
-  }
 
-  void Sheet::DeleteRows(int first, int count) {
-    bool erase_in_the_middle = table_.size() > size_t(first);
-    if (erase_in_the_middle && count) {
-      table_.erase(
-        std::begin(table_) + first,
-        std::begin(table_) + first + std::min<size_t>(table_.size() - first, count)
-      );
-      for (auto& row : table_) {
-        for(auto& cell : row) {
-          if (cell) {
-            cell->HandleDeletedRows(first, count);
-            if (cell->Empty() && !cell->HasIncomingRefs()) {
-              cell = nullptr;
-            }
+    for (int row : deleted_rows) {
+      if (row == kNoIndex) {
+        continue;
+      }
+      for (size_t col = 0; col < table_[row].size(); ++col) {
+        if (const auto& cell = table_[row][col]) {
+          for (auto* dependent : cell->GetIncomingRefs()) {
+            RemoveOneOf(col_dependents_[col], dependent);
           }
         }
-        ShrinkRow(row);
       }
-      ShrinkTable();
     }
+    const auto range_dependents = range_index_.CollectFromRow(first);
+    auto dependents = MergeRangeDependents(CollectDependents(rows_, row_dependents_, first), range_dependents);
+
+    for (int row : deleted_rows) {
+      if (row == kNoIndex) {
+        continue;
+      }
+      for (size_t col = 0; col < table_[row].size(); ++col) {
+        if (const auto& cell = table_[row][col]) {
+          --col_cells_[col];
+          col_values_[col] -= !cell->Empty();
+          columns_[col].Set(row, NumericColumn::Kind::Empty);
+        }
+      }
+      BLACK_COUNT(counters_, Counter::StructuralCellsTouched, row_cells_[row]);
+      table_[row].clear();
+      row_cells_[row] = 0;
+      row_values_[row] = 0;
+      row_dependents_[row].clear();
+      free_rows_.push_back(row);
+    }
+    rows_.erase(std::begin(deleted_rows), std::end(deleted_rows));
+    printable_size_.rows -= std::clamp(printable_size_.rows - first, 0, count);
+    ShrinkPrintableSize();
+
+    for (auto* cell : dependents) {
+      cell->HandleDeletedRows(first, count);
+    }
+    BLACK_COUNT(counters_, Counter::StructuralCellsTouched, dependents.size());
+    for (auto* cell : range_dependents) {
+      IndexRanges(cell);
+    }
+
+    released_refs.erase(
+      std::remove_if(std::begin(released_refs), std::end(released_refs),
+                     [=] (Position pos) { return ValidateBoundaries(first, first + count, pos.row); }
+      ),
+      std::end(released_refs)
+    );
+    for (auto& pos : released_refs) {
+      pos.row -= count * (pos.row >= first + count);
+    }
+    DeleteUnusedCells(std::move(released_refs));
   }
 
   void Sheet::DeleteCols(int first, int count) {
-    if (!count) return;
-
-    bool erase_in_the_middle = false;
-    for (auto& row : table_) {
-      auto erase_begin_it = std::begin(row) + std::min<size_t>(row.size(), first);
-
-      erase_in_the_middle = erase_begin_it != std::end(row);
-
-      row.erase(
-        erase_begin_it,
-        erase_begin_it + std::min<size_t>(std::end(row) - erase_begin_it, count)
-      );
-    }
-    if (erase_in_the_middle) {
-      for (auto& row : table_) {
-        for(auto& cell : row) {
-          if (cell) {
-            cell->HandleDeletedCols(first, count);
-            if (cell->Empty() && !cell->HasIncomingRefs()) {
-              cell = nullptr;
-            }
+    TraceSpan span(tracer_, "DeleteCols", {"first", first}, {"count", count});
+    logical_maps_stale_ = true;
+    if (!count) {
+      return;
+    }
+    if (cols_.size() <= size_t(first)) {
+      // Only ranges reach beyond the table.
+      const auto range_dependents = range_index_.CollectFromCol(first);
+      for (auto* cell : MergeRangeDependents({}, range_dependents)) {
+        cell->HandleDeletedCols(first, count);
+      }
+      BLACK_COUNT(counters_, Counter::StructuralCellsTouched, range_dependents.size());
+      for (auto* cell : range_dependents) {
+        IndexRanges(cell);
+      }
+      return;
+    }
+
+    auto deleted_cols = Head(Tail(cols_, first), count);
+    std::vector<Position> released_refs;
+    for (auto& cells : table_) {
+      for (int col : deleted_cols) {
+        if (col != kNoIndex && size_t(col) < cells.size() && cells[col]) {
+          auto refs = cells[col]->GetReferencedCells();
+          for (auto referenced_cell_pos : refs) {
+            RemoveDependent(cells[col].get(), referenced_cell_pos);
           }
+          cells[col]->DetachFromReferencedCells();
+          range_index_.Remove(cells[col].get());
+          released_refs.insert(std::end(released_refs), std::begin(refs), std::end(refs));
         }
-        ShrinkRow(row);
       }
-      ShrinkTable();
     }
+
+    for (size_t row = 0; row < table_.size(); ++row) {
+      const auto& cells = table_[row];
+      for (int col : deleted_cols) {
+        if (col != kNoIndex && size_t(col) < cells.size() && cells[col]) {
+          for (auto* dependent : cells[col]->GetIncomingRefs()) {
+            RemoveOneOf(row_dependents_[row], dependent);
+          }
+        }
+      }
+    }
+    const auto range_dependents = range_index_.CollectFromCol(first);
+    auto dependents = MergeRangeDependents(CollectDependents(cols_, col_dependents_, first), range_dependents);
+
+    for (size_t row = 0; row < table_.size(); ++row) {
+      auto& cells = table_[row];
+      for (int col : deleted_cols) {
+        if (col != kNoIndex && size_t(col) < cells.size() && cells[col]) {
+          row_values_[row] -= !cells[col]->Empty();
+          cells[col] = nullptr;
+          --row_cells_[row];
+        }
+      }
+    }
+    for (int col : deleted_cols) {
+      if (col != kNoIndex) {
+        BLACK_COUNT(counters_, Counter::StructuralCellsTouched, col_cells_[col]);
+        col_cells_[col] = 0;
+        col_values_[col] = 0;
+        columns_[col].Clear();
+        lookup_indexes_[col] = nullptr;
+        col_dependents_[col].clear();
+        free_cols_.push_back(col);
+      }
+    }
+    cols_.erase(std::begin(deleted_cols), std::end(deleted_cols));
+    printable_size_.cols -= std::clamp(printable_size_.cols - first, 0, count);
+    ShrinkPrintableSize();
+
+    for (auto* cell : dependents) {
+      cell->HandleDeletedCols(first, count);
+    }
+    BLACK_COUNT(counters_, Counter::StructuralCellsTouched, dependents.size());
+    for (auto* cell : range_dependents) {
+      IndexRanges(cell);
+    }
+
+    released_refs.erase(
+      std::remove_if(std::begin(released_refs), std::end(released_refs),
+                     [=] (Position pos) { return ValidateBoundaries(first, first + count, pos.col); }
+      ),
+      std::end(released_refs)
+    );
+    for (auto& pos : released_refs) {
+      pos.col -= count * (pos.col >= first + count);
+    }
+    DeleteUnusedCells(std::move(released_refs));
   }
 
 } // namespace Black
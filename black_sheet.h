@@ -3,31 +3,182 @@
 #include "formula.h"
 #include "black_cell.h"
 #include "black_range.h"
+#include "black_writer.h"
+#include "black_stats.h"
+#include "black_trace.h"
+#include "black_profiler.h"
+#include "black_range_index.h"
+#include "black_numeric_column.h"
+#include "black_lookup_index.h"
 
 #include <vector>
 #include <ostream>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <optional>
 
 namespace Black {
+// Row bands of the printable area are formatted concurrently and written to
+// the stream in order, so the output is the same as with the serial export.
+struct ExportOptions {
+  unsigned threads = 0; // 0 means std::thread::hardware_concurrency()
+  int rows_per_band = 1024;
+};
+
 class Sheet : public ISheet {
+  // Cells are stored by physical rows/columns, which never change while the
+  // cell exists. Row/column insertion and deletion only update the logical ->
+  // physical maps, so the cells and the rest of the table are not moved.
   std::vector<std::vector<std::unique_ptr<Black::Cell>>> table_;
+  std::vector<int> rows_;       // logical row -> physical row or kNoIndex
+  std::vector<int> cols_;       // logical column -> physical column or kNoIndex
+  std::vector<int> row_cells_;  // physical row -> number of cells in the row
+  std::vector<int> col_cells_;  // physical column -> number of cells in the column
+  std::vector<int> row_values_; // physical row -> number of non-empty cells in the row
+  std::vector<int> col_values_; // physical column -> number of non-empty cells in the column
+  // Physical column -> numeric shadow of its cells, for range scans.
+  std::vector<NumericColumn> columns_;
+  // Physical column -> index of its numbers by logical row, built by the
+  // first lookup into the column and dropped when rows move.
+  mutable std::vector<std::unique_ptr<LookupIndex>> lookup_indexes_;
+  Size printable_size_{};
+  Size reserved_size_{}; // set by Reserve, new rows within it get their full width at once
+  // Formulas referring to cells of a physical row/column, once per reference.
+  // Structural edits only need to update the formulas found here.
+  std::vector<std::vector<Black::Cell*>> row_dependents_;
+  std::vector<std::vector<Black::Cell*>> col_dependents_;
+  // Formulas referring to ranges, by logical position of the ranges.
+  RangeIndex range_index_;
+  std::vector<int> free_rows_;
+  std::vector<int> free_cols_;
+  uint64_t edit_epoch_ = 0;
+  mutable SheetCounters counters_;
+  Tracer* tracer_ = nullptr;
+  Profiler* profiler_ = nullptr;
+  // Physical -> logical rows/columns, only built to name the cells in traces.
+  mutable std::vector<int> logical_rows_;
+  mutable std::vector<int> logical_cols_;
+  mutable bool logical_maps_stale_ = true;
+
+  static constexpr int kNoIndex = -1;
 
   void ValidatePosition(Position pos) const;
 
   template <typename PrintFunc>
   void PrintImpl(std::ostream& output, PrintFunc&& printer) const;
-  Black::Cell* GetCellImpl(Position pos) const;
-  std::unique_ptr<Black::Cell>& GetCellRef(Position pos);
+  template <typename PrepareFunc, typename PrintFunc>
+  void PrintBands(std::ostream& output, const ExportOptions& options,
+                  PrepareFunc&& prepare, PrintFunc&& printer) const;
+  template <typename PrintFunc>
+  void PrintRows(BufferedWriter& writer, Size size, int first_row, int last_row, PrintFunc& printer) const;
+
+  static int AllocateIndex(std::vector<int>& cells_count, std::vector<int>& free_indices);
+  Black::Cell* PlaceCell(Position pos, std::unique_ptr<Black::Cell> cell);
+  void RemoveCell(Position pos);
+  // Mirrors the cell at the position into its numeric column and lookup index.
+  void UpdateNumericColumn(Position pos, const Black::Cell& cell, const RangeInput& input);
+  void DropLookupIndexes();
 
-  void DeleteReferencesForCell(Position pos, const std::vector<Position>& refs);
+  void AddDependent(Black::Cell* cell, Position referenced_pos);
+  void RemoveDependent(Black::Cell* cell, Position referenced_pos);
+  static void RemoveOneOf(std::vector<Black::Cell*>& cells, Black::Cell* cell);
+  static std::vector<Black::Cell*> CollectDependents(
+    const std::vector<int>& order, const std::vector<std::vector<Black::Cell*>>& dependents, int first
+  );
+
+  void LinkReferences(Black::Cell* cell);
+  void IndexRanges(Black::Cell* cell);
+  // Takes the range formulas out of the index while their ranges move and
+  // merges them into the sorted dependents, IndexRanges() puts them back.
+  std::vector<Black::Cell*> MergeRangeDependents(
+    std::vector<Black::Cell*> dependents, const std::vector<Black::Cell*>& range_dependents
+  );
+  // Formulas over the ranges containing the position, without duplicates.
+  std::vector<Black::Cell*> CollectRangeDependents(Position pos) const;
+  // Passes an edit of the cell at the position to the formulas over the
+  // ranges containing it, collected before the edit.
+  static void UpdateRangeDependents(const std::vector<Black::Cell*>& dependents, Position pos,
+                                    const RangeInput& before, const RangeInput& after);
+  void DeleteReferencesForCell(Black::Cell* cell, const std::vector<Position>& refs);
+  void DeleteUnusedCells(std::vector<Position> positions);
 
-  void ShrinkRow(std::vector<std::unique_ptr<Black::Cell>>& row);
   void ShrinkTable();
 
+  // Keep printable_size_ in sync when a cell becomes empty or non-empty.
+  void UpdatePrintableSize(Position pos, bool was_empty, bool is_empty);
+  void ShrinkPrintableSize();
+  static int LastUsedIndex(const std::vector<int>& order, const std::vector<int>& values_count, int end);
+
 public:
+  Black::Cell* GetCellImpl(Position pos) const;
+
+  // Every edit which may change some cell value gets its own epoch. Cells
+  // remember the epoch of their latest change and compare it with the epochs of
+  // their inputs on read instead of eagerly invalidating all their dependents.
+  uint64_t GetEditEpoch() const;
+  uint64_t NextEditEpoch();
+
+  // Counters of the engine work done for this sheet, all zero unless built
+  // with BLACK_METRICS.
+  SheetStats GetStats() const;
+  SheetCounters& GetCounters() const;
+
+  // Records the spans of recalculations, parses and row/column edits until
+  // reset with nullptr. The tracer must outlive the sheet or the reset.
+  void SetTracer(Tracer* tracer);
+  Tracer* GetTracer() const;
+  // Measures every formula evaluation until reset with nullptr. The profiler
+  // must outlive the sheet or the reset.
+  void SetProfiler(Profiler* profiler);
+  Profiler* GetProfiler() const;
+  // Logical position of a cell of the sheet, nullopt for a cell not placed yet.
+  // Slow on the first call after a row/column edit.
+  std::optional<Position> FindPosition(const Black::Cell& cell) const;
+
+  // Bytes used by the sheet, walks all the cells.
+  MemoryBreakdown MemoryUsage() const;
+
+  // Preallocates the storage for a sheet of the given size, e.g. before a bulk
+  // import: the row and column maps now, the cells of every row within the
+  // size once the row gets its first cell.
+  void Reserve(Size size);
+
   ICell* GetCell(Position pos) override;
   const ICell* GetCell(Position pos) const override;
 
   void SetCell(Position pos, std::string text) override;
+  // Sets a formula built without parsing, e.g. restored from a snapshot. Unlike
+  // SetCell it doesn't check the formula for circular references.
+  void SetFormula(Position pos, std::unique_ptr<Black::Formula> formula);
+
+  // Whether some formula refers to a range containing the position.
+  bool HasRangeDependents(Position pos) const;
+  // Number of the formulas referring to the position, directly or through a
+  // range, each counted once.
+  size_t CountDependents(Position pos) const;
+
+  // Calls func(pos, cell) for every cell object within the range, including
+  // the empty cells kept for references. Takes time proportional to the part
+  // of the range inside the table.
+  template <typename Func>
+  void ForEachCellInRange(const CellRange& range, Func&& func) const;
+
+  // Calls func(pos, column, begin, end) for the parts of the range stored in
+  // consecutive physical rows [begin, end) of a NumericColumn, pos being the
+  // logical position of the first one, column by column and then row by row.
+  // Rows and columns without cells are skipped.
+  template <typename Func>
+  void ForEachColumnRun(const CellRange& range, Func&& func) const;
+
+  // Lookup index of a logical column with the given part built, nullptr for a
+  // column without cells.
+  const LookupIndex* GetLookupIndex(int col, LookupIndex::Kind kind) const;
+
+  // Calls func(pos, cell) for every non-empty cell, row by row.
+  template <typename Func>
+  void ForEachCell(Func&& func) const;
 
   void ClearCell(Position pos) override;
 
@@ -41,31 +192,171 @@ public:
 
   void PrintValues(std::ostream& output) const override;
   void PrintTexts(std::ostream& output) const override;
+
+  void PrintValues(std::ostream& output, const ExportOptions& options) const;
+  void PrintTexts(std::ostream& output, const ExportOptions& options) const;
 };
 
+template <typename Func>
+void Black::Sheet::ForEachCell(Func&& func) const {
+  std::vector<int> logical_cols(col_cells_.size(), kNoIndex);
+  for (int col = 0; col < int(cols_.size()); ++col) {
+    if (cols_[col] != kNoIndex) {
+      logical_cols[cols_[col]] = col;
+    }
+  }
+
+  std::vector<std::pair<int, const Black::Cell*>> row_cells;
+  for (int row = 0; row < int(rows_.size()); ++row) {
+    if (rows_[row] == kNoIndex) {
+      continue;
+    }
+    row_cells.clear();
+    const auto& cells = table_[rows_[row]];
+    for (size_t col = 0; col < cells.size(); ++col) {
+      if (cells[col] && !cells[col]->Empty()) {
+        row_cells.emplace_back(logical_cols[col], cells[col].get());
+      }
+    }
+    std::sort(std::begin(row_cells), std::end(row_cells));
+    for (const auto& [col, cell] : row_cells) {
+      func(Position{row, col}, *cell);
+    }
+  }
+}
+
+template <typename Func>
+void Black::Sheet::ForEachCellInRange(const CellRange& range, Func&& func) const {
+  const int last_row = std::min(range.last.row, int(rows_.size()) - 1);
+  const int last_col = std::min(range.last.col, int(cols_.size()) - 1);
+  for (int row = range.first.row; row <= last_row; ++row) {
+    const int physical_row = rows_[row];
+    if (physical_row == kNoIndex || !row_cells_[physical_row]) {
+      continue;
+    }
+    const auto& cells = table_[physical_row];
+    for (int col = range.first.col; col <= last_col; ++col) {
+      const int physical_col = cols_[col];
+      if (physical_col != kNoIndex && size_t(physical_col) < cells.size() && cells[physical_col]) {
+        func(Position{row, col}, cells[physical_col].get());
+      }
+    }
+  }
+}
+
+template <typename Func>
+void Black::Sheet::ForEachColumnRun(const CellRange& range, Func&& func) const {
+  const int last_row = std::min(range.last.row, int(rows_.size()) - 1);
+  const int last_col = std::min(range.last.col, int(cols_.size()) - 1);
+  // The logical rows of the range split where the physical rows are not
+  // consecutive, the same for all the columns.
+  std::vector<std::pair<int, int>> runs; // first logical row, number of rows
+  for (int row = range.first.row; row <= last_row;) {
+    if (rows_[row] == kNoIndex) {
+      ++row;
+      continue;
+    }
+    int end = row + 1;
+    while (end <= last_row && rows_[end] != kNoIndex && rows_[end] == rows_[end - 1] + 1) {
+      ++end;
+    }
+    runs.emplace_back(row, end - row);
+    row = end;
+  }
+  for (int col = range.first.col; col <= last_col; ++col) {
+    if (cols_[col] == kNoIndex) {
+      continue;
+    }
+    const auto& column = columns_[cols_[col]];
+    for (const auto& [row, count] : runs) {
+      const int begin = rows_[row];
+      const int end = std::min(begin + count, column.Size());
+      if (begin < end) {
+        func(Position{row, col}, column, begin, end);
+      }
+    }
+  }
+}
+
 template <typename PrintFunc>
 void Black::Sheet::PrintImpl(std::ostream& output, PrintFunc&& printer) const {
   const auto size = GetPrintableSize();
 
-  for (auto& row : Head(table_, size.rows)) {
-    int col_index = 0;
+  BufferedWriter writer(output);
+  PrintRows(writer, size, 0, size.rows, printer);
+}
 
-    for (auto& cell_holder : Head(row, size.cols)) {
-      if (cell_holder) {
-        printer(output, cell_holder);
-      }
+template <typename PrepareFunc, typename PrintFunc>
+void Black::Sheet::PrintBands(std::ostream& output, const ExportOptions& options,
+                              PrepareFunc&& prepare, PrintFunc&& printer) const {
+  const auto size = GetPrintableSize();
+  const int rows_per_band = std::max(options.rows_per_band, 1);
+  const int bands = (size.rows + rows_per_band - 1) / rows_per_band;
+  const unsigned threads = std::min<unsigned>(
+    options.threads ? options.threads : std::max(std::thread::hardware_concurrency(), 1u), bands
+  );
+  if (threads <= 1) {
+    BufferedWriter writer(output);
+    PrintRows(writer, size, 0, size.rows, printer);
+    return;
+  }
 
-      if (col_index + 1 != size.cols) {
-        output << '\t';
+  // Cells compute and cache their values lazily, which is not thread safe, so
+  // everything is prepared here and the workers only read the caches.
+  for (int row : Head(rows_, size.rows)) {
+    if (row == kNoIndex) {
+      continue;
+    }
+    for (const auto& cell : table_[row]) {
+      if (cell) {
+        prepare(cell.get());
       }
+    }
+  }
 
-      ++col_index;
+  std::vector<std::unique_ptr<BufferedWriter>> band_writers(bands);
+  std::atomic<int> next_band = 0;
+  auto worker = [&] {
+    for (int band = next_band++; band < bands; band = next_band++) {
+      band_writers[band] = std::make_unique<BufferedWriter>(output.precision());
+      const int first_row = band * rows_per_band;
+      PrintRows(*band_writers[band], size, first_row, std::min(first_row + rows_per_band, size.rows), printer);
     }
+  };
 
-    for (; col_index + 1 < size.cols; ++col_index) { // before \n \t is not printed
-      output << '\t';
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+
+  for (const auto& writer : band_writers) {
+    const auto data = writer->GetData();
+    output.write(data.data(), data.size());
+  }
+}
+
+template <typename PrintFunc>
+void Black::Sheet::PrintRows(BufferedWriter& writer, Size size, int first_row, int last_row,
+                             PrintFunc& printer) const {
+  for (int row = first_row; row < last_row; ++row) {
+    int printed_tabs = 0; // before \n \t is not printed
+    if (rows_[row] != kNoIndex) {
+      const auto& cells = table_[rows_[row]];
+      for (int col = 0; col < size.cols; ++col) {
+        const int physical_col = cols_[col];
+        if (physical_col != kNoIndex && size_t(physical_col) < cells.size() && cells[physical_col]) {
+          writer.Fill('\t', col - printed_tabs);
+          printed_tabs = col;
+          printer(writer, cells[physical_col].get());
+        }
+      }
     }
-    output << '\n';
+    writer.Fill('\t', size.cols - 1 - printed_tabs);
+    writer.Write('\n');
   }
 }
 } // namespace Black
\ No newline at end of file
@@ -0,0 +1,254 @@
+#include "black_snapshot.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Black {
+  namespace {
+    constexpr char kMagic[8] = {'B', 'L', 'K', 'S', 'H', 'E', 'E', 'T'};
+    constexpr uint32_t kVersion = 3;
+    constexpr uint32_t kByteOrderMark = 0x01020304;
+
+    struct SnapshotHeader {
+      char magic[8];
+      uint32_t version;
+      uint32_t byte_order;
+      uint64_t cell_count;
+      uint64_t token_count;
+      uint64_t pool_size;
+    };
+
+    // Text cells keep their text in the pool, formula cells keep their tokens.
+    struct CellRecord {
+      int32_t row;
+      int32_t col;
+      uint64_t text_offset;
+      uint32_t text_size;
+      uint32_t token_count;
+      uint64_t first_token;
+    };
+
+    struct TokenRecord {
+      uint32_t type;
+      uint32_t arg_count; // of a call, its text is the function name
+      int32_t row;
+      int32_t col;
+      int32_t last_row; // of a range
+      int32_t last_col;
+      uint32_t text_size;
+      uint32_t reserved; // keeps the record free of padding
+      uint64_t text_offset;
+      double value;
+    };
+
+    static_assert(std::is_trivially_copyable_v<SnapshotHeader>);
+    static_assert(std::is_trivially_copyable_v<CellRecord>);
+    static_assert(std::is_trivially_copyable_v<TokenRecord>);
+
+    template <typename T>
+    void Append(std::vector<char>& buffer, const T* data, size_t count) {
+      const auto* bytes = reinterpret_cast<const char*>(data);
+      buffer.insert(std::end(buffer), bytes, bytes + sizeof(T) * count);
+    }
+
+    // Read-only view of a whole file, memory mapped where it is supported.
+    class MappedFile {
+      const char* data_ = nullptr;
+      size_t size_ = 0;
+#ifdef _WIN32
+      std::vector<char> buffer_;
+#endif
+
+    public:
+      explicit MappedFile(const std::filesystem::path& path) {
+#ifdef _WIN32
+        std::ifstream input(path, std::ios::binary);
+        if (!input) {
+          throw std::runtime_error("cannot open " + path.string());
+        }
+        buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+          throw std::runtime_error("cannot open " + path.string());
+        }
+        struct stat file_stat{};
+        if (::fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+          size_ = file_stat.st_size;
+          void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+          data_ = data == MAP_FAILED ? nullptr : static_cast<const char*>(data);
+        }
+        ::close(fd);
+        if (!data_) {
+          size_ = 0;
+        }
+#endif
+      }
+
+      ~MappedFile() {
+#ifndef _WIN32
+        if (data_) {
+          ::munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+      }
+
+      MappedFile(const MappedFile&) = delete;
+      MappedFile& operator=(const MappedFile&) = delete;
+
+      std::string_view GetData() const {
+        return {data_, size_};
+      }
+    };
+
+    // Bounds checked access to the sections of a loaded snapshot.
+    class SnapshotReader {
+      std::string_view data_;
+
+    public:
+      explicit SnapshotReader(std::string_view data) : data_(data) {}
+
+      template <typename T>
+      const T* GetArray(uint64_t offset, uint64_t count) const {
+        if (offset > data_.size() || count > (data_.size() - offset) / sizeof(T)) {
+          throw std::runtime_error("truncated snapshot");
+        }
+        return reinterpret_cast<const T*>(data_.data() + offset);
+      }
+
+      std::string_view GetText(uint64_t pool_offset, uint64_t offset, uint64_t size) const {
+        const char* pool = GetArray<char>(pool_offset, 0);
+        const auto pool_size = data_.size() - pool_offset;
+        if (offset > pool_size || size > pool_size - offset) {
+          throw std::runtime_error("truncated snapshot");
+        }
+        return {pool + offset, size_t(size)};
+      }
+    };
+  }
+
+  std::vector<char> SerializeSnapshot(const Sheet& sheet) {
+    std::vector<CellRecord> cells;
+    std::vector<TokenRecord> tokens;
+    std::vector<char> pool;
+    auto add_text = [&] (std::string_view text) {
+      const uint64_t offset = pool.size();
+      pool.insert(std::end(pool), std::begin(text), std::end(text));
+      return offset;
+    };
+
+    sheet.ForEachCell([&] (Position pos, const Black::Cell& cell) {
+      CellRecord record{pos.row, pos.col, 0, 0, 0, tokens.size()};
+      if (const auto* formula = cell.GetFormula()) {
+        for (const auto& token : formula->GetTokens()) {
+          tokens.push_back({
+            uint32_t(token.type), token.arg_count, token.position.row, token.position.col,
+            token.last.row, token.last.col, uint32_t(token.text.size()), 0, add_text(token.text), token.value
+          });
+        }
+        record.token_count = tokens.size() - record.first_token;
+      } else {
+        const auto text = cell.GetText();
+        record.text_offset = add_text(text);
+        record.text_size = text.size();
+      }
+      cells.push_back(record);
+    });
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.byte_order = kByteOrderMark;
+    header.cell_count = cells.size();
+    header.token_count = tokens.size();
+    header.pool_size = pool.size();
+
+    std::vector<char> buffer;
+    buffer.reserve(sizeof(header) + sizeof(CellRecord) * cells.size()
+                   + sizeof(TokenRecord) * tokens.size() + pool.size());
+    Append(buffer, &header, 1);
+    Append(buffer, cells.data(), cells.size());
+    Append(buffer, tokens.data(), tokens.size());
+    Append(buffer, pool.data(), pool.size());
+    return buffer;
+  }
+
+  void SaveSnapshot(const Sheet& sheet, const std::filesystem::path& path) {
+    const auto buffer = SerializeSnapshot(sheet);
+    // The image replaces the old one only once it is completely written, so a
+    // failed or interrupted save keeps the last good snapshot.
+    auto temp_path = path;
+    temp_path += ".tmp";
+    std::ofstream output(temp_path, std::ios::binary | std::ios::trunc);
+    output.write(buffer.data(), buffer.size());
+    output.close();
+    if (!output) {
+      std::error_code ignored;
+      std::filesystem::remove(temp_path, ignored);
+      throw std::runtime_error("cannot write " + path.string());
+    }
+    std::filesystem::rename(temp_path, path);
+  }
+
+  void LoadSnapshot(const std::filesystem::path& path, Sheet& sheet) {
+    const MappedFile file(path);
+    const SnapshotReader reader(file.GetData());
+
+    const auto& header = *reader.GetArray<SnapshotHeader>(0, 1);
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) || header.byte_order != kByteOrderMark) {
+      throw std::runtime_error(path.string() + " is not a sheet snapshot");
+    }
+    if (header.version != kVersion) {
+      throw std::runtime_error("unsupported snapshot version " + std::to_string(header.version));
+    }
+
+    const uint64_t cells_offset = sizeof(SnapshotHeader);
+    const uint64_t tokens_offset = cells_offset + sizeof(CellRecord) * header.cell_count;
+    const uint64_t pool_offset = tokens_offset + sizeof(TokenRecord) * header.token_count;
+    const auto* cells = reader.GetArray<CellRecord>(cells_offset, header.cell_count);
+    const auto* token_records = reader.GetArray<TokenRecord>(tokens_offset, header.token_count);
+    reader.GetArray<char>(pool_offset, header.pool_size);
+
+    std::vector<FormulaAst::Token> tokens;
+    for (const auto& cell : Range(cells, cells + header.cell_count)) {
+      const Position pos{cell.row, cell.col};
+      if (!cell.token_count) {
+        sheet.SetCell(pos, std::string(reader.GetText(pool_offset, cell.text_offset, cell.text_size)));
+        continue;
+      }
+
+      if (cell.first_token > header.token_count || cell.token_count > header.token_count - cell.first_token) {
+        throw std::runtime_error("truncated snapshot");
+      }
+      tokens.clear();
+      const auto* first = token_records + cell.first_token;
+      for (const auto& token : Range(first, first + cell.token_count)) {
+        if (token.type > uint32_t(FormulaAst::Node::Type::GreaterOrEqual)) {
+          throw std::runtime_error("unknown formula token in snapshot");
+        }
+        tokens.push_back({
+          FormulaAst::Node::Type(token.type), {token.row, token.col}, token.value,
+          reader.GetText(pool_offset, token.text_offset, token.text_size), {token.last_row, token.last_col},
+          token.arg_count
+        });
+      }
+      sheet.SetFormula(pos, BuildFormula(tokens.data(), tokens.data() + tokens.size()));
+    }
+  }
+} // namespace Black
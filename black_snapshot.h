@@ -0,0 +1,19 @@
+#pragma once
+#include "black_sheet.h"
+
+#include <filesystem>
+#include <vector>
+
+namespace Black {
+  // Binary image of a sheet: cell records, formula bodies in postfix order and
+  // a pool with all the texts. It is written with a single write and loaded
+  // from a memory mapped file without parsing the formulas. Snapshots keep the
+  // native byte order and are only meant to be loaded on the same platform.
+  // The image is written next to the path and renamed over it when complete.
+  void SaveSnapshot(const Sheet& sheet, const std::filesystem::path& path);
+  // The image SaveSnapshot writes, for callers doing the writing themselves.
+  std::vector<char> SerializeSnapshot(const Sheet& sheet);
+  // Loads a snapshot into an empty sheet. Throws std::runtime_error if the file
+  // is not a snapshot of the supported version.
+  void LoadSnapshot(const std::filesystem::path& path, Sheet& sheet);
+} // namespace Black
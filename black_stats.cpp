@@ -0,0 +1,87 @@
+#include "black_stats.h"
+#include "black_sheet.h"
+
+#include <fstream>
+
+namespace Black {
+  namespace {
+    struct CounterInfo {
+      std::string_view name;
+      std::string_view help;
+      double scale;
+    };
+
+    constexpr std::array<CounterInfo, kCounterCount> kCounterInfo = {{
+      {"spreadsheet_formula_evaluations_total", "Formula evaluations.", 1},
+      {"spreadsheet_cache_hits_total", "Cell values returned from the cache.", 1},
+      {"spreadsheet_cache_misses_total", "Cell values computed on read.", 1},
+      {"spreadsheet_invalidations_total", "Cell cache invalidations.", 1},
+      {"spreadsheet_validation_visits_total", "Cells visited to validate cached values.", 1},
+      {"spreadsheet_cycle_check_visits_total", "Cells visited by circular reference checks.", 1},
+      {"spreadsheet_parses_total", "Formulas parsed.", 1},
+      {"spreadsheet_parse_seconds_total", "Time spent parsing formulas.", 1e-9},
+      {"spreadsheet_structural_cells_touched_total", "Cells updated or removed by row/column edits.", 1},
+      {"spreadsheet_range_cache_builds_total", "Range scans building the cached contents of a range.", 1},
+      {"spreadsheet_range_cache_updates_total", "Cell edits applied to cached range contents.", 1},
+      {"spreadsheet_lookup_index_builds_total", "Column scans building a lookup index.", 1},
+    }};
+  }
+
+  SheetStats SheetCounters::Snapshot() const {
+    SheetStats stats;
+    for (size_t i = 0; i < kCounterCount; ++i) {
+      stats[Counter(i)] = values_[i].load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+
+  void WritePrometheus(std::ostream& output, const SheetStats& stats) {
+    for (size_t i = 0; i < kCounterCount; ++i) {
+      const auto& info = kCounterInfo[i];
+      output << "# HELP " << info.name << ' ' << info.help << '\n'
+             << "# TYPE " << info.name << " counter\n"
+             << info.name << ' ';
+      if (info.scale == 1) {
+        output << stats[Counter(i)] << '\n';
+      } else {
+        output << stats[Counter(i)] * info.scale << '\n';
+      }
+    }
+  }
+
+  PrometheusDumper::PrometheusDumper(const Sheet& sheet, std::filesystem::path path,
+                                     std::chrono::milliseconds interval)
+    : sheet_(sheet)
+    , path_(std::move(path))
+    , interval_(interval)
+    , thread_([this] {
+        std::unique_lock lock(mutex_);
+        while (!stop_requested_.wait_for(lock, interval_, [this] { return stop_; })) {
+          Dump();
+        }
+      })
+  {
+  }
+
+  PrometheusDumper::~PrometheusDumper() {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    stop_requested_.notify_one();
+    thread_.join();
+    Dump();
+  }
+
+  void PrometheusDumper::Dump() {
+    // Readers never see a partially written file.
+    auto temp_path = path_;
+    temp_path += ".tmp";
+    {
+      std::ofstream output(temp_path, std::ios::trunc);
+      WritePrometheus(output, sheet_.GetStats());
+    }
+    std::error_code error;
+    std::filesystem::rename(temp_path, path_, error);
+  }
+} // namespace Black
@@ -0,0 +1,110 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+#include <thread>
+
+// Engine counters are only collected when built with BLACK_METRICS
+// (cmake -DSPREADSHEET_METRICS=ON), otherwise counting compiles to nothing.
+#ifdef BLACK_METRICS
+#define BLACK_COUNT(counters, counter, n) (counters).Add(counter, n)
+#else
+#define BLACK_COUNT(counters, counter, n) ((void)0)
+#endif
+
+namespace Black {
+class Sheet;
+
+enum class Counter {
+  FormulaEvaluations,
+  CacheHits,
+  CacheMisses,
+  Invalidations,
+  ValidationVisits,       // cells visited while checking cached values are up to date
+  CycleCheckVisits,
+  Parses,
+  ParseNanoseconds,
+  StructuralCellsTouched, // formulas rewritten and cells removed by row/column edits
+  RangeCacheBuilds,       // scans of a range to build its cached contents
+  RangeCacheUpdates,      // cell edits applied to the cached contents of a range
+  LookupIndexBuilds,      // scans of a column to build a part of its lookup index
+  kCount
+};
+
+inline constexpr size_t kCounterCount = static_cast<size_t>(Counter::kCount);
+
+// Point in time copy of the counters of a sheet.
+class SheetStats {
+  std::array<uint64_t, kCounterCount> values_{};
+
+public:
+  uint64_t operator[](Counter counter) const {
+    return values_[static_cast<size_t>(counter)];
+  }
+  uint64_t& operator[](Counter counter) {
+    return values_[static_cast<size_t>(counter)];
+  }
+};
+
+// Counters are relaxed atomics: the parallel export reads cached values of a
+// sheet from several threads.
+class SheetCounters {
+  std::array<std::atomic<uint64_t>, kCounterCount> values_{};
+
+public:
+  void Add(Counter counter, uint64_t n) {
+    values_[static_cast<size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+  }
+  SheetStats Snapshot() const;
+};
+
+// Measures the lifetime of the object into a nanoseconds counter.
+class ScopedTimer {
+#ifdef BLACK_METRICS
+  SheetCounters& counters_;
+  Counter counter_;
+  std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+
+public:
+  ScopedTimer(SheetCounters& counters, Counter counter) : counters_(counters), counter_(counter) {}
+  ~ScopedTimer() {
+    counters_.Add(counter_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start_).count());
+  }
+#else
+public:
+  ScopedTimer(SheetCounters&, Counter) {}
+#endif
+};
+
+// Prometheus text exposition format.
+void WritePrometheus(std::ostream& output, const SheetStats& stats);
+
+// Rewrites a file with the counters of the sheet in Prometheus text format
+// every `interval` from a background thread, e.g. for a node exporter
+// textfile collector. The sheet must outlive the dumper.
+class PrometheusDumper {
+  const Sheet& sheet_;
+  std::filesystem::path path_;
+  std::chrono::milliseconds interval_;
+  std::mutex mutex_;
+  std::condition_variable stop_requested_;
+  bool stop_ = false;
+  std::thread thread_;
+
+  void Dump();
+
+public:
+  PrometheusDumper(const Sheet& sheet, std::filesystem::path path, std::chrono::milliseconds interval);
+  ~PrometheusDumper();
+
+  PrometheusDumper(const PrometheusDumper&) = delete;
+  PrometheusDumper& operator=(const PrometheusDumper&) = delete;
+};
+} // namespace Black
@@ -0,0 +1,86 @@
+#include "black_trace.h"
+
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+
+namespace Black {
+  Tracer::Tracer()
+    : origin_(Clock::now())
+  {
+  }
+
+  int Tracer::ThreadIndex() {
+    return threads_.try_emplace(std::this_thread::get_id(), threads_.size() + 1).first->second;
+  }
+
+  void Tracer::AddSpan(const char* name, std::optional<Position> cell, Clock::time_point start,
+                       Clock::time_point end, TraceArg first, TraceArg second) {
+    std::lock_guard lock(mutex_);
+    events_.push_back(Event{name, 'X', cell, start - origin_, end - start, ThreadIndex(), {first, second}});
+  }
+
+  void Tracer::AddInstant(const char* name, std::optional<Position> cell) {
+    const auto now = Clock::now();
+    std::lock_guard lock(mutex_);
+    events_.push_back(Event{name, 'i', cell, now - origin_, {}, ThreadIndex(), {}});
+  }
+
+  size_t Tracer::GetEventCount() const {
+    std::lock_guard lock(mutex_);
+    return events_.size();
+  }
+
+  void Tracer::Clear() {
+    std::lock_guard lock(mutex_);
+    events_.clear();
+  }
+
+  void Tracer::Write(std::ostream& output) const {
+    auto microseconds = [] (Clock::duration duration) {
+      return std::chrono::duration<double, std::micro>(duration).count();
+    };
+
+    std::lock_guard lock(mutex_);
+    const auto flags = output.flags();
+    const auto precision = output.precision();
+    output << std::fixed << std::setprecision(3) << "{\"traceEvents\": [";
+    for (size_t i = 0; i < events_.size(); ++i) {
+      const auto& event = events_[i];
+      output << (i ? ",\n" : "\n") << "{\"name\": \"" << event.name;
+      if (event.cell) {
+        output << ' ' << event.cell->ToString();
+      }
+      output << "\", \"ph\": \"" << event.phase << "\", \"ts\": " << microseconds(event.start);
+      if (event.phase == 'X') {
+        output << ", \"dur\": " << microseconds(event.duration);
+      } else {
+        output << ", \"s\": \"t\"";
+      }
+      output << ", \"pid\": 1, \"tid\": " << event.thread << ", \"args\": {";
+      const char* separator = "";
+      if (event.cell) {
+        output << "\"cell\": \"" << event.cell->ToString() << '"';
+        separator = ", ";
+      }
+      for (const auto& arg : event.args) {
+        if (arg.name) {
+          output << separator << '"' << arg.name << "\": " << arg.value;
+          separator = ", ";
+        }
+      }
+      output << "}}";
+    }
+    output << "\n], \"displayTimeUnit\": \"ns\"}\n";
+    output.flags(flags);
+    output.precision(precision);
+  }
+
+  void Tracer::Save(const std::filesystem::path& path) const {
+    std::ofstream output(path, std::ios::trunc);
+    if (!output) {
+      throw std::runtime_error("cannot open " + path.string());
+    }
+    Write(output);
+  }
+} // namespace Black
@@ -0,0 +1,101 @@
+#pragma once
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Black {
+struct TraceArg {
+  const char* name = nullptr; // nullptr if unused
+  int value = 0;
+};
+
+// Collects spans of the engine work and writes them in the Chrome trace event
+// format (chrome://tracing, ui.perfetto.dev). A sheet only calls the tracer
+// set by Sheet::SetTracer(), so without one tracing costs a branch per span.
+class Tracer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Event {
+    const char* name;
+    char phase; // 'X' - complete event, 'i' - instant event
+    std::optional<Position> cell;
+    Clock::duration start;
+    Clock::duration duration;
+    int thread;
+    TraceArg args[2];
+  };
+
+  Tracer();
+
+  void AddSpan(const char* name, std::optional<Position> cell, Clock::time_point start,
+               Clock::time_point end, TraceArg first = {}, TraceArg second = {});
+  void AddInstant(const char* name, std::optional<Position> cell);
+
+  size_t GetEventCount() const;
+  void Clear();
+
+  void Write(std::ostream& output) const;
+  void Save(const std::filesystem::path& path) const;
+
+private:
+  Clock::time_point origin_;
+  mutable std::mutex mutex_;
+  std::vector<Event> events_;
+  std::unordered_map<std::thread::id, int> threads_;
+
+  int ThreadIndex();
+};
+
+// Adds a complete event for its scope to the tracer if there is one.
+class TraceSpan {
+  Tracer* tracer_;
+  const char* name_;
+  Tracer::Clock::time_point start_;
+  std::optional<Position> cell_;
+  TraceArg args_[2];
+
+public:
+  TraceSpan(Tracer* tracer, const char* name, TraceArg first = {}, TraceArg second = {})
+    : tracer_(tracer)
+    , name_(name)
+    , args_{first, second}
+  {
+    if (tracer_) {
+      start_ = Tracer::Clock::now();
+    }
+  }
+
+  ~TraceSpan() {
+    if (tracer_) {
+      tracer_->AddSpan(name_, cell_, start_, Tracer::Clock::now(), args_[0], args_[1]);
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  // Tracing is enabled, e.g. to compute the arguments only when needed.
+  explicit operator bool() const {
+    return tracer_;
+  }
+
+  void SetCell(std::optional<Position> cell) {
+    cell_ = cell;
+  }
+
+  // Drops the span, e.g. when it turned out to be a trivial one.
+  void Cancel() {
+    tracer_ = nullptr;
+  }
+};
+} // namespace Black
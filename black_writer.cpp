@@ -0,0 +1,82 @@
+#include "black_writer.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+namespace Black {
+  BufferedWriter::BufferedWriter(std::ostream& output)
+    : output_(&output)
+    , buffer_(kBufferSize)
+    , precision_(output.precision())
+  {
+  }
+
+  BufferedWriter::BufferedWriter(int precision)
+    : buffer_(kBufferSize)
+    , precision_(precision)
+  {
+  }
+
+  BufferedWriter::~BufferedWriter() {
+    Flush();
+  }
+
+  char* BufferedWriter::Reserve(size_t count) {
+    if (buffer_.size() - size_ < count) {
+      Flush();
+    }
+    if (buffer_.size() - size_ < count) {
+      buffer_.resize(std::max(buffer_.size() * 2, size_ + count));
+    }
+    return buffer_.data() + size_;
+  }
+
+  void BufferedWriter::Write(char c) {
+    *Reserve(1) = c;
+    ++size_;
+  }
+
+  void BufferedWriter::Write(std::string_view str) {
+    if (output_ && str.size() > kBufferSize) {
+      Flush();
+      output_->write(str.data(), str.size());
+      return;
+    }
+    std::memcpy(Reserve(str.size()), str.data(), str.size());
+    size_ += str.size();
+  }
+
+  void BufferedWriter::Write(double value) {
+    const size_t max_length = kMaxNumberLength + precision_;
+    char* first = Reserve(max_length);
+    const auto [last, ec] = std::to_chars(
+      first, first + max_length, value, std::chars_format::general, precision_ ? precision_ : 1
+    );
+    size_ += last - first;
+  }
+
+  void BufferedWriter::Write(FormulaError error) {
+    Write(error.ToString());
+  }
+
+  void BufferedWriter::Fill(char c, size_t count) {
+    while (count) {
+      const size_t chunk = std::min(count, kBufferSize);
+      std::fill_n(Reserve(chunk), chunk, c);
+      size_ += chunk;
+      count -= chunk;
+    }
+  }
+
+  void BufferedWriter::Flush() {
+    if (output_ && size_) {
+      output_->write(buffer_.data(), size_);
+      size_ = 0;
+    }
+  }
+
+  std::string_view BufferedWriter::GetData() const {
+    return {buffer_.data(), size_};
+  }
+} // namespace Black
@@ -0,0 +1,42 @@
+#pragma once
+#include "common.h"
+
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+namespace Black {
+// Accumulates output in a large buffer and hands it to the stream in big
+// chunks. Numbers are formatted by std::to_chars, the same way an ostream with
+// default flags and the given precision prints them (%g).
+// Without a stream the writer keeps the whole output in memory, see GetData().
+class BufferedWriter {
+  std::ostream* output_ = nullptr;
+  std::vector<char> buffer_;
+  size_t size_ = 0;
+  int precision_;
+
+  static constexpr size_t kBufferSize = 1 << 16;
+  static constexpr size_t kMaxNumberLength = 64;
+
+  char* Reserve(size_t count);
+
+public:
+  explicit BufferedWriter(std::ostream& output);
+  explicit BufferedWriter(int precision);
+  ~BufferedWriter();
+
+  BufferedWriter(const BufferedWriter&) = delete;
+  BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+  void Write(char c);
+  void Write(std::string_view str);
+  void Write(double value);
+  void Write(FormulaError error);
+  void Fill(char c, size_t count);
+
+  void Flush();
+
+  std::string_view GetData() const;
+};
+} // namespace Black
@@ -39,6 +39,7 @@ public:
     Ref,  // ссылка на несуществующую ячейку (например, она была удалена)
     Value,  // ячейка не может быть трактована как число
     Div0,  // в результате вычисления возникло деление на ноль
+    NA,  // искомое значение не найдено (например, в MATCH или VLOOKUP)
   };
 
   FormulaError(Category category);
@@ -1,6 +1,18 @@
 #include "common.h"
 #include "formula.h"
 #include "test_runner.h"
+#include "black_sheet.h"
+#include "black_import.h"
+#include "black_snapshot.h"
+#include "black_journal.h"
+#include "black_kernels.h"
+#include "black_functions.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <limits>
 
 std::ostream& operator<<(std::ostream& output, Position pos) {
   return output << "(" << pos.row << ", " << pos.col << ")";
@@ -565,6 +577,1152 @@ namespace {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
   }
+
+  void TestCellValueUpdatedThroughChain() {
+    auto sheet = CreateSheet();
+    constexpr int kChainLength = 100;
+    sheet->SetCell("A1"_pos, "1");
+    for (int row = 1; row < kChainLength; ++row) {
+      sheet->SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    const Position last{kChainLength - 1, 0};
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), ICell::Value(double(kChainLength)));
+
+    sheet->SetCell("A1"_pos, "10");
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), ICell::Value(double(kChainLength + 9)));
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), ICell::Value(11.0));
+
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), ICell::Value(double(kChainLength - 1)));
+
+    sheet->SetCell("A50"_pos, "=1/0");
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(),
+                 ICell::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet->GetCell("A49"_pos)->GetValue(), ICell::Value(48.0));
+  }
+
+  void TestCellValueThroughDeepChain() {
+    // As long as the sheet, validation must not recurse per cell.
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    for (int row = 1; row < Position::kMaxRows; ++row) {
+      sheet->SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    const Position last{Position::kMaxRows - 1, 0};
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), ICell::Value(double(Position::kMaxRows)));
+
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), ICell::Value(double(Position::kMaxRows + 1)));
+  }
+
+  void TestCellValueUpdatedThroughHub() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    for (int col = 1; col < 50; ++col) {
+      sheet->SetCell(Position{0, col}, "=A1*" + std::to_string(col));
+      sheet->SetCell(Position{1, col}, "=" + Position{0, col}.ToString() + "+A1");
+    }
+    ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetValue(), ICell::Value(6.0));
+
+    sheet->SetCell("A1"_pos, "3");
+    for (int col = 1; col < 50; ++col) {
+      ASSERT_EQUAL(sheet->GetCell(Position{1, col})->GetValue(), ICell::Value(3.0 * col + 3));
+    }
+
+    sheet->DeleteCols(2);
+    ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetValue(), ICell::Value(12.0));
+    sheet->SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetValue(), ICell::Value(4.0));
+  }
+
+  void TestStructuralEditsOfDependents() {
+    const ICell::Value ref_error = FormulaError(FormulaError::Category::Ref);
+    {
+      Black::Sheet sheet;
+      for (int row = 0; row < 5; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row + 1));
+      }
+      // Formulas above the band only read rows above it.
+      for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row % 2, 2 + row}, "=A" + std::to_string(row % 2 + 1) + "+1");
+      }
+      sheet.SetCell("B6"_pos, "=A2");
+      sheet.SetCell("B7"_pos, "=A5*2");
+      sheet.SetCell("B8"_pos, "=SUM(A1:A5)");
+
+      [[maybe_unused]] const auto before = sheet.GetStats();
+      sheet.DeleteRows(1, 2);
+#ifdef BLACK_METRICS
+      ASSERT(sheet.GetStats()[Black::Counter::StructuralCellsTouched]
+             - before[Black::Counter::StructuralCellsTouched] < 100);
+#endif
+      ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1+1");
+      ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(2.0));
+      ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetText(), "=#REF!");
+      ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), ref_error);
+      ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=A3*2");
+      ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), ICell::Value(10.0));
+      ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetText(), "=SUM(A1:A3)");
+      ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), ICell::Value(10.0));
+
+      sheet.InsertRows(1, 2);
+      ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1+1");
+      ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetText(), "=A5*2");
+      ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetValue(), ICell::Value(10.0));
+      ASSERT_EQUAL(sheet.GetCell("B8"_pos)->GetText(), "=SUM(A1:A5)");
+      sheet.SetCell("A2"_pos, "100");
+      ASSERT_EQUAL(sheet.GetCell("B8"_pos)->GetValue(), ICell::Value(110.0));
+    }
+    {
+      Black::Sheet sheet;
+      for (int col = 0; col < 5; ++col) {
+        sheet.SetCell({0, col}, std::to_string(col + 1));
+      }
+      sheet.SetCell("A2"_pos, "=A1+1");
+      sheet.SetCell("F2"_pos, "=B1");
+      sheet.SetCell("G2"_pos, "=E1*2");
+      sheet.SetCell("H2"_pos, "=SUM(A1:E1)");
+
+      sheet.DeleteCols(1, 2);
+      ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=A1+1");
+      ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), ICell::Value(2.0));
+      ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "=#REF!");
+      ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), ref_error);
+      ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetText(), "=C1*2");
+      ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetValue(), ICell::Value(10.0));
+      ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetText(), "=SUM(A1:C1)");
+      ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetValue(), ICell::Value(10.0));
+
+      sheet.InsertCols(1, 2);
+      ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=A1+1");
+      ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetText(), "=E1*2");
+      ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetValue(), ICell::Value(10.0));
+      ASSERT_EQUAL(sheet.GetCell("H2"_pos)->GetText(), "=SUM(A1:E1)");
+    }
+  }
+
+  void TestStorageReusesFreedRowsAndCols() {
+    auto sheet = CreateSheet();
+    auto texts_and_values = [&] {
+      std::ostringstream texts, values;
+      sheet->PrintTexts(texts);
+      sheet->PrintValues(values);
+      return texts.str() + "|" + values.str();
+    };
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B1"_pos, "2");
+    sheet->SetCell("C1"_pos, "3");
+    sheet->SetCell("A2"_pos, "10");
+    sheet->SetCell("B2"_pos, "20");
+    sheet->SetCell("C2"_pos, "30");
+    sheet->SetCell("A3"_pos, "=SUM(A1:C2)");
+    sheet->SetCell("B3"_pos, "=A1+C2");
+    sheet->SetCell("C3"_pos, "text");
+
+    // Frees a physical row and a physical column.
+    sheet->DeleteRows(1);
+    sheet->DeleteCols(1);
+    ASSERT_EQUAL(texts_and_values(), "1\t3\n=SUM(A1:B1)\ttext\n|1\t3\n4\ttext\n");
+
+    // The inserted rows and columns take the freed ones, which must come back empty.
+    sheet->InsertRows(0, 2);
+    sheet->InsertCols(0);
+    for (const auto pos : {"A1"_pos, "B1"_pos, "C1"_pos, "A2"_pos, "B2"_pos, "C2"_pos, "A3"_pos, "A4"_pos}) {
+      ASSERT(!sheet->GetCell(pos) || sheet->GetCell(pos)->GetText().empty());
+    }
+    ASSERT_EQUAL(texts_and_values(), "\t\t\n\t\t\n\t1\t3\n\t=SUM(B3:C3)\ttext\n|\t\t\n\t\t\n\t1\t3\n\t4\ttext\n");
+
+    sheet->SetCell("B1"_pos, "7");
+    sheet->SetCell("A2"_pos, "=SUM(B1:C3)");
+    sheet->SetCell("C2"_pos, "=B3*2");
+    ASSERT_EQUAL(texts_and_values(),
+                 "\t7\t\n=SUM(B1:C3)\t\t=B3*2\n\t1\t3\n\t=SUM(B3:C3)\ttext\n"
+                 "|\t7\t\n13\t\t2\n\t1\t3\n\t4\ttext\n");
+
+    // Once more, now freeing rows and columns which were reused.
+    sheet->DeleteRows(0);
+    sheet->DeleteCols(0);
+    sheet->InsertRows(0);
+    sheet->InsertCols(1);
+    sheet->SetCell("B1"_pos, "5");
+    ASSERT_EQUAL(texts_and_values(),
+                 "\t5\t\n\t\t=A3*2\n1\t\t3\n=SUM(A3:C3)\t\ttext\n"
+                 "|\t5\t\n\t\t2\n1\t\t3\n4\t\ttext\n");
+  }
+
+  void TestCellValueAfterStructuralChanges() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("B2"_pos, "=A1+C3");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), ICell::Value(0.0));
+
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("C3"_pos, "=A1*2");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), ICell::Value(3.0));
+
+    sheet->InsertRows(0, 2);
+    sheet->InsertCols(1);
+    ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetText(), "=A3+D5");
+    sheet->SetCell("A3"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetValue(), ICell::Value(15.0));
+
+    sheet->SetCell("D5"_pos, "text");
+    ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetValue(),
+                 ICell::Value(FormulaError::Category::Value));
+
+    sheet->DeleteRows(4);
+    ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetText(), "=A3+#REF!");
+    ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetValue(),
+                 ICell::Value(FormulaError::Category::Ref));
+    sheet->SetCell("C4"_pos, "=A3");
+    sheet->SetCell("A3"_pos, "7");
+    ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetValue(), ICell::Value(7.0));
+  }
+
+  void TestDeletedFormulaReleasesReferences() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=C5+B2");
+    sheet->SetCell("B2"_pos, "=C5");
+    sheet->InsertRows(0);
+    sheet->DeleteRows(0, 2);
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=C4");
+    ASSERT(sheet->GetCell("C4"_pos) != nullptr);
+
+    sheet->DeleteCols(1);
+    ASSERT(sheet->GetCell("B4"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+  }
+
+  void TestPrintableSizeAfterEdits() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=D4");
+    sheet->SetCell("C2"_pos, "text");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 3}));
+
+    sheet->InsertRows(1, 2);
+    sheet->InsertCols(0);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{4, 4}));
+
+    sheet->SetCell("D4"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 2}));
+
+    sheet->SetCell("E6"_pos, "1");
+    sheet->DeleteRows(0, 3);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 5}));
+
+    sheet->ClearCell("E3"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+  }
+
+  void TestPrintValuesNumberFormat() {
+    auto sheet = CreateSheet();
+    const std::vector<std::string> formulas = {
+      "=1/3", "=0.1+0.2", "=-2.5", "=123456789", "=1234567", "=0.0001", "=0.00001", "=1e20/3", "=0-0"
+    };
+    std::ostringstream expected;
+    for (size_t i = 0; i < formulas.size(); ++i) {
+      sheet->SetCell({int(i), 3}, formulas[i]);
+      expected << "\t\t\t" << std::get<double>(sheet->GetCell({int(i), 3})->GetValue()) << '\n';
+    }
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), expected.str());
+  }
+
+  void TestParallelExport() {
+    Black::Sheet sheet;
+    for (int row = 0; row < 100; row += 3) {
+      for (int col = row % 7; col < 10; col += 2) {
+        const auto text = (row + col) % 4 ? std::to_string(row * col / 7.0) : "=K1+" + std::to_string(row);
+        sheet.SetCell({row, col}, text);
+      }
+    }
+    sheet.SetCell({100, 0}, "=1/0");
+
+    std::ostringstream values, texts;
+    sheet.PrintValues(values);
+    sheet.PrintTexts(texts);
+    for (unsigned threads : {1u, 3u, 8u}) {
+      std::ostringstream parallel_values, parallel_texts;
+      sheet.PrintValues(parallel_values, {threads, 7});
+      sheet.PrintTexts(parallel_texts, {threads, 7});
+      ASSERT_EQUAL(parallel_values.str(), values.str());
+      ASSERT_EQUAL(parallel_texts.str(), texts.str());
+    }
+  }
+
+  void TestImportTsv() {
+    std::istringstream input("1\t\t=A1+C2\r\n\n'=text\t\t2\t\n\t=A3");
+    Black::Sheet sheet;
+    Black::ImportTsv(input, sheet);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{4, 3}));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1+C2");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), ICell::Value(std::string("=text")));
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), ICell::Value(std::string("2")));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), ICell::Value(FormulaError::Category::Value));
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    std::istringstream printed(texts.str());
+    Black::Sheet imported;
+    Black::ImportTsv(printed, imported);
+    std::ostringstream imported_texts;
+    imported.PrintTexts(imported_texts);
+    ASSERT_EQUAL(imported_texts.str(), texts.str());
+  }
+
+  void TestSnapshotRoundTrip() {
+    Black::Sheet sheet;
+    sheet.SetCell("A1"_pos, "=(B2+1.50)*-C3/A4");
+    sheet.SetCell("B2"_pos, "'=text");
+    sheet.SetCell("C3"_pos, "2");
+    sheet.SetCell("E1"_pos, "=A1-D5");
+    sheet.SetCell("D5"_pos, "=C3");
+    sheet.SetCell("B3"_pos, "=E1+Z9");
+    sheet.SetCell("B4"_pos, "=IF(C3<>2,1/0,D5<=C3)");
+    sheet.DeleteCols(25);
+
+    const auto path = std::filesystem::temp_directory_path() / "black_snapshot_test.bin";
+    Black::SaveSnapshot(Black::Sheet{}, path);
+    Black::SaveSnapshot(sheet, path);
+    ASSERT(!std::filesystem::exists(path.string() + ".tmp"));
+    bool save_failed = false;
+    try {
+      Black::SaveSnapshot(Black::Sheet{}, path / "missing" / "snapshot.bin");
+    } catch (const std::runtime_error&) {
+      save_failed = true;
+    }
+    ASSERT(save_failed);
+    Black::Sheet loaded;
+    Black::LoadSnapshot(path, loaded);
+    std::filesystem::remove(path);
+
+    std::ostringstream texts, loaded_texts, values, loaded_values;
+    sheet.PrintTexts(texts);
+    loaded.PrintTexts(loaded_texts);
+    ASSERT_EQUAL(loaded_texts.str(), texts.str());
+    sheet.PrintValues(values);
+    loaded.PrintValues(loaded_values);
+    ASSERT_EQUAL(loaded_values.str(), values.str());
+
+    loaded.SetCell("C3"_pos, "4");
+    ASSERT_EQUAL(loaded.GetCell("D5"_pos)->GetValue(), ICell::Value(4.0));
+    bool caught = false;
+    try {
+      loaded.SetCell("C3"_pos, "=B3");
+    } catch (const CircularDependencyException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+  }
+
+  void TestJournalRecovery() {
+    const auto dir = std::filesystem::temp_directory_path() / "black_journal_test";
+    std::filesystem::remove_all(dir);
+    auto texts_of = [] (const ISheet& sheet) {
+      std::ostringstream texts;
+      sheet.PrintTexts(texts);
+      return texts.str();
+    };
+
+    std::string expected;
+    {
+      Black::JournaledSheet sheet(dir);
+      sheet.SetCell("A1"_pos, "=B2+1");
+      sheet.SetCell("B2"_pos, "2");
+      sheet.InsertRows(0);
+      sheet.Checkpoint();
+      sheet.SetCell("C1"_pos, "text");
+      sheet.DeleteCols(1);
+      sheet.ClearCell("A2"_pos);
+      sheet.SetCell("A2"_pos, "=B3*2");
+      sheet.Sync();
+      expected = texts_of(sheet);
+    }
+    {
+      std::ofstream torn(dir / "journal-3.log", std::ios::binary | std::ios::app);
+      torn << "torn record";
+    }
+    {
+      Black::JournaledSheet sheet(dir);
+      ASSERT_EQUAL(texts_of(sheet), expected);
+      ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), ICell::Value(0.0));
+      sheet.Checkpoint();
+      sheet.SetCell("D4"_pos, "4");
+      expected = texts_of(sheet);
+    }
+    {
+      Black::JournaledSheet sheet(dir);
+      ASSERT_EQUAL(texts_of(sheet), expected);
+      sheet.Checkpoint();
+    }
+    // The journal started by the checkpoint is torn at its first record.
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+      if (entry.path().extension() == ".log") {
+        std::ofstream torn(entry.path(), std::ios::binary | std::ios::app);
+        torn << "torn!";
+      }
+    }
+    {
+      Black::JournaledSheet sheet(dir);
+      ASSERT_EQUAL(texts_of(sheet), expected);
+      sheet.SetCell("E5"_pos, "5");
+      sheet.SetCell("A1"_pos, "=E5*2");
+      sheet.Sync();
+      expected = texts_of(sheet);
+    }
+    {
+      Black::JournaledSheet sheet(dir);
+      ASSERT_EQUAL(texts_of(sheet), expected);
+      ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), ICell::Value(10.0));
+      sheet.ClearCell("E5"_pos);
+      sheet.Sync();
+      expected = texts_of(sheet);
+    }
+    {
+      Black::JournaledSheet sheet(dir);
+      ASSERT_EQUAL(texts_of(sheet), expected);
+    }
+    std::filesystem::remove_all(dir);
+  }
+
+  void TestSheetStats() {
+    Black::Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2+A1");
+    sheet.SetCell("A2"_pos, "=A1+2"); // A3 depends on A2, so A1 is checked for a cycle
+    sheet.GetCell("A3"_pos)->GetValue();
+    sheet.GetCell("A3"_pos)->GetValue();
+    sheet.DeleteRows(0);
+
+    const auto stats = sheet.GetStats();
+#ifdef BLACK_METRICS
+    ASSERT_EQUAL(stats[Black::Counter::Parses], 3u);
+    ASSERT_EQUAL(stats[Black::Counter::FormulaEvaluations], 2u);
+    ASSERT_EQUAL(stats[Black::Counter::CacheHits], 2u); // A1 read by A2, then by A3 and A3 itself
+    ASSERT_EQUAL(stats[Black::Counter::CycleCheckVisits], 1u);
+    ASSERT(stats[Black::Counter::StructuralCellsTouched] >= 3);
+#else
+    ASSERT_EQUAL(stats[Black::Counter::Parses], 0u);
+#endif
+
+    std::ostringstream output;
+    Black::WritePrometheus(output, stats);
+    ASSERT(output.str().find("# TYPE spreadsheet_cache_hits_total counter\nspreadsheet_cache_hits_total "
+                             + std::to_string(stats[Black::Counter::CacheHits]) + "\n") != std::string::npos);
+
+    const auto path = std::filesystem::temp_directory_path() / "black_stats_test.prom";
+    {
+      Black::PrometheusDumper dumper(sheet, path, std::chrono::hours(1));
+    }
+    std::ifstream dumped(path);
+    ASSERT_EQUAL(std::string(std::istreambuf_iterator<char>(dumped), {}), output.str());
+    dumped.close();
+    std::filesystem::remove(path);
+  }
+  void TestRecalculationTrace() {
+    Black::Sheet sheet;
+    Black::Tracer tracer;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.GetCell("A2"_pos)->GetValue();
+
+    sheet.SetTracer(&tracer);
+    sheet.InsertRows(0);
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A3*2");
+    sheet.GetCell("A3"_pos)->GetValue();
+    sheet.GetCell("A3"_pos)->GetValue();
+    sheet.SetTracer(nullptr);
+    sheet.GetCell("B1"_pos)->GetValue();
+
+    std::ostringstream output;
+    tracer.Write(output);
+    const auto trace = output.str();
+    auto find = [&] (const std::string& name, size_t start = 0) {
+      return trace.find("{\"name\": \"" + name + "\"", start);
+    };
+    ASSERT(trace.find("\"name\": \"InsertRows\", \"ph\": \"X\"") != std::string::npos);
+    ASSERT(trace.find("\"args\": {\"before\": 0, \"count\": 1}") != std::string::npos);
+    ASSERT(trace.find("\"name\": \"InvalidateCache A2\", \"ph\": \"i\"") != std::string::npos);
+    ASSERT(find("ParseFormula B1") != std::string::npos);
+    // Spans are written as they end: the inputs before the cells reading them.
+    ASSERT(find("GetValue A2") < find("Formula::Evaluate A3"));
+    ASSERT(find("Formula::Evaluate A3") < find("GetValue A3"));
+    ASSERT_EQUAL(find("GetValue A3", find("GetValue A3") + 1), std::string::npos);
+    ASSERT_EQUAL(find("GetValue B1"), std::string::npos);
+  }
+  void TestHotCellsProfile() {
+    Black::Sheet sheet;
+    Black::Profiler profiler;
+    sheet.SetProfiler(&profiler);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("B2"_pos, "=B1+A1");
+    sheet.SetCell("B3"_pos, "=B2+B1");
+    sheet.SetCell("C1"_pos, "=SUM(B1:B2)+B2");
+    sheet.GetCell("B3"_pos)->GetValue();
+    sheet.GetCell("C1"_pos)->GetValue();
+    sheet.SetCell("A1"_pos, "2");
+    sheet.GetCell("B3"_pos)->GetValue();
+    sheet.GetCell("C1"_pos)->GetValue();
+    sheet.GetCell("B3"_pos)->GetValue();
+
+    auto profiles = profiler.GetTop(sheet, 10);
+    ASSERT_EQUAL(profiles.size(), 4u);
+    for (size_t i = 1; i < profiles.size(); ++i) {
+      ASSERT(profiles[i - 1].exclusive >= profiles[i].exclusive);
+    }
+    std::sort(std::begin(profiles), std::end(profiles),
+              [] (const auto& lhs, const auto& rhs) { return lhs.pos < rhs.pos; });
+    ASSERT_EQUAL(profiles[0].pos, "B1"_pos);
+    ASSERT_EQUAL(profiles[0].dependents, 3u); // C1 only through its range
+    ASSERT_EQUAL(profiles[1].pos, "C1"_pos);
+    ASSERT_EQUAL(profiles[1].dependents, 0u);
+    ASSERT_EQUAL(profiles[2].expression, "B1+A1");
+    ASSERT_EQUAL(profiles[2].dependents, 2u); // C1 counted once for its range and B2
+    for (const auto& profile : profiles) {
+      ASSERT_EQUAL(profile.evaluations, 2u);
+      ASSERT(profile.exclusive <= profile.inclusive);
+    }
+    ASSERT(profiles[3].inclusive >= profiles[2].inclusive); // B3 waits for B2
+
+    ASSERT_EQUAL(profiler.GetTop(sheet, 1).size(), 1u);
+    std::ostringstream report;
+    profiler.WriteReport(report, sheet, 10);
+    ASSERT(report.str().find("=B1+A1\n") != std::string::npos);
+  }
+  void TestSheetMemoryUsage() {
+    Black::Sheet sheet;
+    const auto empty = sheet.MemoryUsage();
+    ASSERT_EQUAL(empty.cells, 0u);
+
+    const std::string long_text(1000, 'x');
+    sheet.SetCell("A1"_pos, long_text);
+    sheet.SetCell("B2"_pos, "=A1+C3*2");
+    auto usage = sheet.MemoryUsage();
+    ASSERT_EQUAL(usage.cells, 3 * sizeof(Black::Cell)); // C3 is created for the reference
+    ASSERT(usage.texts > long_text.size());
+    ASSERT(usage.formulas > sizeof(Black::Formula));
+    ASSERT(usage.references > 0);
+    ASSERT(usage.table > empty.table);
+    ASSERT_EQUAL(usage.value_caches, 0u);
+    ASSERT_EQUAL(usage.Total(), usage.table + usage.cells + usage.texts + usage.formulas
+                                + usage.references + usage.value_caches);
+
+    sheet.GetCell("A1"_pos)->GetValue();
+    ASSERT(sheet.MemoryUsage().value_caches > long_text.size());
+
+    sheet.ClearCell("A1"_pos);
+    sheet.ClearCell("B2"_pos);
+    usage = sheet.MemoryUsage();
+    ASSERT_EQUAL(usage.cells, 0u);
+    ASSERT_EQUAL(usage.texts, 0u);
+    ASSERT_EQUAL(usage.formulas, 0u);
+  }
+
+  void TestRangeReferences() {
+    const ICell::Value value_error = FormulaError(FormulaError::Category::Value);
+    const ICell::Value ref_error = FormulaError(FormulaError::Category::Ref);
+
+    Black::Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("E1"_pos, "=C3:B2+1");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=B2:C3+1");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), value_error);
+    ASSERT(sheet.GetCell("E1"_pos)->GetReferencedCells().empty());
+    ASSERT(!sheet.GetCell("B2"_pos)); // no cells are created for a range
+    ASSERT(sheet.HasRangeDependents("C2"_pos));
+    ASSERT(!sheet.HasRangeDependents("A1"_pos));
+
+    bool caught = false;
+    try {
+      sheet.SetCell("C2"_pos, "=E1");
+    } catch (const CircularDependencyException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+    caught = false;
+    try {
+      sheet.SetCell("B3"_pos, "=A1:B3");
+    } catch (const CircularDependencyException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+    sheet.SetCell("C2"_pos, "=A1");
+    caught = false;
+    try {
+      sheet.SetCell("A1"_pos, "=E1:F1"); // E1 refers to C2 through its range
+    } catch (const CircularDependencyException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+    sheet.SetCell("A1"_pos, "=F1:G1");
+    sheet.ClearCell("A1"_pos);
+
+    sheet.InsertRows(2, 2);
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=B2:C5+1");
+    sheet.InsertCols(0);
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetText(), "=C2:D5+1");
+    sheet.DeleteRows(1, 2);
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetText(), "=C2:D3+1");
+    sheet.InsertRows(100); // after the range
+    sheet.DeleteCols(2);
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=C2:C3+1");
+    ASSERT(sheet.HasRangeDependents("C3"_pos));
+    ASSERT(!sheet.HasRangeDependents("D3"_pos));
+
+    sheet.SetCell("A10"_pos, "=A20:B30");
+    sheet.DeleteRows(24, 20); // the range reaches beyond the table
+    ASSERT_EQUAL(sheet.GetCell("A10"_pos)->GetText(), "=A20:B24");
+    sheet.DeleteRows(19, 5);
+    ASSERT_EQUAL(sheet.GetCell("A10"_pos)->GetText(), "=" + ToString(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetCell("A10"_pos)->GetValue(), ref_error);
+
+    const auto path = std::filesystem::temp_directory_path() / "black_range_snapshot_test.bin";
+    Black::SaveSnapshot(sheet, path);
+    Black::Sheet loaded;
+    Black::LoadSnapshot(path, loaded);
+    std::filesystem::remove(path);
+    std::ostringstream texts, loaded_texts;
+    sheet.PrintTexts(texts);
+    loaded.PrintTexts(loaded_texts);
+    ASSERT_EQUAL(loaded_texts.str(), texts.str());
+    ASSERT(loaded.HasRangeDependents("C2"_pos));
+  }
+
+  void TestAggregateFunctions() {
+    const ICell::Value value_error = FormulaError(FormulaError::Category::Value);
+    auto isIncorrect = [](std::string expression) {
+      try {
+        ParseFormula(std::move(expression));
+      } catch (const FormulaException&) {
+        return true;
+      }
+      return false;
+    };
+    ASSERT(isIncorrect("SUM()"));
+    ASSERT(isIncorrect("NOSUCH(A1)"));
+    ASSERT(isIncorrect("SUM(A1"));
+    ASSERT_EQUAL(ParseFormula("-SUM( A1:B2 , 2*C3 )")->GetExpression(), "-SUM(A1:B2,2*C3)");
+
+    Black::Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2.5");
+    sheet.SetCell("A4"_pos, "=A1*4");
+    sheet.SetCell("B1"_pos, "=SUM(A1:A10)");
+    sheet.SetCell("B2"_pos, "=AVERAGE(A1:A10)");
+    sheet.SetCell("B3"_pos, "=MIN(A1:A10,3)");
+    sheet.SetCell("B4"_pos, "=MAX(A1:A10)+COUNT(A1:A10,C1)");
+    sheet.SetCell("B5"_pos, "=SUMPRODUCT(A1:A4,A1:A4)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(7.5));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), ICell::Value(2.5)); // empty cells aren't counted
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), ICell::Value(1.0));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), ICell::Value(4.0 + 3));
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), ICell::Value(1 + 6.25 + 16));
+
+    sheet.SetCell("A3"_pos, "text");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), value_error);
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), value_error);
+    sheet.SetCell("B4"_pos, "=COUNT(A1:A10,1/0)");
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), ICell::Value(3.0));
+    sheet.SetCell("A3"_pos, "'12");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(19.5));
+    sheet.ClearCell("A3"_pos);
+    sheet.SetCell("A2"_pos, "=A1/0");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(FormulaError(FormulaError::Category::Div0)));
+    sheet.ClearCell("A2"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(5.0));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), ICell::Value(1.0));
+    sheet.SetCell("B6"_pos, "=MIN(C1:C5)+AVERAGE(C1)");
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), ICell::Value(FormulaError(FormulaError::Category::Div0)));
+
+    sheet.InsertRows(1); // inside the ranges, A1:A4 becomes A1:A5
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetText(), "=SUMPRODUCT(A1:A5,A1:A5)");
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), ICell::Value(17.0));
+    sheet.SetCell("B7"_pos, "=SUMPRODUCT(A1:A5,B1:B4)");
+    ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetValue(), value_error);
+
+    bool caught = false;
+    try {
+      sheet.SetCell("A7"_pos, "=SUM(B1:B2)"); // B1 sums A7
+    } catch (const CircularDependencyException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+
+    const auto path = std::filesystem::temp_directory_path() / "black_functions_snapshot_test.bin";
+    Black::SaveSnapshot(sheet, path);
+    Black::Sheet loaded;
+    Black::LoadSnapshot(path, loaded);
+    std::filesystem::remove(path);
+    std::ostringstream texts, loaded_texts, values, loaded_values;
+    sheet.PrintTexts(texts);
+    loaded.PrintTexts(loaded_texts);
+    ASSERT_EQUAL(loaded_texts.str(), texts.str());
+    sheet.PrintValues(values);
+    loaded.PrintValues(loaded_values);
+    ASSERT_EQUAL(loaded_values.str(), values.str());
+  }
+
+  void TestIncrementalAggregates() {
+    Black::Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+      sheet.SetCell({row, 0}, std::to_string(row));
+    }
+    const std::vector<Position> aggregates = {"B1"_pos, "B2"_pos, "B3"_pos, "B4"_pos, "B5"_pos};
+    sheet.SetCell("B1"_pos, "=SUM(A1:A100)");
+    sheet.SetCell("B2"_pos, "=AVERAGE(A1:A100)");
+    sheet.SetCell("B3"_pos, "=MIN(A1:A100)");
+    sheet.SetCell("B4"_pos, "=MAX(A1:A100)");
+    sheet.SetCell("B5"_pos, "=COUNT(A1:A100)");
+    auto value = [&] (Position pos) { return sheet.GetCell(pos)->GetValue(); };
+    ASSERT_EQUAL(value("B1"_pos), ICell::Value(4950.0));
+    ASSERT_EQUAL(value("B3"_pos), ICell::Value(0.0));
+    ASSERT_EQUAL(value("B4"_pos), ICell::Value(99.0));
+    for (auto pos : aggregates) {
+      value(pos);
+    }
+    const auto built = sheet.GetStats();
+
+    sheet.SetCell("A1"_pos, "1000");
+    ASSERT_EQUAL(value("B1"_pos), ICell::Value(5950.0));
+    ASSERT_EQUAL(value("B3"_pos), ICell::Value(1.0));
+    ASSERT_EQUAL(value("B4"_pos), ICell::Value(1000.0));
+    sheet.ClearCell("A100"_pos);
+    ASSERT_EQUAL(value("B2"_pos), ICell::Value(5851.0 / 99));
+    ASSERT_EQUAL(value("B5"_pos), ICell::Value(99.0));
+    sheet.SetCell("D1"_pos, "3");
+    sheet.SetCell("A50"_pos, "=D1*2"); // formula cells are read on evaluation
+    ASSERT_EQUAL(value("B1"_pos), ICell::Value(5851.0 - 49 + 6));
+    sheet.SetCell("D1"_pos, "-4");
+    ASSERT_EQUAL(value("B1"_pos), ICell::Value(5851.0 - 49 - 8));
+    ASSERT_EQUAL(value("B3"_pos), ICell::Value(-8.0));
+    sheet.SetCell("A2"_pos, "text");
+    ASSERT_EQUAL(value("B3"_pos), ICell::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(value("B5"_pos), ICell::Value(98.0));
+    sheet.SetCell("A3"_pos, "inf");
+    ASSERT_EQUAL(value("B5"_pos), ICell::Value(98.0)); // still a number
+    sheet.SetCell("A2"_pos, "2");
+    ASSERT_EQUAL(value("B1"_pos), ICell::Value(FormulaError(FormulaError::Category::Div0)));
+    ASSERT_EQUAL(value("B4"_pos), ICell::Value(FormulaError(FormulaError::Category::Div0)));
+    sheet.SetCell("A3"_pos, "2");
+    ASSERT_EQUAL(value("B4"_pos), ICell::Value(1000.0));
+#ifdef BLACK_METRICS
+    const auto stats = sheet.GetStats();
+    ASSERT_EQUAL(stats[Black::Counter::RangeCacheBuilds], built[Black::Counter::RangeCacheBuilds]);
+    ASSERT(stats[Black::Counter::RangeCacheUpdates] > built[Black::Counter::RangeCacheUpdates]);
+#else
+    ASSERT_EQUAL(built[Black::Counter::RangeCacheBuilds], 0u);
+#endif
+
+    // The same formulas built from scratch after edits resizing the ranges.
+    sheet.InsertRows(10);
+    sheet.SetCell("A11"_pos, "7");
+    sheet.DeleteRows(95, 10);
+    sheet.SetCell("A20"_pos, "0.1");
+    for (auto pos : aggregates) {
+      const Position copy{pos.row, 2};
+      sheet.SetCell(copy, sheet.GetCell(pos)->GetText());
+      ASSERT_EQUAL(value(copy), value(pos));
+    }
+
+    // Sums are exact, so they don't depend on what the cells held before.
+    Black::Sheet exact;
+    exact.SetCell("A1"_pos, "1e20");
+    exact.SetCell("A2"_pos, "1");
+    exact.SetCell("B1"_pos, "=SUM(A1:A3)");
+    ASSERT_EQUAL(exact.GetCell("B1"_pos)->GetValue(), ICell::Value(1e20));
+    exact.SetCell("A1"_pos, "0.1");
+    exact.SetCell("A2"_pos, "0.2");
+    exact.SetCell("A3"_pos, "0.3");
+    ASSERT_EQUAL(exact.GetCell("B1"_pos)->GetValue(), ICell::Value(0.6));
+    exact.SetCell("A1"_pos, "0.3");
+    exact.SetCell("A3"_pos, "0.1");
+    ASSERT_EQUAL(exact.GetCell("B1"_pos)->GetValue(), ICell::Value(0.6));
+  }
+
+  void TestNumericColumns() {
+    using Kind = Black::NumericColumn::Kind;
+    Black::NumericColumn column;
+    column.Set(3, Kind::Number, 2.5);
+    column.Set(70, Kind::Formula);
+    column.Set(64, Kind::Error);
+    column.Set(200, Kind::Empty); // nothing to store
+    ASSERT_EQUAL(column.Size(), 71);
+    ASSERT(column.GetKind(3) == Kind::Number);
+    ASSERT(column.GetKind(4) == Kind::Empty);
+    ASSERT(column.GetKind(200) == Kind::Empty);
+    ASSERT_EQUAL(column.Numbers()[3], 2.5);
+    ASSERT_EQUAL(column.Numbers()[64], 0.0);
+    ASSERT_EQUAL(column.CountNumbers(0, 71), 1u);
+    ASSERT_EQUAL(column.CountNumbers(4, 71), 0u);
+    std::vector<std::pair<int, Kind>> others;
+    column.ForEachOther(0, 100, [&] (int row, Kind kind) { others.emplace_back(row, kind); });
+    ASSERT(others == (std::vector<std::pair<int, Kind>>{{64, Kind::Error}, {70, Kind::Formula}}));
+    others.clear();
+    column.ForEachOther(65, 70, [&] (int row, Kind kind) { others.emplace_back(row, kind); });
+    ASSERT(others.empty());
+    column.Set(3, Kind::Error);
+    ASSERT_EQUAL(column.Numbers()[3], 0.0);
+    ASSERT_EQUAL(column.CountNumbers(0, 71), 0u);
+
+    // Physical rows out of logical order and reused after row edits.
+    Black::Sheet sheet;
+    for (int row = 0; row < 200; ++row) {
+      sheet.SetCell({row, 0}, std::to_string(row + 1));
+      sheet.SetCell({row, 1}, "2");
+    }
+    sheet.SetCell("D1"_pos, "=SUMPRODUCT(A1:A200,B1:B200)");
+    sheet.SetCell("D2"_pos, "=SUM(A1:B200)");
+    sheet.SetCell("D3"_pos, "=MAX(A1:A200)");
+    auto value = [&] (Position pos) { return sheet.GetCell(pos)->GetValue(); };
+    ASSERT_EQUAL(value("D1"_pos), ICell::Value(40200.0));
+    sheet.InsertRows(50, 3);
+    sheet.SetCell("A51"_pos, "1000");
+    sheet.SetCell("B51"_pos, "1");
+    sheet.DeleteRows(100, 20);
+    sheet.SetCell("A250"_pos, "5");
+    sheet.SetCell("A251"_pos, "6");
+    sheet.SetCell("B10"_pos, "=A10*0+3");
+    sheet.ClearCell("A20"_pos);
+    double sum = 0;
+    double sum_products = 0;
+    auto number = [&] (Position pos) {
+      const auto* cell = sheet.GetCell(pos);
+      if (!cell || cell->GetText().empty()) {
+        return 0.0;
+      }
+      const auto cell_value = cell->GetValue();
+      const auto* text = std::get_if<std::string>(&cell_value);
+      return text ? std::stod(*text) : std::get<double>(cell_value);
+    };
+    for (int row = 0; row < 183; ++row) {
+      sum += number({row, 0}) + number({row, 1});
+      sum_products += number({row, 0}) * number({row, 1});
+    }
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=SUMPRODUCT(A1:A183,B1:B183)");
+    ASSERT_EQUAL(value("D1"_pos), ICell::Value(sum_products));
+    ASSERT_EQUAL(value("D2"_pos), ICell::Value(sum));
+    ASSERT_EQUAL(value("D3"_pos), ICell::Value(1000.0));
+
+    // The first error row by row, whichever column it is in.
+    Black::Sheet errors;
+    for (int row = 0; row < 3; ++row) {
+      errors.SetCell({row, 0}, std::to_string(row + 1));
+      errors.SetCell({row, 1}, "1");
+    }
+    errors.SetCell("C1"_pos, "=SUMPRODUCT(A1:A3,B1:B3)");
+    ASSERT_EQUAL(errors.GetCell("C1"_pos)->GetValue(), ICell::Value(6.0));
+    errors.SetCell("A3"_pos, "=1/0");
+    ASSERT_EQUAL(errors.GetCell("C1"_pos)->GetValue(), ICell::Value(FormulaError(FormulaError::Category::Div0)));
+    errors.SetCell("B2"_pos, "y");
+    ASSERT_EQUAL(errors.GetCell("C1"_pos)->GetValue(), ICell::Value(FormulaError(FormulaError::Category::Value)));
+    errors.ClearCell("B2"_pos);
+    errors.SetCell("A3"_pos, "3");
+    ASSERT_EQUAL(errors.GetCell("C1"_pos)->GetValue(), ICell::Value(4.0));
+  }
+
+  void TestLookupFunctions() {
+    const ICell::Value na = FormulaError(FormulaError::Category::NA);
+    ASSERT_EQUAL(FormulaError(FormulaError::Category::NA).ToString(), "#N/A");
+    auto isIncorrect = [](std::string expression) {
+      try {
+        ParseFormula(std::move(expression));
+      } catch (const FormulaException&) {
+        return true;
+      }
+      return false;
+    };
+    ASSERT(isIncorrect("MATCH(1)"));
+    ASSERT(isIncorrect("VLOOKUP(1,A1:B2,2,0,1)"));
+
+    Black::Sheet sheet;
+    const std::vector<std::string> keys = {"30", "10", "text", "20", "10", "", "=A1+10"};
+    for (int row = 0; row < int(keys.size()); ++row) {
+      sheet.SetCell({row, 0}, keys[row]);
+      sheet.SetCell({row, 1}, std::to_string(100 + row));
+    }
+    auto value = [&] (std::string formula) {
+      sheet.SetCell("D1"_pos, "=" + formula);
+      return sheet.GetCell("D1"_pos)->GetValue();
+    };
+    ASSERT_EQUAL(value("MATCH(10,A1:A7,0)"), ICell::Value(2.0));
+    ASSERT_EQUAL(value("MATCH(10,A3:A7,0)"), ICell::Value(3.0));
+    ASSERT_EQUAL(value("MATCH(40,A1:A7,0)"), ICell::Value(7.0)); // the formula cell
+    ASSERT_EQUAL(value("MATCH(25,A1:A7,0)"), na);
+    ASSERT_EQUAL(value("MATCH(25,A1:A7)"), ICell::Value(4.0));
+    ASSERT_EQUAL(value("MATCH(25,A1:A7,-1)"), ICell::Value(1.0));
+    ASSERT_EQUAL(value("MATCH(5,A1:A7,1)"), na);
+    ASSERT_EQUAL(value("MATCH(100,A1:A7,1)"), ICell::Value(7.0));
+    ASSERT_EQUAL(value("MATCH(100,A1:C1,0)"), ICell::Value(2.0)); // a row
+    ASSERT_EQUAL(value("MATCH(10,A1:B7,0)"), na);
+    ASSERT_EQUAL(value("MATCH(10,3,0)"), ICell::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(value("VLOOKUP(20,A1:B7,2,0)"), ICell::Value(103.0));
+    ASSERT_EQUAL(value("VLOOKUP(15,A1:B7,2)"), ICell::Value(101.0));
+    ASSERT_EQUAL(value("VLOOKUP(20,A1:B7,3,0)"), ICell::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT_EQUAL(value("VLOOKUP(20,A1:B7,0,0)"), ICell::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(value("VLOOKUP(1/0,A1:B7,2,0)"), ICell::Value(FormulaError(FormulaError::Category::Div0)));
+
+    // The indexes follow the edits of the column.
+    sheet.SetCell("E1"_pos, "=MATCH(10,A1:A7,0)");
+    sheet.SetCell("E2"_pos, "=VLOOKUP(35,A1:B7,2)");
+    auto cell_value = [&] (Position pos) { return sheet.GetCell(pos)->GetValue(); };
+    ASSERT_EQUAL(cell_value("E1"_pos), ICell::Value(2.0));
+    ASSERT_EQUAL(cell_value("E2"_pos), ICell::Value(100.0));
+    sheet.ClearCell("A2"_pos);
+    ASSERT_EQUAL(cell_value("E1"_pos), ICell::Value(5.0));
+    sheet.SetCell("A3"_pos, "10");
+    sheet.SetCell("A6"_pos, "35");
+    ASSERT_EQUAL(cell_value("E1"_pos), ICell::Value(3.0));
+    ASSERT_EQUAL(cell_value("E2"_pos), ICell::Value(105.0));
+    sheet.SetCell("A1"_pos, "25"); // A7 follows
+    ASSERT_EQUAL(cell_value("E2"_pos), ICell::Value(105.0));
+    sheet.ClearCell("A6"_pos);
+    ASSERT_EQUAL(cell_value("E2"_pos), ICell::Value(106.0));
+    sheet.InsertRows(0);
+    sheet.SetCell("A1"_pos, "10");
+    ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetText(), "=MATCH(10,A2:A8,0)");
+    ASSERT_EQUAL(cell_value("E2"_pos), ICell::Value(3.0));
+    ASSERT_EQUAL(cell_value("E3"_pos), ICell::Value(106.0));
+
+    // Every lookup into a column shares its index.
+    Black::Sheet table;
+    for (int row = 0; row < 1000; ++row) {
+      table.SetCell({row, 0}, std::to_string(row * 2));
+      table.SetCell({row, 1}, std::to_string(row));
+    }
+    for (int row = 0; row < 100; ++row) {
+      table.SetCell({row, 2}, "=VLOOKUP(" + std::to_string(row * 20) + ",A1:B1000,2,0)");
+    }
+    for (int row = 0; row < 100; ++row) {
+      ASSERT_EQUAL(table.GetCell({row, 2})->GetValue(), ICell::Value(row * 10.0));
+    }
+#ifdef BLACK_METRICS
+    ASSERT_EQUAL(table.GetStats()[Black::Counter::LookupIndexBuilds], 1u);
+#endif
+  }
+
+  void TestLookupIndex() {
+    using Kind = Black::LookupIndex::Kind;
+    using Entry = Black::LookupIndex::Entry;
+    // A low-cardinality column over several blocks, checked against a scan.
+    constexpr int kRows = 1000;
+    std::vector<double> numbers(kRows, std::nan(""));
+    std::vector<Entry> entries;
+    for (int row = 0; row < kRows; row += 1 + row % 3) {
+      numbers[row] = (row * 7919) % 5;
+      entries.push_back({numbers[row], row});
+    }
+    Black::LookupIndex index({});
+    index.Build(Kind::Exact, entries);
+    index.Build(Kind::Ordered, entries);
+    for (int row = 0; row < kRows; row += 17) {
+      using NumberKind = Black::NumericColumn::Kind;
+      const auto old_kind = std::isnan(numbers[row]) ? NumberKind::Empty : NumberKind::Number;
+      index.Update(row, old_kind, numbers[row], NumberKind::Number, row % 7 - 1);
+      numbers[row] = row % 7 - 1;
+    }
+
+    auto scan = [&] (double number, int first_row, int last_row, int sign) {
+      std::optional<Entry> best;
+      for (int row = first_row; row <= last_row; ++row) {
+        const double found = numbers[row];
+        if (!std::isnan(found) && (sign ? (found - number) * sign >= 0 : found == number)
+            && (!best || (found - best->number) * sign < 0)) {
+          best = Entry{found, row};
+        }
+      }
+      return best;
+    };
+    auto equal = [] (const std::optional<Entry>& lhs, const std::optional<Entry>& rhs) {
+      return lhs.has_value() == rhs.has_value() && (!lhs || (lhs->number == rhs->number && lhs->row == rhs->row));
+    };
+    for (const auto& [first_row, last_row] : {std::pair{0, kRows - 1}, {300, 400}, {256, 511}, {10, 20}, {700, 2000}}) {
+      for (double number = -2; number <= 6; number += 0.5) {
+        const int last = std::min(last_row, kRows - 1);
+        const auto first = index.FindFirst(number, first_row, last_row);
+        const auto expected = scan(number, first_row, last, 0);
+        ASSERT_EQUAL(first.value_or(-1), expected ? expected->row : -1);
+        ASSERT(equal(index.FindNotAbove(number, first_row, last_row), scan(number, first_row, last, -1)));
+        ASSERT(equal(index.FindNotBelow(number, first_row, last_row), scan(number, first_row, last, 1)));
+      }
+    }
+  }
+
+  void TestConditionalFunctions() {
+    auto isIncorrect = [](std::string expression) {
+      try {
+        ParseFormula(std::move(expression));
+      } catch (const FormulaException&) {
+        return true;
+      }
+      return false;
+    };
+    ASSERT(isIncorrect("IF(1)"));
+    ASSERT(isIncorrect("IFERROR(1,2,3)"));
+    ASSERT(isIncorrect("1<"));
+    ASSERT(isIncorrect("1=<2"));
+
+    auto expression = [](std::string text) { return ParseFormula(std::move(text))->GetExpression(); };
+    ASSERT_EQUAL(expression("A1 + 1 >= B2 * 2"), "A1+1>=B2*2");
+    ASSERT_EQUAL(expression("(A1=1)+(2<>3)"), "(A1=1)+(2<>3)");
+    ASSERT_EQUAL(expression("(1<2)<3"), "1<2<3");
+    ASSERT_EQUAL(expression("1<(2<3)"), "1<(2<3)");
+    ASSERT_EQUAL(expression("-(1>2)"), "-(1>2)");
+    ASSERT_EQUAL(expression("IF(A1<=0,-A1,A1)"), "IF(A1<=0,-A1,A1)");
+
+    Black::Sheet sheet;
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("A2"_pos, "text");
+    auto value = [&] (std::string formula) {
+      sheet.SetCell("D1"_pos, "=" + formula);
+      return sheet.GetCell("D1"_pos)->GetValue();
+    };
+    const ICell::Value div0 = FormulaError(FormulaError::Category::Div0);
+    ASSERT_EQUAL(value("A1=3"), ICell::Value(1.0));
+    ASSERT_EQUAL(value("A1<>3"), ICell::Value(0.0));
+    ASSERT_EQUAL(value("A1<4"), ICell::Value(1.0));
+    ASSERT_EQUAL(value("A1<=2"), ICell::Value(0.0));
+    ASSERT_EQUAL(value("A1>B1"), ICell::Value(1.0)); // an empty cell is 0
+    ASSERT_EQUAL(value("A1>=1/0"), div0);
+    ASSERT_EQUAL(value("1+1=2*1"), ICell::Value(1.0));
+    ASSERT_EQUAL(value("IF(A1>2,10,20)"), ICell::Value(10.0));
+    ASSERT_EQUAL(value("IF(A1>5,10,20)"), ICell::Value(20.0));
+    ASSERT_EQUAL(value("IF(A1>5,10)"), ICell::Value(0.0));
+    ASSERT_EQUAL(value("IF(A2,10,20)"), ICell::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(value("IF(A1,10,1/0)"), ICell::Value(10.0));
+    ASSERT_EQUAL(value("AND(A1,1,2)"), ICell::Value(1.0));
+    ASSERT_EQUAL(value("AND(A1,0,1/0)"), ICell::Value(0.0));
+    ASSERT_EQUAL(value("AND(A1,1/0,0)"), div0);
+    ASSERT_EQUAL(value("OR(0,B1,A1>2)"), ICell::Value(1.0));
+    ASSERT_EQUAL(value("OR(0,B1)"), ICell::Value(0.0));
+    ASSERT_EQUAL(value("OR(1,A2)"), ICell::Value(1.0));
+    ASSERT_EQUAL(value("IFERROR(A1/B1,-1)"), ICell::Value(-1.0));
+    ASSERT_EQUAL(value("IFERROR(A1/2,-1)"), ICell::Value(1.5));
+    ASSERT_EQUAL(value("IFERROR(A2+1,A1:A2)"), ICell::Value(FormulaError(FormulaError::Category::Value)));
+
+    // Every argument is referenced, only the taken branch is computed.
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("B2"_pos, "=A1*3");
+    sheet.SetCell("C1"_pos, "=IF(A1>0,B1,B2)");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetReferencedCells(), (std::vector<Position>{"A1"_pos, "B1"_pos, "B2"_pos}));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(6.0));
+    sheet.SetCell("A1"_pos, "-1");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(-3.0));
+    sheet.SetCell("A1"_pos, "2");
+    [[maybe_unused]] const auto stats = sheet.GetStats();
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(4.0));
+#ifdef BLACK_METRICS
+    // C1 and B1, B2 stays stale.
+    ASSERT_EQUAL(sheet.GetStats()[Black::Counter::FormulaEvaluations] - stats[Black::Counter::FormulaEvaluations], 2u);
+#endif
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), ICell::Value(6.0));
+    bool caught = false;
+    try {
+      sheet.SetCell("B2"_pos, "=IF(0,C1,1)");
+    } catch (const CircularDependencyException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+  }
+
+  void TestFunctionRegistry() {
+    using namespace Black::FormulaAst;
+    ASSERT_EQUAL(GetFunction(Function::VLookup).name, "VLOOKUP");
+    ASSERT(FindFunction("IFERROR") == &GetFunction(Function::IfError));
+    ASSERT(!FindFunction("CLAMP"));
+
+    // CLAMP(value, low, high) of an application.
+    constexpr FunctionInfo kClamp = {"CLAMP", 3, 3, Black::RangeCache::Aggregates::None,
+      [] (Args args, const ISheet& sheet) -> IFormula::Value {
+        double values[3];
+        for (size_t i = 0; i < args.size(); ++i) {
+          const auto value = args[i]->Evaluate(sheet);
+          if (const auto* error = std::get_if<FormulaError>(&value)) {
+            return *error;
+          }
+          values[i] = std::get<double>(value);
+        }
+        return std::min(std::max(values[0], values[1]), values[2]);
+      }
+    };
+    static_assert(IsValidFunction(kClamp));
+    static_assert(!IsValidFunction({"CLAMP2", 1, 1, Black::RangeCache::Aggregates::None, kClamp.impl}));
+    static_assert(!IsValidFunction({"CLAMP", 2, 1, Black::RangeCache::Aggregates::None, kClamp.impl}));
+
+    Black::Sheet sheet;
+    bool caught = false;
+    try {
+      sheet.SetCell("A1"_pos, "=CLAMP(B1,0,10)");
+    } catch (const FormulaException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+
+    RegisterFunction(kClamp);
+    auto throws = [] (const FunctionInfo& info) {
+      try {
+        RegisterFunction(info);
+      } catch (const FormulaException&) {
+        return true;
+      }
+      return false;
+    };
+    ASSERT(throws(kClamp));
+    ASSERT(throws({"SUM", 1, 1, Black::RangeCache::Aggregates::None, kClamp.impl}));
+    ASSERT(throws({"", 1, 1, Black::RangeCache::Aggregates::None, kClamp.impl}));
+    ASSERT(throws({"NOIMPL", 1, 1, Black::RangeCache::Aggregates::None, nullptr}));
+
+    sheet.SetCell("A1"_pos, "=CLAMP(B1 ,0,10)*2");
+    sheet.SetCell("B1"_pos, "12");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=CLAMP(B1,0,10)*2");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), ICell::Value(20.0));
+    sheet.SetCell("B1"_pos, "-3");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), ICell::Value(0.0));
+    caught = false;
+    try {
+      sheet.SetCell("A2"_pos, "=CLAMP(1,2)");
+    } catch (const FormulaException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+
+    // Rebuilding from tokens, as snapshots do, binds the call again.
+    const auto parsed = Black::ParseFormula("SUM(A1:A2)+CLAMP(5,1,B1)");
+    const auto tokens = parsed->GetTokens();
+    const auto rebuilt = Black::BuildFormula(tokens.data(), tokens.data() + tokens.size());
+    ASSERT_EQUAL(rebuilt->GetExpression(), "SUM(A1:A2)+CLAMP(5,1,B1)");
+    ASSERT_EQUAL(std::get<double>(rebuilt->Evaluate(sheet)), -3.0);
+  }
+
+  void TestAggregateKernels() {
+    using namespace Black::Kernels;
+    std::vector<double> left, right;
+    for (int i = 0; i < 1003; ++i) {
+      left.push_back(std::sin(i) * 1e3);
+      right.push_back(1.0 / (i + 1));
+    }
+    const auto& scalar = GetKernels(Isa::Scalar);
+    for (auto isa : {Isa::Sse2, Isa::Avx2}) {
+      if (!IsSupported(isa)) {
+        continue;
+      }
+      const auto& kernels = GetKernels(isa);
+      for (size_t count : {size_t(0), size_t(5), size_t(8), left.size()}) {
+        SumState expected, actual;
+        scalar.sum(left.data(), count, expected);
+        kernels.sum(left.data(), count, actual);
+        ASSERT_EQUAL(actual.Total(), expected.Total()); // bit for bit
+        scalar.sum_products(left.data(), right.data(), count, expected);
+        kernels.sum_products(left.data(), right.data(), count, actual);
+        ASSERT_EQUAL(actual.Total(), expected.Total());
+        ASSERT_EQUAL(kernels.min(left.data(), count, 0), scalar.min(left.data(), count, 0));
+        ASSERT_EQUAL(kernels.max(left.data(), count, 0), scalar.max(left.data(), count, 0));
+      }
+    }
+  }
 }
 
 int main() {
@@ -595,5 +1753,31 @@ int main() {
   RUN_TEST(tr, TestCellReferences);
   RUN_TEST(tr, TestFormulaIncorrect);
   RUN_TEST(tr, TestCellCircularReferences);
+  RUN_TEST(tr, TestCellValueUpdatedThroughChain);
+  RUN_TEST(tr, TestCellValueThroughDeepChain);
+  RUN_TEST(tr, TestCellValueUpdatedThroughHub);
+  RUN_TEST(tr, TestCellValueAfterStructuralChanges);
+  RUN_TEST(tr, TestStorageReusesFreedRowsAndCols);
+  RUN_TEST(tr, TestStructuralEditsOfDependents);
+  RUN_TEST(tr, TestDeletedFormulaReleasesReferences);
+  RUN_TEST(tr, TestPrintableSizeAfterEdits);
+  RUN_TEST(tr, TestPrintValuesNumberFormat);
+  RUN_TEST(tr, TestParallelExport);
+  RUN_TEST(tr, TestImportTsv);
+  RUN_TEST(tr, TestSnapshotRoundTrip);
+  RUN_TEST(tr, TestJournalRecovery);
+  RUN_TEST(tr, TestSheetStats);
+  RUN_TEST(tr, TestRecalculationTrace);
+  RUN_TEST(tr, TestHotCellsProfile);
+  RUN_TEST(tr, TestSheetMemoryUsage);
+  RUN_TEST(tr, TestRangeReferences);
+  RUN_TEST(tr, TestAggregateFunctions);
+  RUN_TEST(tr, TestAggregateKernels);
+  RUN_TEST(tr, TestIncrementalAggregates);
+  RUN_TEST(tr, TestNumericColumns);
+  RUN_TEST(tr, TestLookupFunctions);
+  RUN_TEST(tr, TestLookupIndex);
+  RUN_TEST(tr, TestConditionalFunctions);
+  RUN_TEST(tr, TestFunctionRegistry);
   return 0;
 }